@@ -78,7 +78,9 @@ void CameraWebServer_AP::CameraWebServer_AP_Init(void)
   if(config.pixel_format == PIXFORMAT_JPEG){
     if(psramFound()){
       config.jpeg_quality = 10;
-      config.fb_count = 2;
+      // one buffer being filled, one ready for the next grab, one lent to
+      // camera_hub (CAMERA_FB_LENT); the hub copies frames out beyond that
+      config.fb_count = 3;
       config.grab_mode = CAMERA_GRAB_LATEST;
     } else {
       // Limit the frame size when PSRAM is not available
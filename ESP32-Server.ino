@@ -10,6 +10,7 @@
 #include "CameraWebServer_AP.h"
 #include <WiFi.h>
 #include "esp_camera.h"
+#include "car_serial.h"
 WiFiServer server(100);
 
 #define RXD2 3
@@ -28,44 +29,35 @@ String makeId(const char prefix) {
   return String(buf);
 }
 
-// Wait for an ack of form {<id>_ok} up to timeoutMs.
-// Returns true if ack received, false on timeout or errored response.
-bool waitForAck(const String &id, unsigned long timeoutMs = 1000) {
-  unsigned long start = millis();
-  String frame = "";
-  if(Serial2.available()){
-    frame = Serial2.readString();
-    if (frame == ("{" + id + "_ok}")) {
-      return true;
-    }
-  } 
-  return false;
+// Frames from the car that no command waits for, queued by the car link's
+// reader task: the factory test probes for FactoryTest, everything else
+// (replies to the TCP bridge) for SocketServer_Test.
+car_frame_queue_t bridgeFrames;
+car_frame_queue_t factoryFrames;
+
+// Send a command; with waitAck, wait up to timeoutMs for {<id>_ok}.
+bool sendCommand(const car_cmd_t &cmd, bool waitAck, unsigned long timeoutMs = 1000) {
+  if (!waitAck) return car_link_submit(&car_link, &cmd, timeoutMs, NULL, NULL) == CAR_OK;
+  return car_link_call(&car_link, &cmd, timeoutMs, NULL) == CAR_OK;
+}
+
+// Stop ahead of any queued motion and flush it (car_link_preempt).
+void sendStop() {
+  car_cmd_t stop = car_cmd_stop();
+  car_link_preempt(&car_link, &stop, 0, NULL);
 }
 
 // Send a move (meters as float) and optionally wait for ack.
 bool sendMoveMeters(float meters, bool waitAck = true) {
   uint16_t cm = (uint16_t)round(meters * 100.0f); // convert to cm
   String id = makeId('m');
-  // Build JSON frame manually (no spaces)
-  Serial2.print("{\"N\":200,\"D1\":1,\"D2\":");
-  Serial2.print(cm);
-  Serial2.print(",\"H\":\"");
-  Serial2.print(id);
-  Serial2.print("\"}");
-  if (waitAck) return waitForAck(id, 1000);
-  return true;
+  return sendCommand(car_cmd_move(1, cm, id.c_str()), waitAck);
 }
 
 // Send a turn (degrees) and optionally wait for ack.
 bool sendTurnDegrees(int degrees, bool waitAck = true) {
   String id = makeId('t');
-  Serial2.print("{\"N\":201,\"D1\":");
-  Serial2.print(degrees);
-  Serial2.print(",\"H\":\"");
-  Serial2.print(id);
-  Serial2.print("\"}");
-  if (waitAck) return waitForAck(id, 1000);
-  return true;
+  return sendCommand(car_cmd_turn(degrees, id.c_str()), waitAck);
 }
 
 void SocketServer_Test(void)
@@ -77,8 +69,11 @@ void SocketServer_Test(void)
     WA_en = true;
     ED_client = true;
     Serial.println("[Client connected]");
+    car_frame_t stale;
+    while (car_frame_queue_pop(&bridgeFrames, &stale)) //丢弃连接前车模发来的帧
+    {
+    }
     String readBuff;
-    String sendBuff;
     uint8_t Heartbeat_count = 0;
     bool Heartbeat_status = false;
     bool data_begin = true;
@@ -105,22 +100,17 @@ void SocketServer_Test(void)
           }
           else
           {
-            Serial2.print(readBuff);
+            car_link_write(&car_link, readBuff.c_str(), readBuff.length());
           }
           //Serial2.print(readBuff);
           readBuff = "";
         }
       }
-      if (Serial2.available())
+      car_frame_t frame;
+      if (car_frame_queue_pop(&bridgeFrames, &frame)) //车模发来的完整帧
       {
-        char c = Serial2.read();
-        sendBuff += c;
-        if (c == '}') //接收到结束字符
-        {
-          client.print(sendBuff);
-          Serial.print(sendBuff); //从串口打印
-          sendBuff = "";
-        }
+        client.print(frame.text);
+        Serial.print(frame.text); //从串口打印
       }
 
       static unsigned long Heartbeat_time = 0;
@@ -151,12 +141,12 @@ void SocketServer_Test(void)
         //Serial2.println(WiFi.softAPgetStationNum());
         if (0 == (WiFi.softAPgetStationNum())) //如果连接的设备个数为“0” 则向车模发送停止命令
         {
-          Serial2.print("{\"N\":100}");
+          sendStop();
           break;
         }
       }
     }
-    Serial2.print("{\"N\":100}");
+    sendStop();
     client.stop(); //结束当前连接:
     Serial.println("[Client disconnected]");
   }
@@ -165,34 +155,26 @@ void SocketServer_Test(void)
     if (ED_client == true)
     {
       ED_client = false;
-      Serial2.print("{\"N\":100}");
+      sendStop();
     }
   }
 }
 /*作用于测试架*/
 void FactoryTest(void)
 {
-  static String readBuff;
-  String sendBuff;
-  if (Serial2.available())
+  car_frame_t frame;
+  if (car_frame_queue_pop(&factoryFrames, &frame))
   {
-    char c = Serial2.read();
-    readBuff += c;
-    if (c == '}') //接收到结束字符
+    if (0 == strcmp(frame.text, "{BT_detection}"))
     {
-      if (true == readBuff.equals("{BT_detection}"))
-      {
-        Serial2.print("{BT_OK}");
-        Serial.println("Factory...");
-      }
-      else if (true == readBuff.equals("{WA_detection}"))
-      {
-        Serial2.print("{");
-        Serial2.print(CameraWebServerAP.wifi_name);
-        Serial2.print("}");
-        Serial.println("Factory...");
-      }
-      readBuff = "";
+      car_link_write(&car_link, "{BT_OK}", 7);
+      Serial.println("Factory...");
+    }
+    else if (0 == strcmp(frame.text, "{WA_detection}"))
+    {
+      String reply = "{" + CameraWebServerAP.wifi_name + "}";
+      car_link_write(&car_link, reply.c_str(), reply.length());
+      Serial.println("Factory...");
     }
   }
   {
@@ -201,7 +183,7 @@ void FactoryTest(void)
       if (true == WA_en)
       {
         digitalWrite(46, LOW);
-        Serial2.print("{WA_OK}");
+        car_link_write(&car_link, "{WA_OK}", 7);
         WA_en = false;
       }
     }
@@ -214,7 +196,7 @@ void FactoryTest(void)
       {
         if (false == WA_en)
         {
-          Serial2.print("{WA_NO}");
+          car_link_write(&car_link, "{WA_NO}", 7);
           WA_en = true;
         }
         if (en == true)
@@ -236,7 +218,15 @@ void setup()
 {
   Serial.begin(115200);
   Serial.print("wifi_name:");
-  Serial2.begin(9600, SERIAL_8N1, RXD2, TXD2);
+  car_frame_queue_init(&bridgeFrames);
+  car_frame_queue_init(&factoryFrames);
+  car_frame_queue_init(&pose_frames);
+  car_serial_init(9600, RXD2, TXD2);
+  car_link_subscribe(&car_link, CAR_POSE_STREAM_ID, &pose_frames);
+  car_link_subscribe(&car_link, "BT_detection", &factoryFrames);
+  car_link_subscribe(&car_link, "WA_detection", &factoryFrames);
+  car_link_subscribe(&car_link, "", &bridgeFrames);
+  car_serial_begin(); // starts the reader, so after the subscriptions
   //http://192.168.4.1/control?var=framesize&val=3
   //http://192.168.4.1/Test?var=
   CameraWebServerAP.CameraWebServer_AP_Init();
@@ -254,7 +244,7 @@ void setup()
   pinMode(46, OUTPUT);
   digitalWrite(46, HIGH);
   Serial.println("Elegoo-2020...");
-  Serial2.print("{Factory}");
+  car_link_write(&car_link, "{Factory}", 9);
   //ESP.restart();
   // esp_restart();
 }
@@ -13,12 +13,26 @@
 // limitations under the License.
 #include "esp_http_server.h"
 #include "esp_timer.h"
+#include "esp_system.h"
 #include "esp_camera.h"
 #include "img_converters.h"
 #include "camera_index.h"
 #include "Arduino.h"
 // JSON parsing
 #include "ArduinoJson-v6.11.1.h"
+#include "frame_hub.h"
+#include "quality_ctl.h"
+#include "rtp_jpeg.h"
+#include "pose_cache.h"
+#include "clip_ring.h"
+#include "mjpeg_avi.h"
+#include "car_serial.h"
+#include "path_coalesce.h"
+#include "req_arena.h"
+#include "lwip/sockets.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 
 
 
@@ -46,184 +60,1315 @@ static const char *_STREAM_BOUNDARY = "\r\n";
 static const char *_STREAM_PART = "Len: %u\r\n";
 
 static const char *_STREAM_BOUNDARY_test = "\r\n--" PART_BOUNDARY "\r\n";
-static const char *_STREAM_PART_test = "Content-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n";
+static const char *_STREAM_PART_test = "Content-Type: image/jpeg\r\nContent-Length: %u\r\n";
+
+// Raw socket mode: response head written once, then boundary + part header + JPEG in a single writev
+static const char *_STREAM_RAW_HEAD = "HTTP/1.1 200 OK\r\n"
+                                      "Content-Type: multipart/x-mixed-replace;boundary=" PART_BOUNDARY "\r\n"
+                                      "Access-Control-Allow-Origin: *\r\n"
+                                      "Cache-Control: no-cache\r\n"
+                                      "Connection: close\r\n"
+                                      "\r\n";
+// Chunked mode (?mode=chunked): the same parts, each one HTTP chunk
+static const char *_STREAM_CHUNKED_HEAD = "HTTP/1.1 200 OK\r\n"
+                                          "Content-Type: multipart/x-mixed-replace;boundary=" PART_BOUNDARY "\r\n"
+                                          "Transfer-Encoding: chunked\r\n"
+                                          "Access-Control-Allow-Origin: *\r\n"
+                                          "\r\n";
+static const char *_STREAM_PART_raw = "\r\n--" PART_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n";
+
+// Per-frame metadata appended to either part header; timestamps are seconds since boot
+static const char *_STREAM_PART_META = "X-Frame-Seq: %u\r\nX-Capture-Timestamp: %u.%06u\r\nX-Send-Timestamp: %u.%06u\r\n";
+static const char *_STREAM_PART_POSE = "X-Robot-Pose: ";
+static const char *_STREAM_PART_POSE_TS = "\r\nX-Pose-Timestamp: %u.%06u\r\n";
+#define STREAM_PART_BUF_LEN 512
 
-static ra_filter_t ra_filter;
 httpd_handle_t stream_httpd = NULL;
 httpd_handle_t camera_httpd = NULL;
 
-static ra_filter_t *ra_filter_init(ra_filter_t *filter, size_t sample_size)
-{
-    memset(filter, 0, sizeof(ra_filter_t));
-    filter->values = (int *)malloc(sample_size * sizeof(int));
-    if (!filter->values)
+// Every consumer of camera frames subscribes here instead of calling esp_camera_fb_get() itself
+static frame_hub_t camera_hub;
+// Downscaled copies of camera_hub frames for /preview, produced only while someone watches
+static frame_hub_t preview_hub;
+
+static ra_filter_t *ra_filter_init(ra_filter_t *filter, size_t sample_size)
+{
+    memset(filter, 0, sizeof(ra_filter_t));
+    filter->values = (int *)malloc(sample_size * sizeof(int));
+    if (!filter->values)
+    {
+        return NULL;
+    }
+    memset(filter->values, 0, sample_size * sizeof(int));
+
+    filter->size = sample_size;
+    return filter;
+}
+
+static int ra_filter_run(ra_filter_t *filter, int value)
+{
+    if (!filter->values)
+    {
+        return value;
+    }
+    filter->sum -= filter->values[filter->index];
+    filter->values[filter->index] = value;
+    filter->sum += filter->values[filter->index];
+    filter->index++;
+    filter->index = filter->index % filter->size;
+    if (filter->count < filter->size)
+    {
+        filter->count++;
+    }
+    return filter->sum / filter->count;
+}
+
+static void ra_filter_reset(ra_filter_t *filter)
+{
+    if (filter->values)
+    {
+        memset(filter->values, 0, filter->size * sizeof(int));
+    }
+    filter->index = 0;
+    filter->count = 0;
+    filter->sum = 0;
+}
+
+// Per-client stream telemetry. The client's sender task (or the RTP loop) is the
+// only writer and publishes its averages through a sequence counter, so readers
+// don't block it; one that keeps losing the race waits on the writer's lock.
+#define STREAM_STATS_SAMPLES 20
+#define STREAM_STATS_READ_TRIES 8
+#define STREAM_CLIENT_MAX (2 * FRAME_HUB_MAX_SUBSCRIBERS)
+
+typedef struct
+{
+    uint32_t frames;
+    uint32_t bytes;
+    int interval_us; // between consecutive sends
+    int wait_us;     // blocked waiting for the next frame
+    int latency_us;  // capture timestamp to send start
+    int size;        // JPEG bytes
+    int send_us;     // time spent writing one part
+} stream_stats_t;
+
+// How a sender task writes parts to a socket it took over from httpd
+typedef enum
+{
+    STREAM_RAW,     // multipart straight onto the socket
+    STREAM_CHUNKED, // the same parts in HTTP chunks
+    STREAM_WS,      // one binary WebSocket message per frame
+} stream_mode_t;
+
+typedef struct
+{
+    bool in_use;
+    uint32_t id;
+    const char *transport;
+    // Sender task state; fd is -1 for clients without one (RTP)
+    stream_mode_t mode;
+    httpd_handle_t server;
+    int fd;
+    std::atomic<bool> session_closed; // httpd dropped the session, the sender closes fd
+    int64_t opened_us;
+    int64_t last_send_us;
+    frame_hub_t *hub;
+    frame_sub_t *sub;
+    ra_filter_t interval, wait, latency, size, send;
+    std::mutex write_lock;         // held by the writer while it updates stats
+    std::atomic<uint32_t> version; // odd while the writer updates stats
+    stream_stats_t stats;
+} stream_client_t;
+
+static stream_client_t stream_clients[STREAM_CLIENT_MAX];
+static std::mutex stream_clients_lock;
+static uint32_t stream_client_next_id = 1;
+
+static void stream_clients_init(void)
+{
+    for (int i = 0; i < STREAM_CLIENT_MAX; i++)
+    {
+        stream_client_t *c = &stream_clients[i];
+        ra_filter_init(&c->interval, STREAM_STATS_SAMPLES);
+        ra_filter_init(&c->wait, STREAM_STATS_SAMPLES);
+        ra_filter_init(&c->latency, STREAM_STATS_SAMPLES);
+        ra_filter_init(&c->size, STREAM_STATS_SAMPLES);
+        ra_filter_init(&c->send, STREAM_STATS_SAMPLES);
+        c->in_use = false;
+        c->version = 0;
+    }
+}
+
+static stream_client_t *stream_client_open(const char *transport, frame_hub_t *hub, frame_sub_t *sub)
+{
+    std::lock_guard<std::mutex> guard(stream_clients_lock);
+    for (int i = 0; i < STREAM_CLIENT_MAX; i++)
+    {
+        stream_client_t *c = &stream_clients[i];
+        if (c->in_use)
+        {
+            continue;
+        }
+        ra_filter_reset(&c->interval);
+        ra_filter_reset(&c->wait);
+        ra_filter_reset(&c->latency);
+        ra_filter_reset(&c->size);
+        ra_filter_reset(&c->send);
+        memset(&c->stats, 0, sizeof(c->stats));
+        c->id = stream_client_next_id++;
+        c->transport = transport;
+        c->opened_us = esp_timer_get_time();
+        c->last_send_us = 0;
+        c->hub = hub;
+        c->sub = sub;
+        c->fd = -1;
+        c->session_closed = false;
+        c->in_use = true;
+        return c;
+    }
+    return NULL;
+}
+
+static void stream_client_close(stream_client_t *c)
+{
+    if (!c)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(stream_clients_lock);
+    c->in_use = false;
+}
+
+// Called by the stream loop after each part; wait_start is when it began waiting for the frame
+static void stream_client_record(stream_client_t *c, const frame_ref_t *frame, int64_t wait_start, int64_t send_start, int64_t send_end)
+{
+    if (!c)
+    {
+        return;
+    }
+    int interval = c->last_send_us ? (int)(send_start - c->last_send_us) : 0;
+    c->last_send_us = send_start;
+
+    std::lock_guard<std::mutex> guard(c->write_lock);
+    c->version.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    if (interval)
+    {
+        c->stats.interval_us = ra_filter_run(&c->interval, interval);
+    }
+    c->stats.wait_us = ra_filter_run(&c->wait, (int)(send_start - wait_start));
+    c->stats.latency_us = ra_filter_run(&c->latency, (int)(send_start - frame->timestamp_us));
+    c->stats.size = ra_filter_run(&c->size, (int)frame->len);
+    c->stats.send_us = ra_filter_run(&c->send, (int)(send_end - send_start));
+    c->stats.frames++;
+    c->stats.bytes += frame->len;
+    std::atomic_thread_fence(std::memory_order_release);
+    c->version.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Stats as of one consistent version, like read_pose() in pose_cache.cpp
+static bool stream_client_snapshot(stream_client_t *c, stream_stats_t *out)
+{
+    for (int tries = 0; tries < STREAM_STATS_READ_TRIES; tries++)
+    {
+        uint32_t v = c->version.load(std::memory_order_acquire);
+        if (v & 1)
+        {
+            continue;
+        }
+        memcpy(out, &c->stats, sizeof(*out));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (c->version.load(std::memory_order_relaxed) == v)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void stream_client_read(stream_client_t *c, stream_stats_t *out)
+{
+    if (!stream_client_snapshot(c, out))
+    {
+        // the sender kept getting in the way (e.g. it was preempted mid-update); wait it out
+        std::lock_guard<std::mutex> guard(c->write_lock);
+        memcpy(out, &c->stats, sizeof(*out));
+    }
+}
+
+static size_t jpg_encode_stream(void *arg, size_t index, const void *data, size_t len)
+{
+    jpg_chunking_t *j = (jpg_chunking_t *)arg;
+    if (!index)
+    {
+        j->len = 0;
+    }
+    if (httpd_resp_send_chunk(j->req, (const char *)data, len) != ESP_OK)
+    {
+        return 0;
+    }
+    j->len += len;
+    return len;
+}
+static void camera_fb_release(void *owner)
+{
+    esp_camera_fb_return((camera_fb_t *)owner);
+}
+
+static void jpg_buf_release(void *owner)
+{
+    free(owner);
+}
+
+// camera_hub lends subscribers at most this many camera buffers (fb_count in
+// CameraWebServer_AP.cpp leaves the rest to the driver); later frames are copied
+#define CAMERA_FB_LENT 1
+
+static void *frame_copy_alloc(size_t len)
+{
+    return psramFound() ? ps_malloc(len) : malloc(len);
+}
+
+// Adaptive quality: rungs from the boot configuration (SVGA, q10) down to what a
+// link at the edge of AP range can still carry
+static const quality_step_t quality_ladder[] = {
+    {FRAMESIZE_SVGA, 10, 1000},
+    {FRAMESIZE_SVGA, 15, 700},
+    {FRAMESIZE_VGA, 12, 560},
+    {FRAMESIZE_VGA, 18, 400},
+    {FRAMESIZE_CIF, 15, 170},
+    {FRAMESIZE_QVGA, 15, 110},
+    {FRAMESIZE_QVGA, 25, 75},
+    {FRAMESIZE_HQVGA, 25, 45},
+};
+#define QUALITY_LADDER_STEPS (int)(sizeof(quality_ladder) / sizeof(quality_ladder[0]))
+#define ADAPTIVE_PERIOD_MS 500
+#define ADAPTIVE_SETTLE_MS 2000
+
+static quality_ctl_t quality_ctl;
+static std::atomic<bool> adaptive_enabled(false);
+static std::atomic<bool> adaptive_restart(false);
+static std::atomic<int> adaptive_target_fps(15);
+// Rung the controller last applied, -1 until it changed one since (re)start;
+// until then the sensor still holds what it was started from
+static std::atomic<int> adaptive_rung(-1);
+// Bumped whenever a camera setting may have changed; /status re-renders then
+static std::atomic<uint32_t> status_generation(1);
+
+// Runs in the capture task, so sensor changes land between frames
+static void adaptive_quality_tick(void)
+{
+    static int64_t last_tick = 0;
+    static int64_t settle_until = 0;
+    int64_t now = esp_timer_get_time();
+    if (!adaptive_enabled || now - last_tick < ADAPTIVE_PERIOD_MS * 1000LL || now < settle_until)
+    {
+        return;
+    }
+    last_tick = now;
+
+    sensor_t *s = esp_camera_sensor_get();
+    if (adaptive_restart.exchange(false))
+    {
+        int start = 0;
+        while (start < QUALITY_LADDER_STEPS - 1 && quality_ladder[start].framesize > s->status.framesize)
+        {
+            start++;
+        }
+        quality_ctl_init(&quality_ctl, quality_ladder, QUALITY_LADDER_STEPS, (float)adaptive_target_fps, start);
+    }
+    quality_ctl.target_fps = (float)adaptive_target_fps;
+
+    // Steer by the slowest full-resolution viewer that has enough history; preview
+    // clients are rate-capped on purpose and say nothing about the link
+    quality_sample_t sample = {(uint32_t)(now / 1000), 0.0f, 0, 0};
+    {
+        std::lock_guard<std::mutex> guard(stream_clients_lock);
+        for (int i = 0; i < STREAM_CLIENT_MAX; i++)
+        {
+            stream_stats_t st;
+            if (!stream_clients[i].in_use || stream_clients[i].hub != &camera_hub)
+            {
+                continue;
+            }
+            stream_client_read(&stream_clients[i], &st);
+            if (st.frames < STREAM_STATS_SAMPLES || !st.interval_us)
+            {
+                continue;
+            }
+            float fps = 1000000.0f / st.interval_us;
+            if (sample.fps == 0.0f || fps < sample.fps)
+            {
+                sample.fps = fps;
+                sample.frame_bytes = st.size;
+                sample.send_us = st.send_us;
+            }
+        }
+    }
+    if (!quality_ctl_update(&quality_ctl, &sample))
+    {
+        return;
+    }
+    adaptive_rung = quality_ctl.step;
+    const quality_step_t *step = quality_ctl_current(&quality_ctl);
+    Serial.printf("Adaptive quality: %.1f fps -> framesize %u quality %u\n", sample.fps, step->framesize, step->quality);
+    if (s->status.framesize != step->framesize)
+    {
+        s->set_framesize(s, (framesize_t)step->framesize);
+    }
+    if (s->status.quality != step->quality)
+    {
+        s->set_quality(s, step->quality);
+    }
+    status_generation++;
+    // the rolling averages still describe the old rung for a while
+    settle_until = now + ADAPTIVE_SETTLE_MS * 1000LL;
+}
+
+// Camera settings shared by /control and /api/camera: name, setter and the
+// current value. Names resolve through a switch over a compile-time FNV-1a
+// hash; duplicate case labels fail to compile, so the table stays a perfect
+// hash, and the strcmp rejects names that merely collide with one.
+typedef int (*control_fn)(sensor_t *s, int val);
+typedef int (*control_get_fn)(sensor_t *s);
+
+typedef struct
+{
+    const char *name;
+    control_fn set;
+    control_get_fn get;
+} control_t;
+
+static constexpr uint32_t control_hash(const char *name, uint32_t h = 2166136261u)
+{
+    return *name ? control_hash(name + 1, (h ^ (uint8_t)*name) * 16777619u) : h;
+}
+
+static int control_framesize(sensor_t *s, int val)
+{
+    // a manual choice overrides the adaptive controller
+    adaptive_enabled = false;
+    return s->pixformat == PIXFORMAT_JPEG ? s->set_framesize(s, (framesize_t)val) : 0;
+}
+
+static int control_quality(sensor_t *s, int val)
+{
+    adaptive_enabled = false;
+    return s->set_quality(s, val);
+}
+
+// While the adaptive controller owns size and quality they read as its current
+// rung: resending that leaves the controller alone, any other value takes over
+static int control_framesize_get(sensor_t *s)
+{
+    int rung = adaptive_rung;
+    return adaptive_enabled && rung >= 0 ? quality_ladder[rung].framesize : s->status.framesize;
+}
+
+static int control_quality_get(sensor_t *s)
+{
+    int rung = adaptive_rung;
+    return adaptive_enabled && rung >= 0 ? quality_ladder[rung].quality : s->status.quality;
+}
+
+static int control_adaptive(sensor_t *s, int val)
+{
+    adaptive_rung = -1;
+    adaptive_restart = val != 0;
+    adaptive_enabled = val != 0;
+    return 0;
+}
+
+static int control_target_fps(sensor_t *s, int val)
+{
+    if (val <= 0 || val > 60)
+        return -1;
+    adaptive_target_fps = val;
+    return 0;
+}
+
+#define SENSOR_SET(setter, type) [](sensor_t *s, int val) { return s->setter(s, (type)val); }
+#define STATUS_GET(field) [](sensor_t *s) { return (int)s->status.field; }
+
+// In the order a settings transaction writes them: size and compression, each
+// automatic control ahead of the manual value it overrides, and the adaptive
+// controller last, so framesize/quality sent with adaptive=1 become its
+// starting rung instead of switching it off again
+#define CAMERA_CONTROLS(X)                                                                           \
+    X(framesize, control_framesize, control_framesize_get)                                            \
+    X(quality, control_quality, control_quality_get)                                                  \
+    X(special_effect, SENSOR_SET(set_special_effect, int), STATUS_GET(special_effect))                \
+    X(brightness, SENSOR_SET(set_brightness, int), STATUS_GET(brightness))                            \
+    X(contrast, SENSOR_SET(set_contrast, int), STATUS_GET(contrast))                                  \
+    X(saturation, SENSOR_SET(set_saturation, int), STATUS_GET(saturation))                            \
+    X(hmirror, SENSOR_SET(set_hmirror, int), STATUS_GET(hmirror))                                     \
+    X(vflip, SENSOR_SET(set_vflip, int), STATUS_GET(vflip))                                           \
+    X(dcw, SENSOR_SET(set_dcw, int), STATUS_GET(dcw))                                                 \
+    X(bpc, SENSOR_SET(set_bpc, int), STATUS_GET(bpc))                                                 \
+    X(wpc, SENSOR_SET(set_wpc, int), STATUS_GET(wpc))                                                 \
+    X(raw_gma, SENSOR_SET(set_raw_gma, int), STATUS_GET(raw_gma))                                     \
+    X(lenc, SENSOR_SET(set_lenc, int), STATUS_GET(lenc))                                              \
+    X(awb, SENSOR_SET(set_whitebal, int), STATUS_GET(awb))                                            \
+    X(awb_gain, SENSOR_SET(set_awb_gain, int), STATUS_GET(awb_gain))                                  \
+    X(wb_mode, SENSOR_SET(set_wb_mode, int), STATUS_GET(wb_mode))                                     \
+    X(aec, SENSOR_SET(set_exposure_ctrl, int), STATUS_GET(aec))                                       \
+    X(aec2, SENSOR_SET(set_aec2, int), STATUS_GET(aec2))                                              \
+    X(ae_level, SENSOR_SET(set_ae_level, int), STATUS_GET(ae_level))                                  \
+    X(aec_value, SENSOR_SET(set_aec_value, int), STATUS_GET(aec_value))                               \
+    X(agc, SENSOR_SET(set_gain_ctrl, int), STATUS_GET(agc))                                           \
+    X(gainceiling, SENSOR_SET(set_gainceiling, gainceiling_t), STATUS_GET(gainceiling))               \
+    X(agc_gain, SENSOR_SET(set_agc_gain, int), STATUS_GET(agc_gain))                                  \
+    X(colorbar, SENSOR_SET(set_colorbar, int), STATUS_GET(colorbar))                                  \
+    X(target_fps, control_target_fps, [](sensor_t *) { return (int)adaptive_target_fps; })            \
+    X(adaptive, control_adaptive, [](sensor_t *) { return adaptive_enabled ? 1 : 0; })
+
+#define CONTROL_INDEX(name, set, get) CONTROL_##name,
+#define CONTROL_ENTRY(name, set, get) {#name, set, get},
+#define CONTROL_CASE(name, set, get) \
+    case control_hash(#name):        \
+        c = &controls[CONTROL_##name]; \
+        break;
+
+enum
+{
+    CAMERA_CONTROLS(CONTROL_INDEX) CONTROL_COUNT
+};
+
+static const control_t controls[CONTROL_COUNT] = {CAMERA_CONTROLS(CONTROL_ENTRY)};
+
+static const control_t *control_find(const char *var)
+{
+    const control_t *c;
+    switch (control_hash(var))
+    {
+        CAMERA_CONTROLS(CONTROL_CASE)
+    default:
+        return NULL;
+    }
+    return strcmp(var, c->name) ? NULL : c;
+}
+
+#undef CONTROL_INDEX
+#undef CONTROL_ENTRY
+#undef CONTROL_CASE
+#undef SENSOR_SET
+#undef STATUS_GET
+
+// Settings transaction from POST /api/camera. The capture task applies it
+// between two frames, writing only what differs from s->status, in table order.
+#define CAMERA_TXN_WAIT_MS 1500
+
+typedef struct
+{
+    std::mutex lock;
+    std::condition_variable cond;
+    bool pending;
+    bool requested[CONTROL_COUNT];
+    int value[CONTROL_COUNT];
+    const char *result[CONTROL_COUNT]; // "written", "unchanged" or "failed"
+    int writes;
+} camera_txn_t;
+
+static camera_txn_t camera_txn;
+
+static void camera_txn_apply_locked(void)
+{
+    sensor_t *s = esp_camera_sensor_get();
+    camera_txn.writes = 0;
+    for (int i = 0; i < CONTROL_COUNT; i++)
+    {
+        if (!camera_txn.requested[i])
+        {
+            continue;
+        }
+        if (controls[i].get(s) == camera_txn.value[i])
+        {
+            camera_txn.result[i] = "unchanged";
+            continue;
+        }
+        camera_txn.result[i] = controls[i].set(s, camera_txn.value[i]) ? "failed" : "written";
+        camera_txn.writes++;
+    }
+    if (camera_txn.writes)
+    {
+        status_generation++;
+    }
+    camera_txn.pending = false;
+    camera_txn.cond.notify_all();
+}
+
+// Capture task, between frames
+static void camera_txn_poll(void)
+{
+    std::lock_guard<std::mutex> guard(camera_txn.lock);
+    if (camera_txn.pending)
+    {
+        camera_txn_apply_locked();
+    }
+}
+
+// Single producer: grabs each frame once and fans it out through camera_hub.
+// Capture runs only while somebody is subscribed.
+static void capture_task(void *arg)
+{
+    while (true)
+    {
+        camera_txn_poll();
+        if (!frame_hub_wait_subscribers(&camera_hub, 1000))
+        {
+            continue;
+        }
+        camera_fb_t *fb = esp_camera_fb_get(); //获取一帧图像
+        if (!fb)
+        {
+            Serial.println("Camera capture failed");
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+        int64_t timestamp = (int64_t)fb->timestamp.tv_sec * 1000000LL + fb->timestamp.tv_usec;
+        if (fb->format != PIXFORMAT_JPEG)
+        {
+            uint8_t *_jpg_buf = NULL;
+            size_t _jpg_buf_len = 0;
+            bool jpeg_converted = frame2jpg(fb, 80, &_jpg_buf, &_jpg_buf_len);
+            uint16_t width = fb->width;
+            uint16_t height = fb->height;
+            esp_camera_fb_return(fb);
+            if (!jpeg_converted)
+            {
+                Serial.println("JPEG compression failed");
+                continue;
+            }
+            frame_hub_publish(&camera_hub, _jpg_buf, _jpg_buf_len, width, height, timestamp, _jpg_buf, jpg_buf_release);
+        }
+        else
+        {
+            frame_hub_publish(&camera_hub, fb->buf, fb->len, fb->width, fb->height, timestamp, fb, camera_fb_release);
+        }
+        adaptive_quality_tick();
+    }
+}
+
+// Preview: the decoder's scaled IDCT (TJpgDec keeps only the low-frequency DCT
+// coefficients at 1/2, 1/4 and 1/8) gives a small RGB565 image straight from the
+// sensor JPEG, which is re-encoded at preview quality. The sensor configuration
+// and the full-resolution stream are left alone.
+#define PREVIEW_MAX_WIDTH 320
+#define PREVIEW_QUALITY 60 // fmt2jpg scale, higher is better
+#define PREVIEW_MAX_FPS 10
+
+static void preview_task(void *arg)
+{
+    uint8_t *rgb = NULL;
+    size_t rgb_size = 0;
+    while (true)
+    {
+        if (!frame_hub_wait_subscribers(&preview_hub, 1000))
+        {
+            continue;
+        }
+        frame_sub_t *sub = frame_hub_subscribe(&camera_hub);
+        if (!sub)
+        {
+            vTaskDelay(pdMS_TO_TICKS(1000));
+            continue;
+        }
+        int64_t next = 0;
+        while (frame_hub_subscriber_count(&preview_hub) > 0)
+        {
+            frame_ref_t *frame = frame_hub_take(&camera_hub, sub, 1000);
+            if (!frame)
+            {
+                continue;
+            }
+            int64_t now = esp_timer_get_time();
+            if (now < next)
+            {
+                frame_ref_release(frame);
+                continue;
+            }
+            next = now + 1000000 / PREVIEW_MAX_FPS;
+
+            // smallest reduction the decoder offers (1/2..1/8) that fits PREVIEW_MAX_WIDTH
+            int shift = 1;
+            while (shift < 3 && (frame->width >> shift) > PREVIEW_MAX_WIDTH)
+            {
+                shift++;
+            }
+            jpg_scale_t scale = shift == 1 ? JPG_SCALE_2X : (shift == 2 ? JPG_SCALE_4X : JPG_SCALE_8X);
+            uint16_t width = frame->width >> shift;
+            uint16_t height = frame->height >> shift;
+            size_t need = (size_t)width * height * 2;
+            if (need > rgb_size)
+            {
+                free(rgb);
+                rgb = (uint8_t *)(psramFound() ? ps_malloc(need) : malloc(need));
+                rgb_size = rgb ? need : 0;
+            }
+            bool decoded = rgb && jpg2rgb565(frame->buf, frame->len, rgb, scale);
+            int64_t timestamp = frame->timestamp_us;
+            frame_ref_release(frame);
+
+            uint8_t *jpg = NULL;
+            size_t jpg_len = 0;
+            if (!decoded || !fmt2jpg(rgb, need, width, height, PIXFORMAT_RGB565, PREVIEW_QUALITY, &jpg, &jpg_len))
+            {
+                Serial.println("Preview conversion failed");
+                continue;
+            }
+            frame_hub_publish(&preview_hub, jpg, jpg_len, width, height, timestamp, jpg, jpg_buf_release);
+        }
+        frame_hub_unsubscribe(&camera_hub, sub);
+    }
+}
+
+//图片帧捕获（图片）
+static esp_err_t capture_handler(httpd_req_t *req)
+{
+    esp_err_t res = ESP_OK;
+    int64_t fr_start = esp_timer_get_time();
+
+    frame_sub_t *sub = frame_hub_subscribe(&camera_hub);
+    frame_ref_t *frame = sub ? frame_hub_take(&camera_hub, sub, 3000) : NULL;
+    frame_hub_unsubscribe(&camera_hub, sub);
+    if (!frame)
+    {
+        Serial.println("Camera capture failed");
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+
+    httpd_resp_set_type(req, "image/jpeg");
+    httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+
+    size_t fb_len = frame->len;
+    res = httpd_resp_send(req, (const char *)frame->buf, frame->len);
+    frame_ref_release(frame);
+    int64_t fr_end = esp_timer_get_time();
+    Serial.printf("JPG: %uB %ums\n", (uint32_t)(fb_len), (uint32_t)((fr_end - fr_start) / 1000));
+    return res;
+}
+// Write all iovecs, resuming after partial writes. Returns ESP_FAIL once the peer is gone.
+static esp_err_t stream_raw_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return ESP_FAIL;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t stream_raw_send_part(int fd, const char *part_hdr, size_t hlen, const uint8_t *buf, size_t len)
+{
+    struct iovec iov[2];
+    iov[0].iov_base = (void *)part_hdr;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = len;
+    return stream_raw_writev(fd, iov, 2);
+}
+
+// Builds the part header for one frame in the caller's preallocated buffer
+static size_t stream_format_part(char *buf, size_t size, const char *part_fmt, const frame_ref_t *frame, int64_t send_us)
+{
+    size_t len = snprintf(buf, size, part_fmt, frame->len);
+    len += snprintf(buf + len, size - len, _STREAM_PART_META, frame->seq,
+                    (uint32_t)(frame->timestamp_us / 1000000), (uint32_t)(frame->timestamp_us % 1000000),
+                    (uint32_t)(send_us / 1000000), (uint32_t)(send_us % 1000000));
+
+    // leave room for the pose timestamp line and the blank line that ends the header
+    size_t pose_hdr_len = strlen(_STREAM_PART_POSE);
+    size_t reserve = 48;
+    if (len + pose_hdr_len + reserve < size)
+    {
+        int64_t pose_us = 0;
+        int n = pose_cache_read(buf + len + pose_hdr_len, size - len - pose_hdr_len - reserve, &pose_us);
+        if (n >= 0)
+        {
+            memcpy(buf + len, _STREAM_PART_POSE, pose_hdr_len);
+            len += pose_hdr_len + n;
+            len += snprintf(buf + len, size - len, _STREAM_PART_POSE_TS,
+                            (uint32_t)(pose_us / 1000000), (uint32_t)(pose_us % 1000000));
+        }
+    }
+    len += snprintf(buf + len, size - len, "\r\n");
+    return len;
+}
+
+// /stream?mode=chunked keeps chunked transfer encoding for clients that need it.
+// The query is read whole, however long, so mode= isn't cut off behind other keys.
+static bool stream_wants_chunked(httpd_req_t *req)
+{
+    size_t len = httpd_req_get_url_query_len(req) + 1;
+    if (len <= 1)
+    {
+        return false;
+    }
+    char *query = (char *)malloc(len);
+    char mode[16];
+    bool chunked = query && httpd_req_get_url_query_str(req, query, len) == ESP_OK &&
+                   httpd_query_key_value(query, "mode", mode, sizeof(mode)) == ESP_OK && !strcmp(mode, "chunked");
+    free(query);
+    return chunked;
+}
+
+// esp_http_server runs every handler of a server on one task, so a handler that
+// streamed until the viewer left would keep every other viewer waiting. The
+// stream handlers only answer the request and hand the socket to a sender task
+// of its own. stream_sock_close() keeps httpd from closing a socket a sender
+// still writes to; the sender closes it once it is done.
+#define STREAM_SENDER_STACK 4096
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+// /ws: one binary WebSocket message per frame. The message starts with a 16 byte
+// little-endian header followed by the JPEG:
+//   uint32 seq | uint32 jpeg size | uint64 capture timestamp (us since boot)
+// The header and the JPEG go out as two fragments of the same message, so the
+// frame buffer is sent in place.
+#define WS_FRAME_HEADER_LEN 16
+
+static void ws_put_le(uint8_t *p, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+static esp_err_t ws_send_frame(stream_client_t *c, const frame_ref_t *frame)
+{
+    uint8_t header[WS_FRAME_HEADER_LEN];
+    ws_put_le(header, frame->seq, 4);
+    ws_put_le(header + 4, frame->len, 4);
+    ws_put_le(header + 8, (uint64_t)frame->timestamp_us, 8);
+
+    httpd_ws_frame_t pkt;
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.type = HTTPD_WS_TYPE_BINARY;
+    pkt.fragmented = true;
+    pkt.final = false;
+    pkt.payload = header;
+    pkt.len = sizeof(header);
+    esp_err_t res = httpd_ws_send_frame_async(c->server, c->fd, &pkt);
+    if (res == ESP_OK)
+    {
+        pkt.type = HTTPD_WS_TYPE_CONTINUE;
+        pkt.final = true;
+        pkt.payload = (uint8_t *)frame->buf;
+        pkt.len = frame->len;
+        res = httpd_ws_send_frame_async(c->server, c->fd, &pkt);
+    }
+    return res;
+}
+#endif
+
+// httpd's close_fn for both servers
+static void stream_sock_close(httpd_handle_t hd, int fd)
+{
+    {
+        std::lock_guard<std::mutex> guard(stream_clients_lock);
+        for (int i = 0; i < STREAM_CLIENT_MAX; i++)
+        {
+            stream_client_t *c = &stream_clients[i];
+            if (c->in_use && c->fd == fd)
+            {
+                // the sender may be inside a write; it closes fd on its way out
+                c->session_closed = true;
+                return;
+            }
+        }
+    }
+    close(fd);
+}
+
+static esp_err_t stream_send_frame(stream_client_t *c, char *part_buf, const frame_ref_t *frame, int64_t send_us)
+{
+    switch (c->mode)
+    {
+    case STREAM_RAW:
+    {
+        size_t hlen = stream_format_part(part_buf, STREAM_PART_BUF_LEN, _STREAM_PART_raw, frame, send_us);
+        return stream_raw_send_part(c->fd, part_buf, hlen, frame->buf, frame->len);
+    }
+    case STREAM_CHUNKED:
+    {
+        // one chunk per part: header, JPEG and the boundary that closes it
+        size_t hlen = stream_format_part(part_buf, STREAM_PART_BUF_LEN, _STREAM_PART_test, frame, send_us);
+        size_t blen = strlen(_STREAM_BOUNDARY_test);
+        char size_line[12];
+        int slen = snprintf(size_line, sizeof(size_line), "%x\r\n", (unsigned)(hlen + frame->len + blen));
+        struct iovec iov[5];
+        iov[0].iov_base = size_line;
+        iov[0].iov_len = slen;
+        iov[1].iov_base = part_buf;
+        iov[1].iov_len = hlen;
+        iov[2].iov_base = (void *)frame->buf;
+        iov[2].iov_len = frame->len;
+        iov[3].iov_base = (void *)_STREAM_BOUNDARY_test;
+        iov[3].iov_len = blen;
+        iov[4].iov_base = (void *)"\r\n";
+        iov[4].iov_len = 2;
+        return stream_raw_writev(c->fd, iov, 5);
+    }
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    case STREAM_WS:
+        return ws_send_frame(c, frame);
+#endif
+    default:
+        return ESP_FAIL;
+    }
+}
+
+static void stream_send_task(void *arg)
+{
+    stream_client_t *c = (stream_client_t *)arg;
+    char part_buf[STREAM_PART_BUF_LEN];
+    esp_err_t res = ESP_OK;
+    while (res == ESP_OK && !c->session_closed)
+    {
+        int64_t wait_start = esp_timer_get_time();
+        frame_ref_t *frame = frame_hub_take(c->hub, c->sub, 5000);
+        if (!frame)
+        {
+            Serial.println("Camera capture failed");
+            break;
+        }
+        int64_t send_start = esp_timer_get_time();
+        res = stream_send_frame(c, part_buf, frame, send_start);
+        stream_client_record(c, frame, wait_start, send_start, esp_timer_get_time());
+        frame_ref_release(frame);
+    }
+    frame_hub_t *hub = c->hub;
+    frame_sub_t *sub = c->sub;
+    frame_sub_stats_t stats = frame_hub_sub_stats(hub, sub);
+    Serial.printf("Stream closed (%s): %u sent, %u dropped, %u skipped\n", c->transport, stats.taken, stats.dropped,
+                  stats.skipped);
+
+    httpd_handle_t server = c->server;
+    int fd = c->fd;
+    bool closed;
+    {
+        std::lock_guard<std::mutex> guard(stream_clients_lock);
+        closed = c->session_closed;
+        c->fd = -1;
+        c->in_use = false;
+    }
+    frame_hub_unsubscribe(hub, sub);
+    if (closed)
+    {
+        // httpd already forgot the session
+        close(fd);
+    }
+    else
+    {
+        // httpd closes it through stream_sock_close(), which finds no sender now
+        httpd_sess_trigger_close(server, fd);
+    }
+    vTaskDelete(NULL);
+}
+
+// Hands the request's socket to a new sender task; false if none could be started
+static bool stream_sender_start(stream_client_t *c, httpd_req_t *req, stream_mode_t mode)
+{
+    int fd = httpd_req_to_sockfd(req);
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    {
+        std::lock_guard<std::mutex> guard(stream_clients_lock);
+        c->mode = mode;
+        c->server = req->handle;
+        c->fd = fd;
+    }
+    if (xTaskCreate(stream_send_task, "stream", STREAM_SENDER_STACK, c, tskIDLE_PRIORITY + 5, NULL) == pdPASS)
+    {
+        return true;
+    }
+    Serial.println("Stream: no memory for a sender task");
+    std::lock_guard<std::mutex> guard(stream_clients_lock);
+    c->fd = -1;
+    return false;
+}
+
+//图片帧流（实时视频）AAP
+static esp_err_t stream_handler(httpd_req_t *req)
+{
+    bool raw = !stream_wants_chunked(req);
+    // /stream serves camera frames, /preview the downscaled ones
+    frame_hub_t *hub = req->user_ctx ? (frame_hub_t *)req->user_ctx : &camera_hub;
+
+    frame_sub_t *sub = frame_hub_subscribe(hub);
+    stream_client_t *client = sub ? stream_client_open(raw ? "raw" : "chunked", hub, sub) : NULL;
+    if (!client)
+    {
+        Serial.println("Too many stream clients");
+        frame_hub_unsubscribe(hub, sub);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "too many clients");
+        return ESP_FAIL;
+    }
+
+    // The head goes out here, the parts from the sender task without httpd's
+    // framing: one lwIP write per part, chunk framing of our own if asked for
+    const char *head = raw ? _STREAM_RAW_HEAD : _STREAM_CHUNKED_HEAD;
+    struct iovec iov = {(void *)head, strlen(head)};
+    if (stream_raw_writev(httpd_req_to_sockfd(req), &iov, 1) != ESP_OK ||
+        !stream_sender_start(client, req, raw ? STREAM_RAW : STREAM_CHUNKED))
+    {
+        stream_client_close(client);
+        frame_hub_unsubscribe(hub, sub);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+static esp_err_t ws_stream_handler(httpd_req_t *req)
+{
+    if (req->method != HTTP_GET)
+    {
+        // Client to server messages are not used, just drain them
+        httpd_ws_frame_t pkt;
+        memset(&pkt, 0, sizeof(pkt));
+        return httpd_ws_recv_frame(req, &pkt, 0);
+    }
+
+    // the handshake is done; frames go out from the sender task
+    frame_sub_t *sub = frame_hub_subscribe(&camera_hub);
+    stream_client_t *client = sub ? stream_client_open("ws", &camera_hub, sub) : NULL;
+    if (!client || !stream_sender_start(client, req, STREAM_WS))
+    {
+        Serial.println("Too many stream clients");
+        stream_client_close(client);
+        frame_hub_unsubscribe(&camera_hub, sub);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+#endif
+
+// Opt-in RTP/JPEG over UDP for teleoperation: a lost datagram costs one frame
+// instead of stalling the stream behind TCP retransmits.
+#define RTP_SEND_RETRIES 5
+
+typedef struct
+{
+    std::mutex lock; // dest and session
+    std::atomic<bool> enabled;
+    struct sockaddr_in dest;
+    rtp_jpeg_session_t session;
+    uint32_t send_errors;
+    uint32_t bad_frames; // JPEGs RFC 2435 can't carry
+} rtp_state_t;
+
+static rtp_state_t rtp_state;
+
+typedef struct
+{
+    int sock;
+    struct sockaddr_in dest;
+} rtp_send_ctx_t;
+
+static bool rtp_send_packet(void *arg, const uint8_t *header, size_t header_len, const uint8_t *payload, size_t payload_len)
+{
+    rtp_send_ctx_t *ctx = (rtp_send_ctx_t *)arg;
+    struct iovec iov[2];
+    iov[0].iov_base = (void *)header;
+    iov[0].iov_len = header_len;
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = payload_len;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &ctx->dest;
+    msg.msg_namelen = sizeof(ctx->dest);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    for (int i = 0; i < RTP_SEND_RETRIES; i++)
+    {
+        if (sendmsg(ctx->sock, &msg, 0) >= 0)
+        {
+            return true;
+        }
+        if (errno != ENOMEM)
+        {
+            break;
+        }
+        // lwIP ran out of pbufs on a burst, give the WiFi queue a tick to drain
+        vTaskDelay(1);
+    }
+    return false;
+}
+
+static void rtp_task(void *arg)
+{
+    rtp_send_ctx_t ctx;
+    ctx.sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (ctx.sock < 0)
+    {
+        Serial.println("RTP socket failed");
+        vTaskDelete(NULL);
+        return;
+    }
+    while (true)
+    {
+        if (!rtp_state.enabled)
+        {
+            vTaskDelay(pdMS_TO_TICKS(200));
+            continue;
+        }
+
+        frame_sub_t *sub = frame_hub_subscribe(&camera_hub);
+        if (!sub)
+        {
+            vTaskDelay(pdMS_TO_TICKS(1000));
+            continue;
+        }
+        stream_client_t *client = stream_client_open("rtp", &camera_hub, sub);
+        while (rtp_state.enabled)
+        {
+            int64_t wait_start = esp_timer_get_time();
+            frame_ref_t *frame = frame_hub_take(&camera_hub, sub, 1000);
+            if (!frame)
+            {
+                continue;
+            }
+            int64_t send_start = esp_timer_get_time();
+            rtp_jpeg_info_t info;
+            bool parsed = rtp_jpeg_parse(frame->buf, frame->len, &info);
+            {
+                std::lock_guard<std::mutex> guard(rtp_state.lock);
+                ctx.dest = rtp_state.dest;
+                if (!parsed)
+                {
+                    rtp_state.bad_frames++;
+                }
+                else if (!rtp_jpeg_send_frame(&rtp_state.session, &info,
+                                              (uint32_t)(frame->timestamp_us * RTP_JPEG_CLOCK_HZ / 1000000), rtp_send_packet, &ctx))
+                {
+                    rtp_state.send_errors++;
+                }
+            }
+            stream_client_record(client, frame, wait_start, send_start, esp_timer_get_time());
+            frame_ref_release(frame);
+        }
+        stream_client_close(client);
+        frame_hub_unsubscribe(&camera_hub, sub);
+    }
+}
+
+// GET /api/rtp?port=5004[&dest=192.168.4.2]  start streaming (dest defaults to the caller)
+// GET /api/rtp?stop=1                        stop
+// GET /api/rtp                               status
+static esp_err_t rtp_handler(httpd_req_t *req)
+{
+    char query[96];
+    char value[32];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
+    {
+        if (httpd_query_key_value(query, "stop", value, sizeof(value)) == ESP_OK)
+        {
+            rtp_state.enabled = false;
+        }
+        else if (httpd_query_key_value(query, "port", value, sizeof(value)) == ESP_OK)
+        {
+            struct sockaddr_in dest;
+            memset(&dest, 0, sizeof(dest));
+            dest.sin_family = AF_INET;
+            dest.sin_port = htons(atoi(value));
+            if (httpd_query_key_value(query, "dest", value, sizeof(value)) == ESP_OK)
+            {
+                if (inet_pton(AF_INET, value, &dest.sin_addr) != 1)
+                {
+                    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "bad dest");
+                    return ESP_FAIL;
+                }
+            }
+            else
+            {
+                struct sockaddr_in6 peer;
+                socklen_t peer_len = sizeof(peer);
+                if (getpeername(httpd_req_to_sockfd(req), (struct sockaddr *)&peer, &peer_len) != 0)
+                {
+                    httpd_resp_send_500(req);
+                    return ESP_FAIL;
+                }
+                if (peer.sin6_family == AF_INET)
+                {
+                    dest.sin_addr = ((struct sockaddr_in *)&peer)->sin_addr;
+                }
+                else
+                {
+                    // IPv4-mapped IPv6 peer, address in the last four bytes
+                    memcpy(&dest.sin_addr.s_addr, &peer.sin6_addr.s6_addr[12], 4);
+                }
+            }
+            std::lock_guard<std::mutex> guard(rtp_state.lock);
+            rtp_state.dest = dest;
+            if (!rtp_state.enabled)
+            {
+                rtp_jpeg_session_init(&rtp_state.session, (uint32_t)esp_random(), (uint16_t)esp_random());
+                rtp_state.send_errors = 0;
+                rtp_state.bad_frames = 0;
+            }
+            rtp_state.enabled = true;
+        }
+    }
+
+    char json[256];
+    int len;
     {
-        return NULL;
+        std::lock_guard<std::mutex> guard(rtp_state.lock);
+        char addr[16];
+        inet_ntop(AF_INET, &rtp_state.dest.sin_addr, addr, sizeof(addr));
+        len = snprintf(json, sizeof(json),
+                       "{\"enabled\":%s,\"dest\":\"%s\",\"port\":%u,\"ssrc\":%u,\"frames\":%u,\"packets\":%u,"
+                       "\"send_errors\":%u,\"bad_frames\":%u}",
+                       rtp_state.enabled ? "true" : "false", addr, ntohs(rtp_state.dest.sin_port), rtp_state.session.ssrc,
+                       rtp_state.session.frames, rtp_state.session.packets, rtp_state.send_errors, rtp_state.bad_frames);
     }
-    memset(filter->values, 0, sample_size * sizeof(int));
-
-    filter->size = sample_size;
-    return filter;
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, json, len);
 }
 
-static int ra_filter_run(ra_filter_t *filter, int value)
+// Control handlers run one at a time on camera_httpd's task and take their
+// request and response buffers from this block instead of the heap (req_arena.h)
+#define CONTROL_ARENA_BYTES (32 * 1024)
+
+static uint8_t control_arena_mem[CONTROL_ARENA_BYTES];
+static req_arena_t control_arena;
+typedef BasicJsonDocument<req_arena_allocator> ArenaJsonDocument;
+
+// A document whose pool didn't fit in the arena has no capacity and would
+// silently drop everything; false once a 500 went out
+static bool control_doc_ready(httpd_req_t *req, const ArenaJsonDocument &doc)
 {
-    if (!filter->values)
-    {
-        return value;
-    }
-    filter->sum -= filter->values[filter->index];
-    filter->values[filter->index] = value;
-    filter->sum += filter->values[filter->index];
-    filter->index++;
-    filter->index = filter->index % filter->size;
-    if (filter->count < filter->size)
+    if (!doc.capacity())
     {
-        filter->count++;
+        httpd_resp_send_500(req);
+        return false;
     }
-    return filter->sum / filter->count;
+    return true;
 }
 
-static size_t jpg_encode_stream(void *arg, size_t index, const void *data, size_t len)
+// Query string in the control arena; NULL once an error went out
+static char *control_query(httpd_req_t *req)
 {
-    jpg_chunking_t *j = (jpg_chunking_t *)arg;
-    if (!index)
+    size_t len = httpd_req_get_url_query_len(req) + 1;
+    if (len <= 1)
     {
-        j->len = 0;
+        httpd_resp_send_404(req);
+        return NULL;
     }
-    if (httpd_resp_send_chunk(j->req, (const char *)data, len) != ESP_OK)
+    char *buf = (char *)req_arena_alloc(&control_arena, len);
+    if (!buf)
     {
-        return 0;
+        httpd_resp_send_500(req);
+        return NULL;
     }
-    j->len += len;
-    return len;
+    if (httpd_req_get_url_query_str(req, buf, len) != ESP_OK)
+    {
+        httpd_resp_send_404(req);
+        return NULL;
+    }
+    return buf;
 }
-//图片帧捕获（图片）
-static esp_err_t capture_handler(httpd_req_t *req)
-{
-    camera_fb_t *fb = NULL;
-    esp_err_t res = ESP_OK;
-    int64_t fr_start = esp_timer_get_time();
 
-    fb = esp_camera_fb_get();
-    if (!fb)
+// Request body in the control arena, NUL-terminated; NULL once an error went out
+static char *control_body(httpd_req_t *req, size_t max_len)
+{
+    size_t content_len = req->content_len;
+    if (content_len == 0 || content_len > max_len)
     {
-        Serial.println("Camera capture failed");
-        httpd_resp_send_500(req);
-        return ESP_FAIL;
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "bad body");
+        return NULL;
     }
-
-    httpd_resp_set_type(req, "image/jpeg");
-    httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg");
-    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-
-    size_t fb_len = 0;
-    if (fb->format == PIXFORMAT_JPEG)
+    char *body = (char *)req_arena_alloc(&control_arena, content_len + 1);
+    if (!body)
     {
-        fb_len = fb->len;
-        res = httpd_resp_send(req, (const char *)fb->buf, fb->len);
+        httpd_resp_send_500(req);
+        return NULL;
     }
-    else
+    size_t received = 0;
+    while (received < content_len)
     {
-        jpg_chunking_t jchunk = {req, 0};
-        res = frame2jpg_cb(fb, 80, jpg_encode_stream, &jchunk) ? ESP_OK : ESP_FAIL;
-        httpd_resp_send_chunk(req, NULL, 0);
-        fb_len = jchunk.len;
+        int ret = httpd_req_recv(req, body + received, content_len - received);
+        if (ret <= 0)
+        {
+            httpd_resp_send_500(req);
+            return NULL;
+        }
+        received += ret;
     }
-    esp_camera_fb_return(fb);
-    int64_t fr_end = esp_timer_get_time();
-    Serial.printf("JPG: %uB %ums\n", (uint32_t)(fb_len), (uint32_t)((fr_end - fr_start) / 1000));
-    return res;
+    body[content_len] = '\0';
+    return body;
 }
-//图片帧流（实时视频）AAP
-static esp_err_t stream_handler(httpd_req_t *req)
-{
-    camera_fb_t *fb = NULL;
-    esp_err_t res = ESP_OK;
-    size_t _jpg_buf_len = 0;
-    uint8_t *_jpg_buf = NULL;
-    char *part_buf[64];
-    int64_t fr_start = 0;
 
-    static int64_t last_frame = 0;
-    if (!last_frame)
+static esp_err_t control_send_json(httpd_req_t *req, const JsonDocument &doc)
+{
+    size_t len = measureJson(doc);
+    char *out = (char *)req_arena_alloc(&control_arena, len + 1);
+    if (!out)
     {
-        last_frame = esp_timer_get_time();
+        return httpd_resp_send_500(req);
     }
+    serializeJson(doc, out, len + 1);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, out, len);
+}
+
+#define CONTROL_MAX_PAIRS 32
 
-    res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
-    if (res != ESP_OK)
+// Applies one setting, returns "ok", "unknown", "bad_value" or "failed"
+static const char *control_apply(sensor_t *s, const char *var, const char *value)
+{
+    const control_t *c = control_find(var);
+    if (!c)
     {
-        return res;
+        return "unknown";
     }
-
-    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-    while (true)
+    char *end;
+    long val = strtol(value, &end, 10);
+    if (end == value || *end)
     {
-        fb = esp_camera_fb_get(); //获取一帧图像
-        if (!fb)
-        {
-            Serial.println("Camera capture failed");
-            res = ESP_FAIL;
-        }
-        else
-        {
-            fr_start = esp_timer_get_time();
-            if (fb->format != PIXFORMAT_JPEG)
-            {
-                bool jpeg_converted = frame2jpg(fb, 80, &_jpg_buf, &_jpg_buf_len);
-                esp_camera_fb_return(fb);
-                fb = NULL;
-                if (!jpeg_converted)
-                {
-                    Serial.println("JPEG compression failed");
-                    res = ESP_FAIL;
-                }
-            }
-            else
-            {
-                _jpg_buf_len = fb->len;
-                _jpg_buf = fb->buf;
-            }
-        }
-        if (res == ESP_OK)
-        {
-            size_t hlen = snprintf((char *)part_buf, 64, _STREAM_PART_test, _jpg_buf_len);
-            res = httpd_resp_send_chunk(req, (const char *)part_buf, hlen);
-        }
-        if (res == ESP_OK)
-        {
-            res = httpd_resp_send_chunk(req, (const char *)_jpg_buf, _jpg_buf_len); //原始发送
-        }
-        if (res == ESP_OK)
-        {
-            res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY_test, strlen(_STREAM_BOUNDARY_test));
-        }
-
-        if (fb)
-        {
-            esp_camera_fb_return(fb);
-            fb = NULL;
-            _jpg_buf = NULL;
-        }
-        else if (_jpg_buf)
-        {
-            free(_jpg_buf);
-            _jpg_buf = NULL;
-        }
-        if (res != ESP_OK)
-        {
-            break;
-        }
+        return "bad_value";
     }
-    last_frame = 0;
-    return res;
+    // the sensor already holds it: skip the register write
+    if (c->get(s) == (int)val)
+    {
+        return "ok";
+    }
+    int res = c->set(s, (int)val);
+    status_generation++;
+    return res ? "failed" : "ok";
 }
 
+// /control?var=<name>&val=<n> as before: empty 200 or 500.
+// /control?<name>=<n>&<name>=<n>... applies every pair in order and answers
+// {"applied":N,"failed":N,"results":{"<name>":"ok"|"unknown"|"bad_value"|"failed",...}}
+// More than CONTROL_MAX_PAIRS pairs get a 413 and nothing is applied.
 static esp_err_t cmd_handler(httpd_req_t *req)
 {
-    char *buf;
-    size_t buf_len;
+    req_arena_scope scope(&control_arena);
     char variable[32] = {
         0,
     };
@@ -231,119 +1376,170 @@ static esp_err_t cmd_handler(httpd_req_t *req)
         0,
     };
 
-    buf_len = httpd_req_get_url_query_len(req) + 1;
-    if (buf_len > 1)
+    char *buf = control_query(req);
+    if (!buf)
     {
-        buf = (char *)malloc(buf_len);
-        if (!buf)
+        return ESP_FAIL;
+    }
+    sensor_t *s = esp_camera_sensor_get();
+
+    if (httpd_query_key_value(buf, "var", variable, sizeof(variable)) == ESP_OK)
+    {
+        if (httpd_query_key_value(buf, "val", value, sizeof(value)) != ESP_OK)
         {
-            httpd_resp_send_500(req);
+            httpd_resp_send_404(req);
             return ESP_FAIL;
         }
-        if (httpd_req_get_url_query_str(req, buf, buf_len) == ESP_OK)
+        Serial.println(value);
+        Serial.println(variable);
+        if (strcmp(control_apply(s, variable, value), "ok"))
         {
-            if (httpd_query_key_value(buf, "var", variable, sizeof(variable)) == ESP_OK &&
-                httpd_query_key_value(buf, "val", value, sizeof(value)) == ESP_OK)
-            {
-            }
-            else
-            {
-                free(buf);
-                httpd_resp_send_404(req);
-                return ESP_FAIL;
-            }
+            return httpd_resp_send_500(req);
+        }
+        httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    int count = 1;
+    for (const char *c = buf; *c; c++)
+    {
+        count += *c == '&';
+    }
+    if (count > CONTROL_MAX_PAIRS)
+    {
+        httpd_resp_set_status(req, "413 Payload Too Large");
+        httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+        return httpd_resp_send(req, "too many settings", HTTPD_RESP_USE_STRLEN);
+    }
+
+    size_t json_size = 48 + CONTROL_MAX_PAIRS * (sizeof(variable) + 16);
+    char *json = (char *)req_arena_alloc(&control_arena, json_size);
+    if (!json)
+    {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+    int applied = 0, failed = 0, pairs = 0;
+    int len = snprintf(json, json_size, "{\"results\":{");
+    for (char *pair = strtok(buf, "&"); pair; pair = strtok(NULL, "&"), pairs++)
+    {
+        char *eq = strchr(pair, '=');
+        if (eq)
+        {
+            *eq = 0;
         }
+        snprintf(variable, sizeof(variable), "%s", pair);
+        const char *result = eq ? control_apply(s, variable, eq + 1) : "bad_value";
+        if (strcmp(result, "ok"))
+            failed++;
         else
+            applied++;
+        // names come from the URL; keep only what is safe inside a JSON string
+        for (char *c = variable; *c; c++)
         {
-            free(buf);
-            httpd_resp_send_404(req);
-            return ESP_FAIL;
+            if (!isalnum((unsigned char)*c) && *c != '_')
+                *c = '?';
         }
-        free(buf);
+        len += snprintf(json + len, json_size - len, "%s\"%s\":\"%s\"", pairs ? "," : "", variable, result);
     }
-    else
+    len += snprintf(json + len, json_size - len, "},\"applied\":%d,\"failed\":%d}", applied, failed);
+    Serial.printf("Control: %d applied, %d failed\n", applied, failed);
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, json, len);
+}
+
+// POST /api/camera {"framesize":5,"quality":12,"awb":1,...}
+// Applies the whole set between two frames and writes only the settings that
+// differ from the sensor's cached status:
+// {"writes":1,"results":{"framesize":"unchanged","quality":"written","bogus":"unknown"}}
+static esp_err_t camera_post_handler(httpd_req_t *req)
+{
+    req_arena_scope scope(&control_arena);
+    char *body = control_body(req, 1024);
+    if (!body)
     {
-        httpd_resp_send_404(req);
         return ESP_FAIL;
     }
-
-    int val = atoi(value);
-    Serial.println(val);
-    Serial.println(variable);
-    sensor_t *s = esp_camera_sensor_get();
-    int res = 0;
-
-    if (!strcmp(variable, "framesize"))
-    {
-        if (s->pixformat == PIXFORMAT_JPEG)
-            res = s->set_framesize(s, (framesize_t)val);
-    }
-    else if (!strcmp(variable, "quality"))
-        res = s->set_quality(s, val);
-    else if (!strcmp(variable, "contrast"))
-        res = s->set_contrast(s, val);
-    else if (!strcmp(variable, "brightness"))
-        res = s->set_brightness(s, val);
-    else if (!strcmp(variable, "saturation"))
-        res = s->set_saturation(s, val);
-    else if (!strcmp(variable, "gainceiling"))
-        res = s->set_gainceiling(s, (gainceiling_t)val);
-    else if (!strcmp(variable, "colorbar"))
-        res = s->set_colorbar(s, val);
-    else if (!strcmp(variable, "awb"))
-        res = s->set_whitebal(s, val);
-    else if (!strcmp(variable, "agc"))
-        res = s->set_gain_ctrl(s, val);
-    else if (!strcmp(variable, "aec"))
-        res = s->set_exposure_ctrl(s, val);
-    else if (!strcmp(variable, "hmirror"))
-        res = s->set_hmirror(s, val);
-    else if (!strcmp(variable, "vflip"))
-        res = s->set_vflip(s, val);
-    else if (!strcmp(variable, "awb_gain"))
-        res = s->set_awb_gain(s, val);
-    else if (!strcmp(variable, "agc_gain"))
-        res = s->set_agc_gain(s, val);
-    else if (!strcmp(variable, "aec_value"))
-        res = s->set_aec_value(s, val);
-    else if (!strcmp(variable, "aec2"))
-        res = s->set_aec2(s, val);
-    else if (!strcmp(variable, "dcw"))
-        res = s->set_dcw(s, val);
-    else if (!strcmp(variable, "bpc"))
-        res = s->set_bpc(s, val);
-    else if (!strcmp(variable, "wpc"))
-        res = s->set_wpc(s, val);
-    else if (!strcmp(variable, "raw_gma"))
-        res = s->set_raw_gma(s, val);
-    else if (!strcmp(variable, "lenc"))
-        res = s->set_lenc(s, val);
-    else if (!strcmp(variable, "special_effect"))
-        res = s->set_special_effect(s, val);
-    else if (!strcmp(variable, "wb_mode"))
-        res = s->set_wb_mode(s, val);
-    else if (!strcmp(variable, "ae_level"))
-        res = s->set_ae_level(s, val);
-    else
+    ArenaJsonDocument doc(1024, &control_arena);
+    if (!control_doc_ready(req, doc))
     {
-        res = -1;
+        return ESP_FAIL;
     }
-
-    if (res)
+    if (deserializeJson(doc, body) || !doc.is<JsonObject>())
     {
-        return httpd_resp_send_500(req);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid json");
+        return ESP_FAIL;
     }
+    JsonObject settings = doc.as<JsonObject>();
 
-    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-    return httpd_resp_send(req, NULL, 0);
+    ArenaJsonDocument resp(1536, &control_arena);
+    if (!control_doc_ready(req, resp))
+    {
+        return ESP_FAIL;
+    }
+    JsonObject results = resp.createNestedObject("results");
+    int writes;
+    {
+        std::unique_lock<std::mutex> guard(camera_txn.lock);
+        memset(camera_txn.requested, 0, sizeof(camera_txn.requested));
+        for (JsonPair kv : settings)
+        {
+            const control_t *c = control_find(kv.key().c_str());
+            if (!c)
+            {
+                results[kv.key().c_str()] = "unknown";
+            }
+            else if (!kv.value().is<int>())
+            {
+                results[kv.key().c_str()] = "bad_value";
+            }
+            else
+            {
+                camera_txn.requested[c - controls] = true;
+                camera_txn.value[c - controls] = kv.value().as<int>();
+            }
+        }
+        camera_txn.pending = true;
+        if (!frame_hub_subscriber_count(&camera_hub))
+        {
+            // capture is idle, no frame is at stake
+            camera_txn_apply_locked();
+        }
+        else if (!camera_txn.cond.wait_for(guard, std::chrono::milliseconds(CAMERA_TXN_WAIT_MS),
+                                           [] { return !camera_txn.pending; }))
+        {
+            // the camera stalled; don't hold the request for it
+            camera_txn_apply_locked();
+        }
+        for (int i = 0; i < CONTROL_COUNT; i++)
+        {
+            if (camera_txn.requested[i])
+            {
+                results[controls[i].name] = camera_txn.result[i];
+            }
+        }
+        writes = camera_txn.writes;
+    }
+    resp["writes"] = writes;
+    Serial.printf("Camera: %d sensor writes\n", writes);
+    return control_send_json(req, resp);
 }
 
-static esp_err_t status_handler(httpd_req_t *req)
+// Last rendered /status document and the generation it describes
+static struct
 {
-    static char json_response[1024];
+    std::mutex lock;
+    uint32_t generation;
+    size_t len;
+    char json[1024];
+} status_doc;
 
+static size_t status_render(char *json)
+{
     sensor_t *s = esp_camera_sensor_get();
-    char *p = json_response;
+    char *p = json;
     *p++ = '{';
 
     p += sprintf(p, "\"framesize\":%u,", s->status.framesize);
@@ -370,12 +1566,43 @@ static esp_err_t status_handler(httpd_req_t *req)
     p += sprintf(p, "\"vflip\":%u,", s->status.vflip);
     p += sprintf(p, "\"hmirror\":%u,", s->status.hmirror);
     p += sprintf(p, "\"dcw\":%u,", s->status.dcw);
-    p += sprintf(p, "\"colorbar\":%u", s->status.colorbar);
+    p += sprintf(p, "\"colorbar\":%u,", s->status.colorbar);
+    p += sprintf(p, "\"adaptive\":%u,", adaptive_enabled ? 1 : 0);
+    p += sprintf(p, "\"target_fps\":%d", (int)adaptive_target_fps);
     *p++ = '}';
-    *p++ = 0;
-    httpd_resp_set_type(req, "application/json");
+    *p = 0;
+    return p - json;
+}
+
+// The document is rendered again only after status_generation moved. Its
+// strong ETag (boot id and generation) lets pollers revalidate with
+// If-None-Match and get a bodiless 304 while nothing changed.
+static esp_err_t status_handler(httpd_req_t *req)
+{
+    static const uint32_t boot_id = esp_random();
+    uint32_t generation = status_generation;
+    char etag[24];
+    snprintf(etag, sizeof(etag), "\"%08x-%u\"", boot_id, generation);
+
     httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-    return httpd_resp_send(req, json_response, strlen(json_response));
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "ETag", etag);
+    char match[64];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", match, sizeof(match)) == ESP_OK && strstr(match, etag))
+    {
+        httpd_resp_set_status(req, "304 Not Modified");
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    std::lock_guard<std::mutex> guard(status_doc.lock);
+    if (status_doc.generation != generation || !status_doc.len)
+    {
+        // a change landing meanwhile bumps the generation again, so the next poll re-renders
+        status_doc.len = status_render(status_doc.json);
+        status_doc.generation = generation;
+    }
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_send(req, status_doc.json, status_doc.len);
 }
 
 static esp_err_t index_handler(httpd_req_t *req)
@@ -554,213 +1781,398 @@ static esp_err_t index_handler(httpd_req_t *req)
 static esp_err_t Test1_handler(httpd_req_t *req)
 {
     Serial.println("Test1_handler...");
-    char *buf;
-    size_t buf_len;
+    req_arena_scope scope(&control_arena);
     char variable[32] = {
         0,
     };
-    char value[32] = {
-        0,
-    };
-    buf_len = httpd_req_get_url_query_len(req) + 1;
-    if (buf_len > 1)
+    char *buf = control_query(req);
+    if (!buf)
+    {
+        return ESP_FAIL;
+    }
+    if (httpd_query_key_value(buf, "var", variable, sizeof(variable)) == ESP_OK)
+    {
+        // Serial2.println(variable);
+    }
+    else
+    {
+        httpd_resp_send_404(req);
+        return ESP_FAIL;
+    }
+
+    // httpd_resp_send(req, (const char *)"index", 5);
+    return ESP_OK;
+}
+
+static esp_err_t Test2_handler(httpd_req_t *req)
+{
+    Serial.println("Test2_handler...");
+
+    //  httpd_resp_send(req, (const char *)"index", 5);
+    httpd_resp_send(req, (const char *)"index", 5);
+    return ESP_OK;
+}
+
+// Helper: send a command to the Arduino and wait for the reply carrying its id,
+// {<id>_ok} or a JSON object echoing "H". Replies are matched by the car link's
+// reader task, so this returns as soon as the car answers.
+static bool sendCommandAndWaitReply(const car_cmd_t &cmd, uint32_t timeoutMs, car_result_t *result = NULL)
+{
+    car_result_t local;
+    car_result_t *r = result ? result : &local;
+    car_status_t status = car_link_call(&car_link, &cmd, timeoutMs, r);
+    if (status != CAR_OK)
+    {
+        Serial.printf("Command %s: %s\n", cmd.id,
+                      status == CAR_TIMEOUT    ? "timed out"
+                      : status == CAR_REJECTED ? "rejected"
+                      : status == CAR_CANCELLED ? "cancelled by a stop"
+                                                : "not sent");
+        return false;
+    }
+    Serial.printf("Command %s: %s in %ums\n", cmd.id, r->reply, (uint32_t)(r->rtt_us / 1000));
+    return true;
+}
+#define PATH_WINDOW 4 // commands in flight unless ?window= says otherwise
+
+// Path jobs: POST /api/path only parses and queues the path, path_job_task
+// feeds it to the car, so camera_httpd keeps answering while a long path runs.
+// Finished jobs stay readable until their slot is needed again.
+#define PATH_JOB_SLOTS 4
+#define PATH_JOB_MAX_ACTIONS 64
+#define PATH_JOB_TIMEOUT_MS 3000
+
+typedef enum
+{
+    PATH_JOB_FREE,
+    PATH_JOB_QUEUED,
+    PATH_JOB_RUNNING,
+    PATH_JOB_DONE,
+    PATH_JOB_CANCELLED,
+} path_job_state_t;
+
+typedef struct
+{
+    uint32_t id;
+    path_job_state_t state;
+    bool cancel;    // DELETE while it ran
+    uint32_t epoch; // car link epoch when queued; a stop since then drops the job
+    size_t window;
+    size_t n; // actions
+    size_t m; // commands after coalescing
+    car_cmd_t cmds[PATH_JOB_MAX_ACTIONS];
+    car_cmd_t sent[PATH_JOB_MAX_ACTIONS];
+    int origin[PATH_JOB_MAX_ACTIONS];
+    car_outcome_t outcomes[PATH_JOB_MAX_ACTIONS]; // read through car_link_outcomes()
+    int64_t queued_us;
+    int64_t finished_us;
+} path_job_t;
+
+// Everything but cmds/sent/origin, which are fixed once queued, is guarded by lock
+static struct
+{
+    std::mutex lock;
+    std::condition_variable cond;
+    uint32_t next_id;
+    path_job_t jobs[PATH_JOB_SLOTS];
+} path_jobs;
+
+static path_job_t *path_job_find_locked(uint32_t id)
+{
+    for (int i = 0; i < PATH_JOB_SLOTS; i++)
+    {
+        if (path_jobs.jobs[i].state != PATH_JOB_FREE && path_jobs.jobs[i].id == id)
+            return &path_jobs.jobs[i];
+    }
+    return NULL;
+}
+
+// A free slot, else the oldest finished job; NULL while all are queued or running
+static path_job_t *path_job_slot_locked(void)
+{
+    path_job_t *oldest = NULL;
+    for (int i = 0; i < PATH_JOB_SLOTS; i++)
     {
-        buf = (char *)malloc(buf_len);
-        if (!buf)
-        {
-            httpd_resp_send_500(req);
-            return ESP_FAIL;
-        }
-        if (httpd_req_get_url_query_str(req, buf, buf_len) == ESP_OK)
+        path_job_t *job = &path_jobs.jobs[i];
+        if (job->state == PATH_JOB_FREE)
+            return job;
+        if ((job->state == PATH_JOB_DONE || job->state == PATH_JOB_CANCELLED) && (!oldest || job->id < oldest->id))
+            oldest = job;
+    }
+    return oldest;
+}
+
+static void path_job_task(void *arg)
+{
+    while (true)
+    {
+        path_job_t *job = NULL;
         {
-            if (httpd_query_key_value(buf, "var", variable, sizeof(variable)) == ESP_OK)
+            std::unique_lock<std::mutex> guard(path_jobs.lock);
+            while (!job)
             {
-               // Serial2.println(variable);
+                for (int i = 0; i < PATH_JOB_SLOTS; i++)
+                {
+                    path_job_t *j = &path_jobs.jobs[i];
+                    if (j->state == PATH_JOB_QUEUED && (!job || j->id < job->id))
+                        job = j;
+                }
+                if (!job)
+                    path_jobs.cond.wait(guard);
             }
-            else
+            if (car_link_epoch(&car_link) != job->epoch)
             {
-                free(buf);
-                httpd_resp_send_404(req);
-                return ESP_FAIL;
+                // stopped after it was queued
+                job->state = PATH_JOB_CANCELLED;
+                job->finished_us = esp_timer_get_time();
+                continue;
             }
+            job->state = PATH_JOB_RUNNING;
         }
-        else
+
+        int64_t start = esp_timer_get_time();
+        // against the epoch from queuing: a stop between the check above and here
+        // still cancels the whole job
+        size_t ok = car_link_pipeline_at(&car_link, job->sent, job->m, job->window, PATH_JOB_TIMEOUT_MS,
+                                         job->outcomes, job->epoch);
+        Serial.printf("Path job %u: %u actions as %u commands, %u acked in %ums, window %u\n", job->id, (uint32_t)job->n,
+                      (uint32_t)job->m, (uint32_t)ok, (uint32_t)((esp_timer_get_time() - start) / 1000),
+                      (uint32_t)job->window);
+
+        std::lock_guard<std::mutex> guard(path_jobs.lock);
+        bool cancelled = job->cancel;
+        for (size_t i = 0; i < job->m; i++)
         {
-            free(buf);
-            httpd_resp_send_404(req);
-            return ESP_FAIL;
+            cancelled |= job->outcomes[i].status == CAR_CANCELLED;
         }
-        free(buf);
+        job->state = cancelled ? PATH_JOB_CANCELLED : PATH_JOB_DONE;
+        job->finished_us = esp_timer_get_time();
     }
-    else
+}
+
+static const char *path_job_state_name(path_job_state_t state)
+{
+    switch (state)
     {
-        httpd_resp_send_404(req);
-        return ESP_FAIL;
+    case PATH_JOB_QUEUED:
+        return "queued";
+    case PATH_JOB_RUNNING:
+        return "running";
+    case PATH_JOB_DONE:
+        return "done";
+    case PATH_JOB_CANCELLED:
+        return "cancelled";
+    default:
+        return "free";
     }
-
-    // httpd_resp_send(req, (const char *)"index", 5);
-    return ESP_OK;
 }
 
-static esp_err_t Test2_handler(httpd_req_t *req)
+// {"job":7,"state":"running","actions":3,"commands":2,"acked":1,"elapsed_ms":840,
+//  "progress":[{"id":"m001","status":"ok"},{"id":"m002","status":"ok"},{"id":"t001","status":"pending"}]}
+// An action merged into another command reports that command's status.
+static esp_err_t path_job_send(httpd_req_t *req, path_job_t *job)
 {
-    Serial.println("Test2_handler...");
+    car_outcome_t outcomes[PATH_JOB_MAX_ACTIONS];
+    path_job_state_t state;
+    int64_t end;
+    {
+        std::lock_guard<std::mutex> guard(path_jobs.lock);
+        state = job->state;
+        end = state == PATH_JOB_DONE || state == PATH_JOB_CANCELLED ? job->finished_us : esp_timer_get_time();
+        car_link_outcomes(&car_link, job->outcomes, job->m, outcomes);
+    }
 
-    //  httpd_resp_send(req, (const char *)"index", 5);
-    httpd_resp_send(req, (const char *)"index", 5);
-    return ESP_OK;
+    ArenaJsonDocument resp(JSON_OBJECT_SIZE(7) + JSON_ARRAY_SIZE(job->n) + job->n * JSON_OBJECT_SIZE(2),
+                           &control_arena);
+    if (!control_doc_ready(req, resp))
+    {
+        return ESP_FAIL;
+    }
+    resp["job"] = job->id;
+    resp["state"] = path_job_state_name(state);
+    resp["actions"] = job->n;
+    resp["commands"] = job->m;
+    resp["elapsed_ms"] = (uint32_t)((end - job->queued_us) / 1000);
+    JsonArray progress = resp.createNestedArray("progress");
+    size_t acked = 0;
+    for (size_t i = 0; i < job->n; i++)
+    {
+        car_status_t status = job->origin[i] == PATH_COALESCE_NOOP ? CAR_OK : outcomes[job->origin[i]].status;
+        const char *name = status == CAR_OK          ? "ok"
+                           : status == CAR_PENDING   ? (state == PATH_JOB_CANCELLED ? "cancelled" : "pending")
+                           : status == CAR_CANCELLED ? "cancelled"
+                           : status == CAR_TIMEOUT   ? "timeout"
+                           : status == CAR_REJECTED  ? "rejected"
+                                                     : "fail";
+        acked += status == CAR_OK;
+        JsonObject action = progress.createNestedObject();
+        action["id"] = (const char *)job->cmds[i].id;
+        action["status"] = name;
+    }
+    resp["acked"] = acked;
+    return control_send_json(req, resp);
 }
 
-// Helper: send a frame string over Serial2 and wait for Arduino ack of form {<id>_ok}
-static bool sendFrameAndWaitAck(const String &frame, const String &id, uint32_t timeoutMs = 800)
+// Job id from /api/path/<id>[?...]; NULL once a 404 went out
+static path_job_t *path_job_from_uri(httpd_req_t *req, std::unique_lock<std::mutex> &guard)
 {
-    
-    // send frame
-    Serial2.print(frame);
-    Serial.print("sent command for queueing ");
-    Serial.println(frame);
-    unsigned long start = millis();
-    String buf = "";
-delay(500);
-    while (millis() - start < timeoutMs)
+    const char *at = req->uri + strlen("/api/path/");
+    char *end;
+    unsigned long id = strtoul(at, &end, 10);
+    path_job_t *job = end != at && (!*end || *end == '?') ? path_job_find_locked((uint32_t)id) : NULL;
+    if (!job)
     {
-        while (Serial2.available())
-        {
-            buf = Serial2.readString();
-            Serial.print("Received: ");
-            Serial.println(buf);
-            if(buf.length() > 0){
-                return true;
-            }
-        }
-        delay(5);
+        guard.unlock();
+        httpd_resp_send_404(req);
+    }
+    return job;
+}
+
+// GET /api/path/<id>
+static esp_err_t path_get_handler(httpd_req_t *req)
+{
+    req_arena_scope scope(&control_arena);
+    std::unique_lock<std::mutex> guard(path_jobs.lock);
+    path_job_t *job = path_job_from_uri(req, guard);
+    if (!job)
+    {
+        return ESP_FAIL;
     }
-    Serial.print("timed out");
-    return false; // timeout
+    guard.unlock();
+    // only handlers on this task reuse slots, so job stays put
+    return path_job_send(req, job);
 }
-// Helper: send a frame over Serial2 and wait for a JSON object response (returns true + fills outJson)
-static bool sendFrameAndWaitJsonResponse(const String &frame, String &outJson, uint32_t timeoutMs = 3000)
+
+// DELETE /api/path/<id>
+// A queued job is dropped; a running one is cut short with a stop on the
+// priority lane, which also cancels whatever else is in flight to the car.
+// Jobs queued behind it survive: that stop was only meant for this job.
+static esp_err_t path_delete_handler(httpd_req_t *req)
 {
- 
-    // send frame
-    Serial2.print(frame);
-    Serial.print("Sent frame: ");
-    Serial.println(frame);
-    
-    unsigned long start = millis();
-    String buf = "";
-    delay(500);
-    bool ok = Serial2.available();
-    Serial.print(ok);
-    while (millis() - start < timeoutMs)
+    req_arena_scope scope(&control_arena);
+    std::unique_lock<std::mutex> guard(path_jobs.lock);
+    path_job_t *job = path_job_from_uri(req, guard);
+    if (!job)
+    {
+        return ESP_FAIL;
+    }
+    bool running = job->state == PATH_JOB_RUNNING;
+    if (job->state == PATH_JOB_QUEUED)
+    {
+        job->state = PATH_JOB_CANCELLED;
+        job->finished_us = esp_timer_get_time();
+    }
+    job->cancel = running;
+    if (running)
     {
-        while (Serial2.available())
+        // still under the lock, so path_job_task can't pick a queued job up
+        // between the preempt and the re-stamp
+        uint32_t before = car_link_epoch(&car_link);
+        car_cmd_t stop = car_cmd_stop();
+        car_link_preempt(&car_link, &stop, 0, NULL);
+        uint32_t after = car_link_epoch(&car_link);
+        // if another stop got in as well, the queued jobs go with it
+        for (int i = 0; i < PATH_JOB_SLOTS && after == before + 1; i++)
         {
-        outJson = Serial2.readString();
-        if(outJson.length()>0){
-            return true;
+            path_job_t *j = &path_jobs.jobs[i];
+            if (j->state == PATH_JOB_QUEUED && j->epoch == before)
+                j->epoch = after;
         }
+        Serial.printf("Path job %u cancelled\n", job->id);
     }
+    guard.unlock();
+    return path_job_send(req, job);
 }
-// Serial.print("\nTimeout! Received ");
-// Serial.print(frame_from_arduino.length());
-// Serial.println(" chars total");
-// Serial.println(frame_from_arduino);
-return false; // timeout
-}
+
 // POST /api/path
 // Accepts single action {"cmd":"move","d":5.0,"dir":1,"id":"m001"} or {"cmd":"turn","a":90,"id":"t001"}
-// or an array of such objects. Converts to Arduino protocol and forwards per-action.
+// or an array of such objects. Converts to Arduino protocol, merges actions that
+// make one motion (path_coalesce.h) and queues the path as a job. Answers
+// 202 Accepted right away, {"job":7,"location":"/api/path/7","actions":3,"commands":2},
+// and reports an ack per action at the job's location.
 static esp_err_t path_post_handler(httpd_req_t *req)
 {
-    size_t content_len = req->content_len;
-    if (content_len == 0 || content_len > 4096)
+    req_arena_scope scope(&control_arena);
+    char *body = control_body(req, 4096);
+    if (!body)
     {
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "bad body");
         return ESP_FAIL;
     }
 
-    char *body = (char *)malloc(content_len + 1);
-    if (!body)
+    // Parse JSON; strings stay in body
+    ArenaJsonDocument doc(4096, &control_arena);
+    if (!control_doc_ready(req, doc))
     {
-        httpd_resp_send_500(req);
         return ESP_FAIL;
     }
-    size_t received = 0;
-    while (received < content_len)
-    {
-        int ret = httpd_req_recv(req, body + received, content_len - received);
-        if (ret <= 0)
-        {
-            free(body);
-            httpd_resp_send_500(req);
-            return ESP_FAIL;
-        }
-        received += ret;
-    }
-    body[content_len] = '\0';
-
-    // Parse JSON
-    DynamicJsonDocument doc(4096);
     DeserializationError err = deserializeJson(doc, body);
-    free(body);
     if (err)
     {
-          Serial.print(F("deserializeJson() failed: "));
-    Serial.println(err.c_str());
+        Serial.print(F("deserializeJson() failed: "));
+        Serial.println(err.c_str());
         httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid json");
         return ESP_FAIL;
     }
 
-    // Prepare response JSON
-    DynamicJsonDocument resp(1024);
-    JsonArray acks = resp.createNestedArray("acks");
+    // Ids for actions that bring none; counted like baud_cmd() so two in
+    // flight never share one
+    static uint32_t made_ids = 0;
 
-    // Helper to process a single action object
-    auto processAction = [&](JsonObject action) {
+    // Helper to turn a single action object into a car command
+    auto toCommand = [&](JsonObject action, car_cmd_t *command) -> bool {
         const char *cmd = action["cmd"] | "";
-        String id = action["id"] | "";
-        String frame;
+        const char *id = action["id"] | "";
+        char made[8];
         if (strcmp(cmd, "move") == 0)
         {
             float meters = action["d"] | 0.0f;
             int dir = action["dir"] | 1;
             uint32_t cm = (uint32_t)round(meters * 100.0f);
-            if (id.length() == 0)
+            if (!*id)
             {
-                id = String("m") + String(random(1, 10000));
+                snprintf(made, sizeof(made), "m%u", (unsigned)(++made_ids % 10000));
+                id = made;
             }
-            frame = String("{\"N\":200,\"D1\":") + String(dir) + String(",\"D2\":") + String(cm) + String(",\"H\":\"") + id + String("\"}");
+            *command = car_cmd_move(dir, cm, id);
         }
         else if (strcmp(cmd, "turn") == 0)
         {
             int angle = action["a"] | 0;
-            if (id.length() == 0)
+            if (!*id)
             {
-                id = String("t") + String(random(1, 10000));
+                snprintf(made, sizeof(made), "t%u", (unsigned)(++made_ids % 10000));
+                id = made;
             }
-            frame = String("{\"N\":201,\"D1\":") + String(angle) + String(",\"H\":\"") + id + String("\"}");
+            *command = car_cmd_turn(angle, id);
         }
         else
         {
-            return; // ignore unknown
+            return false; // ignore unknown
         }
-
-        bool ok = sendFrameAndWaitAck(frame, id, 3000);
-        if (ok)
-            acks.add(id + String("_ok"));
-        else
-            acks.add(String("{\"id\":\"") + id + String("\",\"status\":\"fail\"}"));
+        return true;
     };
 
+    size_t count = doc.is<JsonArray>() ? doc.size() : 1;
+    if (count > PATH_JOB_MAX_ACTIONS)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "too many actions");
+        return ESP_FAIL;
+    }
+    car_cmd_t *cmds = (car_cmd_t *)req_arena_alloc(&control_arena, count * sizeof(car_cmd_t));
+    if (!cmds)
+    {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+    size_t n = 0;
     if (doc.is<JsonArray>())
     {
         for (JsonObject item : doc.as<JsonArray>())
-            processAction(item);
+            n += toCommand(item, &cmds[n]);
     }
     else if (doc.is<JsonObject>())
     {
-        processAction(doc.as<JsonObject>());
+        n += toCommand(doc.as<JsonObject>(), &cmds[n]);
     }
     else
     {
@@ -768,43 +2180,443 @@ static esp_err_t path_post_handler(httpd_req_t *req)
         return ESP_FAIL;
     }
 
-    String out;
-    serializeJson(resp, out);
+    // Keep up to ?window=K commands awaiting their ack; the car queues them and
+    // answers each by id, so a path costs about one round trip per K actions
+    size_t window = PATH_WINDOW;
+    bool coalesce = true;
+    char query[48];
+    char value[8];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
+    {
+        if (httpd_query_key_value(query, "window", value, sizeof(value)) == ESP_OK)
+        {
+            window = constrain(atoi(value), 1, CAR_LINK_MAX_PENDING);
+        }
+        if (httpd_query_key_value(query, "coalesce", value, sizeof(value)) == ESP_OK)
+        {
+            coalesce = atoi(value) != 0;
+        }
+    }
+
+    // before the job is queued, so a full arena refuses the path instead of
+    // running it unannounced
+    ArenaJsonDocument resp(JSON_OBJECT_SIZE(4), &control_arena);
+    if (!control_doc_ready(req, resp))
+    {
+        return ESP_FAIL;
+    }
+
+    path_job_t *job;
+    {
+        std::lock_guard<std::mutex> guard(path_jobs.lock);
+        job = path_job_slot_locked();
+        if (!job)
+        {
+            httpd_resp_set_status(req, "503 Service Unavailable");
+            httpd_resp_set_hdr(req, "Retry-After", "1");
+            return httpd_resp_send(req, "path queue full", HTTPD_RESP_USE_STRLEN);
+        }
+        memcpy(job->cmds, cmds, n * sizeof(car_cmd_t));
+        // Fewer, longer commands for the same motion (?coalesce=0 sends every action as is)
+        job->m = n;
+        if (coalesce)
+        {
+            job->m = path_coalesce(job->cmds, n, job->sent, job->origin);
+        }
+        else
+        {
+            memcpy(job->sent, job->cmds, n * sizeof(car_cmd_t));
+            for (size_t i = 0; i < n; i++)
+                job->origin[i] = (int)i;
+        }
+        for (size_t i = 0; i < job->m; i++)
+        {
+            job->outcomes[i].status = CAR_PENDING;
+            job->outcomes[i].rtt_us = 0;
+        }
+        job->id = ++path_jobs.next_id;
+        job->n = n;
+        job->window = window;
+        job->cancel = false;
+        job->epoch = car_link_epoch(&car_link);
+        job->queued_us = esp_timer_get_time();
+        job->state = PATH_JOB_QUEUED;
+        path_jobs.cond.notify_all();
+    }
+
+    char location[32];
+    snprintf(location, sizeof(location), "/api/path/%u", job->id);
+    resp["job"] = job->id;
+    resp["location"] = (const char *)location;
+    resp["actions"] = job->n;
+    resp["commands"] = job->m;
+    httpd_resp_set_status(req, "202 Accepted");
+    httpd_resp_set_hdr(req, "Location", location);
+    return control_send_json(req, resp);
+}
+
+// GET/POST /api/stop
+// Stops the car ahead of any queued motion and cancels what is still pending
+// (car_link_preempt), including the running path job and every queued one. Reports how long the stop took to reach the wire:
+// {"latency_us":850,"max_us":2100,"cancelled":3}
+static esp_err_t stop_handler(httpd_req_t *req)
+{
+    car_link_stats_t before = car_link_stats(&car_link);
+    car_cmd_t stop = car_cmd_stop();
+    if (car_link_preempt(&car_link, &stop, 0, NULL) != CAR_OK)
+    {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+    car_link_stats_t after = car_link_stats(&car_link);
+    char out[96];
+    int n = snprintf(out, sizeof(out), "{\"latency_us\":%lld,\"max_us\":%lld,\"cancelled\":%u}",
+                     (long long)after.preempt_last_us, (long long)after.preempt_max_us,
+                     after.cancelled - before.cancelled);
     httpd_resp_set_type(req, "application/json");
     httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-    httpd_resp_send(req, out.c_str(), out.length());
+    httpd_resp_send(req, out, n);
     return ESP_OK;
 }
 
+// Pose telemetry: the car streams its pose every POSE_STREAM_PERIOD_MS and the
+// task below copies it into pose_cache, so /api/pose and the stream parts read
+// memory instead of asking the car. Car firmware without streaming rejects or
+// ignores the subscription; /api/pose then falls back to asking with N=300.
+#define POSE_STREAM_PERIOD_MS 100
+#define POSE_STALE_US (5 * POSE_STREAM_PERIOD_MS * 1000LL) // older: the stream has stopped
+#define POSE_RETRY_MIN_MS 2000
+#define POSE_RETRY_MAX_MS 60000
+
+static void pose_stream_task(void *arg)
+{
+    int64_t last_pose_us = 0;
+    int64_t next_subscribe_us = 0;
+    uint32_t retry_ms = POSE_RETRY_MIN_MS;
+    while (true)
+    {
+        car_frame_t frame;
+        while (car_frame_queue_pop(&pose_frames, &frame))
+        {
+            last_pose_us = esp_timer_get_time();
+            pose_cache_store_reply(frame.text, frame.len, last_pose_us);
+        }
+        int64_t now = esp_timer_get_time();
+        if (now - last_pose_us > POSE_STALE_US && now >= next_subscribe_us)
+        {
+            // first start, a car reset or old firmware; back off for the latter
+            car_cmd_t cmd = car_cmd_pose_stream(POSE_STREAM_PERIOD_MS, "psub");
+            bool accepted = car_link_call(&car_link, &cmd, 500, NULL) == CAR_OK;
+            retry_ms = accepted ? POSE_RETRY_MIN_MS : min(retry_ms * 2, (uint32_t)POSE_RETRY_MAX_MS);
+            next_subscribe_us = esp_timer_get_time() + retry_ms * 1000LL;
+        }
+        vTaskDelay(20 / portTICK_PERIOD_MS);
+    }
+}
+
 // GET /api/pose
-// Query the Arduino for current estimated pose via N=300. Returns the Arduino JSON directly.
+// Latest pose with its age: {"pose":{"x":..,"y":..,"th":..,"v":..},"age_us":12345}.
+// Answered from memory while the car streams; otherwise queries it via N=300.
 static esp_err_t pose_get_handler(httpd_req_t *req)
 {
-    // construct a random id so Arduino will echo it in H
-    String id = String("p") + String(random(1000, 9999));
-    String frame = String("{\"N\":300,\"H\":\"") + id + String("\"}");
-    String respJson;
-    Serial.println("\n=== Pose Query Start ===");
-    Serial.print("Sending: ");
-    Serial.println(frame);
-        
-    bool ok = sendFrameAndWaitJsonResponse(frame, respJson, 3000);
-    Serial.print("recieved ");
-    Serial.print(respJson);
-    Serial.println("=== Pose Query End ===\n");
-    
-    if (!ok)
-    {
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "no response");
-        return ESP_FAIL;
+    char pose[POSE_CACHE_TEXT_LEN];
+    int64_t stamp_us = 0;
+    int len = pose_cache_read(pose, sizeof(pose), &stamp_us);
+    if (len < 0 || esp_timer_get_time() - stamp_us > POSE_STALE_US)
+    {
+        // construct a random id so Arduino will echo it in H
+        char id[8];
+        snprintf(id, sizeof(id), "p%ld", random(1000, 9999));
+        car_result_t reply;
+        if (!sendCommandAndWaitReply(car_cmd_pose(id), 3000, &reply) ||
+            !pose_cache_store_reply(reply.reply, reply.reply_len, esp_timer_get_time()) ||
+            (len = pose_cache_read(pose, sizeof(pose), &stamp_us)) < 0)
+        {
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "no response");
+            return ESP_FAIL;
+        }
     }
-    // respJson contains the Arduino response JSON (e.g. {"H":"p1234","pose":{"x":...,"v":...}})
+    char out[POSE_CACHE_TEXT_LEN + 48];
+    int n = snprintf(out, sizeof(out), "{\"pose\":%s,\"age_us\":%lld}", pose,
+                     (long long)(esp_timer_get_time() - stamp_us));
     httpd_resp_set_type(req, "application/json");
     httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-    httpd_resp_send(req, respJson.c_str(), respJson.length());
+    httpd_resp_send(req, out, n);
     return ESP_OK;
 }
 
+// Pre-event buffer: while armed, which it is from boot, the recorder keeps the
+// last seconds of video in PSRAM whether anyone watches or not, so /api/clip can
+// hand out what led up to an incident. Armed, it keeps camera_hub subscribed and
+// the camera capturing; disarmed (/api/clip?arm=0), capture idles again when no
+// one streams. It copies frames in its own task; capture and streaming never
+// wait for it.
+#define CLIP_BUDGET_BYTES (1536 * 1024)
+#define CLIP_MAX_SECONDS 10
+#define CLIP_MAX_FPS 10
+#define CLIP_INDEX_BATCH 32
+#define CLIP_ARMED_AT_BOOT true
+
+static clip_ring_t clip_ring;
+static std::atomic<bool> clip_armed(CLIP_ARMED_AT_BOOT);
+
+static void clip_record_task(void *arg)
+{
+    frame_sub_t *sub = NULL;
+    int64_t next = 0;
+    while (true)
+    {
+        if (!clip_armed)
+        {
+            if (sub)
+            {
+                // keep what was recorded for export, but let capture idle
+                frame_hub_unsubscribe(&camera_hub, sub);
+                sub = NULL;
+            }
+            vTaskDelay(pdMS_TO_TICKS(250));
+            continue;
+        }
+        if (!sub && !(sub = frame_hub_subscribe(&camera_hub)))
+        {
+            Serial.println("Clip recorder: no free subscriber");
+            vTaskDelay(pdMS_TO_TICKS(1000));
+            continue;
+        }
+        frame_ref_t *frame = frame_hub_take(&camera_hub, sub, 1000);
+        if (!frame)
+        {
+            continue;
+        }
+        if (frame->timestamp_us >= next)
+        {
+            next = frame->timestamp_us + 1000000 / CLIP_MAX_FPS;
+            clip_ring_push(&clip_ring, frame->buf, frame->len, frame->width, frame->height, frame->timestamp_us);
+        }
+        frame_ref_release(frame);
+    }
+}
+
+typedef struct
+{
+    mjpeg_avi_info_t avi;
+    int64_t first_us;
+    int64_t last_us;
+} clip_measure_t;
+
+static bool clip_measure(void *arg, const clip_frame_t *frame, const uint8_t *jpg)
+{
+    clip_measure_t *m = (clip_measure_t *)arg;
+    if (!m->avi.frames)
+    {
+        m->first_us = frame->timestamp_us;
+    }
+    m->last_us = frame->timestamp_us;
+    m->avi.frames++;
+    m->avi.frame_bytes += mjpeg_avi_padded(frame->len);
+    if (frame->len > m->avi.max_frame_len)
+    {
+        m->avi.max_frame_len = frame->len;
+    }
+    // the adaptive controller may have changed the framesize; announce the largest
+    if (frame->width > m->avi.width)
+    {
+        m->avi.width = frame->width;
+        m->avi.height = frame->height;
+    }
+    return true;
+}
+
+typedef struct
+{
+    httpd_req_t *req;
+    esp_err_t res;
+    uint32_t offset; // movi-relative, for the index
+    uint8_t index[CLIP_INDEX_BATCH * MJPEG_AVI_INDEX_ENTRY_LEN];
+    size_t index_len;
+} clip_export_t;
+
+static bool clip_send_frame(void *arg, const clip_frame_t *frame, const uint8_t *jpg)
+{
+    clip_export_t *ex = (clip_export_t *)arg;
+    uint8_t chunk[MJPEG_AVI_CHUNK_LEN];
+    mjpeg_avi_chunk(chunk, frame->len);
+    ex->res = httpd_resp_send_chunk(ex->req, (const char *)chunk, sizeof(chunk));
+    if (ex->res == ESP_OK)
+    {
+        ex->res = httpd_resp_send_chunk(ex->req, (const char *)jpg, frame->len);
+    }
+    if (ex->res == ESP_OK && (frame->len & 1))
+    {
+        ex->res = httpd_resp_send_chunk(ex->req, "", 1);
+    }
+    return ex->res == ESP_OK;
+}
+
+static bool clip_send_index(void *arg, const clip_frame_t *frame, const uint8_t *jpg)
+{
+    clip_export_t *ex = (clip_export_t *)arg;
+    if (ex->index_len == sizeof(ex->index))
+    {
+        ex->res = httpd_resp_send_chunk(ex->req, (const char *)ex->index, ex->index_len);
+        ex->index_len = 0;
+    }
+    ex->offset = mjpeg_avi_index_entry(ex->index + ex->index_len, ex->offset, frame->len);
+    ex->index_len += MJPEG_AVI_INDEX_ENTRY_LEN;
+    return ex->res == ESP_OK;
+}
+
+// GET /api/clip: the buffer as an MJPEG AVI, ?seconds=N for only the last N
+// seconds, ?info=1 for the buffer state as JSON, ?arm=1 / ?arm=0 to start or
+// stop recording (answered like ?info=1).
+static esp_err_t clip_handler(httpd_req_t *req)
+{
+    char query[64];
+    char value[16];
+    int seconds = 0;
+    bool info = false;
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
+    {
+        if (httpd_query_key_value(query, "seconds", value, sizeof(value)) == ESP_OK)
+        {
+            seconds = atoi(value);
+        }
+        info = httpd_query_key_value(query, "info", value, sizeof(value)) == ESP_OK;
+        if (httpd_query_key_value(query, "arm", value, sizeof(value)) == ESP_OK)
+        {
+            clip_armed = atoi(value) != 0;
+            info = true;
+        }
+    }
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+
+    clip_ring_stats_t st = clip_ring_stats(&clip_ring);
+    if (info)
+    {
+        char json[256];
+        int len = snprintf(json, sizeof(json),
+                           "{\"armed\":%s,\"frames\":%u,\"bytes\":%u,\"budget\":%u,\"span_ms\":%u,"
+                           "\"stored\":%u,\"evicted\":%u,\"rejected\":%u}",
+                           clip_armed ? "true" : "false", st.count, (uint32_t)st.frame_bytes, (uint32_t)st.size,
+                           (uint32_t)((st.newest_us - st.oldest_us) / 1000), st.stored, st.evicted, st.rejected);
+        httpd_resp_set_type(req, "application/json");
+        return httpd_resp_send(req, json, len);
+    }
+    if (!st.size)
+    {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No clip buffer (needs PSRAM)");
+        return ESP_FAIL;
+    }
+    if (!st.count)
+    {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND,
+                            clip_armed ? "Clip buffer is empty" : "Clip buffer is empty (not armed, see ?arm=1)");
+        return ESP_FAIL;
+    }
+
+    // Frozen, the ring can be read without the lock while the recorder skips frames
+    clip_ring_freeze(&clip_ring, true);
+    int64_t since = seconds > 0 ? clip_ring_stats(&clip_ring).newest_us - seconds * 1000000LL : 0;
+    clip_measure_t m;
+    memset(&m, 0, sizeof(m));
+    clip_ring_visit(&clip_ring, since, clip_measure, &m);
+    m.avi.us_per_frame = m.avi.frames > 1 ? (uint32_t)((m.last_us - m.first_us) / (m.avi.frames - 1)) : 1000000 / CLIP_MAX_FPS;
+
+    uint8_t header[MJPEG_AVI_HEADER_LEN];
+    mjpeg_avi_header(header, &m.avi);
+    httpd_resp_set_type(req, "video/x-msvideo");
+    httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=clip.avi");
+
+    clip_export_t ex;
+    ex.req = req;
+    ex.offset = 4;
+    ex.index_len = 0;
+    ex.res = httpd_resp_send_chunk(req, (const char *)header, sizeof(header));
+    if (ex.res == ESP_OK)
+    {
+        clip_ring_visit(&clip_ring, since, clip_send_frame, &ex);
+    }
+    if (ex.res == ESP_OK)
+    {
+        uint8_t idx[MJPEG_AVI_CHUNK_LEN];
+        mjpeg_avi_index(idx, m.avi.frames);
+        ex.res = httpd_resp_send_chunk(req, (const char *)idx, sizeof(idx));
+    }
+    if (ex.res == ESP_OK)
+    {
+        clip_ring_visit(&clip_ring, since, clip_send_index, &ex);
+    }
+    clip_ring_freeze(&clip_ring, false);
+    if (ex.res == ESP_OK && ex.index_len)
+    {
+        ex.res = httpd_resp_send_chunk(req, (const char *)ex.index, ex.index_len);
+    }
+    if (ex.res != ESP_OK)
+    {
+        Serial.println("Clip export aborted");
+        return ESP_FAIL;
+    }
+    Serial.printf("Clip: %u frames, %u bytes\n", m.avi.frames, (uint32_t)mjpeg_avi_file_len(&m.avi));
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+// GET /api/streams
+// Rolling per-client stream statistics, read without stalling the stream loops.
+static esp_err_t streams_get_handler(httpd_req_t *req)
+{
+    char buf[384];
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    // read under the hub lock; capture_task updates the counters
+    frame_hub_stats_t hub = frame_hub_stats(&camera_hub);
+    int len = snprintf(buf, sizeof(buf),
+                       "{\"published\":%u,\"overruns\":%u,\"copies\":%u,\"subscribers\":%d,\"streams\":[",
+                       hub.published, hub.overruns, hub.copies, frame_hub_subscriber_count(&camera_hub));
+    httpd_resp_send_chunk(req, buf, len);
+
+    int64_t now = esp_timer_get_time();
+    bool first = true;
+    for (int i = 0; i < STREAM_CLIENT_MAX; i++)
+    {
+        stream_client_t *c = &stream_clients[i];
+        stream_stats_t st;
+        uint32_t id;
+        const char *transport;
+        const char *source;
+        int64_t opened;
+        frame_sub_stats_t sub_stats = {0, 0, 0};
+        {
+            std::lock_guard<std::mutex> guard(stream_clients_lock);
+            if (!c->in_use)
+            {
+                continue;
+            }
+            stream_client_read(c, &st);
+            id = c->id;
+            transport = c->transport;
+            source = c->hub == &preview_hub ? "preview" : "camera";
+            opened = c->opened_us;
+            if (c->sub)
+            {
+                sub_stats = frame_hub_sub_stats(c->hub, c->sub);
+            }
+        }
+        float fps = st.interval_us ? 1000000.0f / st.interval_us : 0.0f;
+        uint32_t kbps = st.interval_us ? (uint32_t)((int64_t)st.size * 8000 / st.interval_us) : 0;
+        len = snprintf(buf, sizeof(buf),
+                       "%s{\"id\":%u,\"transport\":\"%s\",\"source\":\"%s\",\"uptime_ms\":%u,\"frames\":%u,\"bytes\":%u,"
+                       "\"dropped\":%u,\"skipped\":%u,\"fps\":%.1f,\"kbps\":%u,\"interval_us\":%d,"
+                       "\"wait_us\":%d,\"latency_us\":%d,\"size\":%d,\"send_us\":%d}",
+                       first ? "" : ",", id, transport, source, (uint32_t)((now - opened) / 1000), st.frames, st.bytes,
+                       sub_stats.dropped, sub_stats.skipped, fps, kbps, st.interval_us,
+                       st.wait_us, st.latency_us, st.size, st.send_us);
+        httpd_resp_send_chunk(req, buf, len);
+        first = false;
+    }
+    httpd_resp_send_chunk(req, "]}", 2);
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
 // Simple web UI served at /ui — tiny page to send path actions and show pose
 static esp_err_t ui_get_handler(httpd_req_t *req)
 {
@@ -833,7 +2645,9 @@ static esp_err_t ui_get_handler(httpd_req_t *req)
 void startCameraServer()
 {
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-    config.max_uri_handlers = 16;
+    config.max_uri_handlers = 24;
+    config.uri_match_fn = httpd_uri_match_wildcard; // /api/path/<job>
+    config.close_fn = stream_sock_close;            // sockets handed to stream senders
 
     httpd_uri_t index_uri = {
         .uri = "/",
@@ -865,6 +2679,27 @@ void startCameraServer()
         .handler = stream_handler,
         .user_ctx = NULL};
 
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    httpd_uri_t ws_uri = {
+        .uri = "/ws",
+        .method = HTTP_GET,
+        .handler = ws_stream_handler,
+        .user_ctx = NULL,
+        .is_websocket = true};
+#endif
+
+    httpd_uri_t preview_uri = {
+        .uri = "/preview",
+        .method = HTTP_GET,
+        .handler = stream_handler,
+        .user_ctx = &preview_hub};
+
+    httpd_uri_t clip_uri = {
+        .uri = "/api/clip",
+        .method = HTTP_GET,
+        .handler = clip_handler,
+        .user_ctx = NULL};
+
     httpd_uri_t Test_uri = {
         .uri = "/Test",
         .method = HTTP_GET,
@@ -890,20 +2725,78 @@ void startCameraServer()
         .handler = path_post_handler,
         .user_ctx = NULL};
 
+    httpd_uri_t path_job_uri = {
+        .uri = "/api/path/*",
+        .method = HTTP_GET,
+        .handler = path_get_handler,
+        .user_ctx = NULL};
+
+    httpd_uri_t path_job_delete_uri = {
+        .uri = "/api/path/*",
+        .method = HTTP_DELETE,
+        .handler = path_delete_handler,
+        .user_ctx = NULL};
+
+    httpd_uri_t stop_uri = {
+        .uri = "/api/stop",
+        .method = HTTP_GET,
+        .handler = stop_handler,
+        .user_ctx = NULL};
+
+    httpd_uri_t stop_post_uri = {
+        .uri = "/api/stop",
+        .method = HTTP_POST,
+        .handler = stop_handler,
+        .user_ctx = NULL};
+
+    httpd_uri_t camera_uri = {
+        .uri = "/api/camera",
+        .method = HTTP_POST,
+        .handler = camera_post_handler,
+        .user_ctx = NULL};
+
     httpd_uri_t pose_uri = {
         .uri = "/api/pose",
         .method = HTTP_GET,
         .handler = pose_get_handler,
         .user_ctx = NULL};
 
+    httpd_uri_t streams_uri = {
+        .uri = "/api/streams",
+        .method = HTTP_GET,
+        .handler = streams_get_handler,
+        .user_ctx = NULL};
+
+    httpd_uri_t rtp_uri = {
+        .uri = "/api/rtp",
+        .method = HTTP_GET,
+        .handler = rtp_handler,
+        .user_ctx = NULL};
+
     httpd_uri_t ui_uri = {
         .uri = "/ui",
         .method = HTTP_GET,
         .handler = ui_get_handler,
         .user_ctx = NULL};
 
-    ra_filter_init(&ra_filter, 20);
+    stream_clients_init();
+
+    frame_hub_init(&camera_hub);
+    frame_hub_limit_pins(&camera_hub, CAMERA_FB_LENT, frame_copy_alloc, jpg_buf_release);
+    frame_hub_init(&preview_hub);
+    xTaskCreate(capture_task, "capture", 4096, NULL, tskIDLE_PRIORITY + 5, NULL);
+    xTaskCreate(rtp_task, "rtp", 4096, NULL, tskIDLE_PRIORITY + 5, NULL);
+    xTaskCreate(preview_task, "preview", 8192, NULL, tskIDLE_PRIORITY + 4, NULL);
+    uint8_t *clip_mem = psramFound() ? (uint8_t *)ps_malloc(CLIP_BUDGET_BYTES) : NULL;
+    clip_ring_init(&clip_ring, clip_mem, CLIP_BUDGET_BYTES, CLIP_MAX_SECONDS * 1000000LL);
+    if (clip_mem)
+    {
+        xTaskCreate(clip_record_task, "clip", 4096, NULL, tskIDLE_PRIORITY + 3, NULL);
+    }
+    xTaskCreate(pose_stream_task, "pose", 3072, NULL, tskIDLE_PRIORITY + 2, NULL);
+    xTaskCreate(path_job_task, "path", 4096, NULL, tskIDLE_PRIORITY + 2, NULL);
 
+    req_arena_init(&control_arena, control_arena_mem, sizeof(control_arena_mem));
     Serial.printf("Starting web server on port: '%d'\n", config.server_port);
     if (httpd_start(&camera_httpd, &config) == ESP_OK)
     {
@@ -915,8 +2808,16 @@ void startCameraServer()
         httpd_register_uri_handler(camera_httpd, &Test1_uri);
         httpd_register_uri_handler(camera_httpd, &Test2_uri);
         httpd_register_uri_handler(camera_httpd, &path_uri);
+        httpd_register_uri_handler(camera_httpd, &path_job_uri);
+        httpd_register_uri_handler(camera_httpd, &path_job_delete_uri);
         httpd_register_uri_handler(camera_httpd, &pose_uri);
+        httpd_register_uri_handler(camera_httpd, &stop_uri);
+        httpd_register_uri_handler(camera_httpd, &stop_post_uri);
         httpd_register_uri_handler(camera_httpd, &ui_uri);
+        httpd_register_uri_handler(camera_httpd, &streams_uri);
+        httpd_register_uri_handler(camera_httpd, &rtp_uri);
+        httpd_register_uri_handler(camera_httpd, &clip_uri);
+        httpd_register_uri_handler(camera_httpd, &camera_uri);
     }
     config.server_port += 1; //视频流端口
     config.ctrl_port += 1;
@@ -924,5 +2825,9 @@ void startCameraServer()
     if (httpd_start(&stream_httpd, &config) == ESP_OK)
     {
         httpd_register_uri_handler(stream_httpd, &stream_uri);
+        httpd_register_uri_handler(stream_httpd, &preview_uri);
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+        httpd_register_uri_handler(stream_httpd, &ws_uri);
+#endif
     }
 }
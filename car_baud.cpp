@@ -0,0 +1,296 @@
+#include "car_baud.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+
+const uint32_t car_baud_rates[CAR_BAUD_RATES] = {9600, 19200, 38400, 57600, 115200, 230400, 460800};
+
+static car_cmd_t baud_cmd(uint16_t n, uint8_t argc, int32_t d1, int32_t d2)
+{
+    static uint32_t counter = 0;
+    car_cmd_t cmd;
+    cmd.n = n;
+    cmd.argc = argc;
+    cmd.arg[0] = d1;
+    cmd.arg[1] = d2;
+    snprintf(cmd.id, sizeof(cmd.id), "b%u", (unsigned)(++counter % 10000));
+    return cmd;
+}
+
+// {id_<value>} -> value
+static bool reply_value(const car_result_t *result, long *value)
+{
+    const char *us = strrchr(result->reply, '_');
+    if (!us)
+    {
+        return false;
+    }
+    char *end;
+    *value = strtol(us + 1, &end, 10);
+    return end != us + 1 && *end == '}';
+}
+
+static bool call(car_baud_t *baud, car_cmd_t cmd, car_result_t *result)
+{
+    return car_link_call(baud->link, &cmd, CAR_BAUD_REPLY_MS, result) == CAR_OK;
+}
+
+static void sleep_ms(uint32_t ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+static void enter(car_baud_t *baud, car_baud_state_t state, int index)
+{
+    baud->state = state;
+    if (baud->trace)
+    {
+        baud->trace(state, car_baud_rates[index]);
+    }
+}
+
+// Both sides switch on the ack; give the car time to drain its ack and reconfigure
+static void switch_to(car_baud_t *baud, int index)
+{
+    car_link_set_baud(baud->link, car_baud_rates[index]);
+    sleep_ms(20);
+}
+
+void car_baud_init(car_baud_t *baud, car_link_t *link, car_baud_trace_fn trace)
+{
+    baud->link = link;
+    baud->state = CAR_BAUD_DONE;
+    baud->current = 0;
+    baud->candidate = 0;
+    baud->supported = 0;
+    baud->max_rate = 0;
+    baud->upgrades = 0;
+    baud->failed_tests = 0;
+    baud->step_downs = 0;
+    baud->trace = trace;
+    baud->window_start_us = 0;
+    baud->window_errors = 0;
+    baud->idle_tx_bytes = 0;
+    baud->idle_since_us = 0;
+    baud->seen_completed = 0;
+    baud->seen_timeouts = 0;
+    baud->silent_checks = 0;
+    baud->keepalives = 0;
+    baud->resyncs = 0;
+}
+
+void car_baud_limit(car_baud_t *baud, uint32_t max_rate)
+{
+    baud->max_rate = max_rate;
+}
+
+uint32_t car_baud_negotiate(car_baud_t *baud)
+{
+    car_result_t result;
+    long value;
+    enter(baud, CAR_BAUD_PROBE, baud->current);
+    while (baud->state != CAR_BAUD_DONE)
+    {
+        switch (baud->state)
+        {
+        case CAR_BAUD_PROBE:
+            if (!call(baud, baud_cmd(CAR_CMD_BAUD_PROBE, 0, 0, 0), &result) || !reply_value(&result, &value))
+            {
+                enter(baud, CAR_BAUD_DONE, baud->current); // firmware without rate switching
+                break;
+            }
+            baud->supported = (uint32_t)value | 1;
+            for (int i = 1; i < CAR_BAUD_RATES && baud->max_rate; i++)
+            {
+                if (car_baud_rates[i] > baud->max_rate)
+                {
+                    baud->supported &= ~(1u << i);
+                }
+            }
+            baud->candidate = CAR_BAUD_RATES;
+            enter(baud, CAR_BAUD_PROPOSE, baud->current);
+            break;
+
+        case CAR_BAUD_PROPOSE:
+            // next rate down from the last candidate that both sides support
+            do
+            {
+                baud->candidate--;
+            } while (baud->candidate > baud->current && !(baud->supported & (1u << baud->candidate)));
+            if (baud->candidate <= baud->current)
+            {
+                enter(baud, CAR_BAUD_DONE, baud->current);
+            }
+            else if (call(baud, baud_cmd(CAR_CMD_BAUD_SET, 1, baud->candidate, 0), &result) && result.status == CAR_OK)
+            {
+                enter(baud, CAR_BAUD_SWITCH, baud->candidate);
+            }
+            else
+            {
+                // the ack may have been lost after the car switched; it returns on its own
+                sleep_ms(CAR_BAUD_COMMIT_MS);
+            }
+            break;
+
+        case CAR_BAUD_SWITCH:
+            switch_to(baud, baud->candidate);
+            enter(baud, CAR_BAUD_TEST, baud->candidate);
+            break;
+
+        case CAR_BAUD_TEST:
+        {
+            bool passed = true;
+            for (int i = 0; i < CAR_BAUD_TEST_FRAMES && passed; i++)
+            {
+                int32_t check = (i * 7919 + baud->candidate * 104729) & 0x7FFF;
+                passed = call(baud, baud_cmd(CAR_CMD_BAUD_TEST, 2, i, check), &result) && reply_value(&result, &value) &&
+                         value == check;
+            }
+            enter(baud, passed ? CAR_BAUD_COMMIT : CAR_BAUD_REVERT, baud->candidate);
+            break;
+        }
+
+        case CAR_BAUD_COMMIT:
+            if (call(baud, baud_cmd(CAR_CMD_BAUD_COMMIT, 0, 0, 0), &result))
+            {
+                baud->current = baud->candidate;
+                baud->upgrades++;
+                enter(baud, CAR_BAUD_DONE, baud->current);
+            }
+            else
+            {
+                enter(baud, CAR_BAUD_REVERT, baud->candidate);
+            }
+            break;
+
+        case CAR_BAUD_REVERT:
+            baud->failed_tests++;
+            switch_to(baud, baud->current);
+            sleep_ms(CAR_BAUD_COMMIT_MS); // until the car has given up on the candidate too
+            enter(baud, CAR_BAUD_PROPOSE, baud->current);
+            break;
+
+        case CAR_BAUD_DONE:
+            break;
+        }
+    }
+    return car_baud_rates[baud->current];
+}
+
+// Errors that point at the line rate. Timeouts don't: a busy or unplugged car
+// times out at any rate, and stepping down would not help it.
+static uint32_t line_errors(const car_link_stats_t *stats)
+{
+    return stats->crc_errors + stats->overflows;
+}
+
+// Keeps the car from falling back to the base rate while the link is idle, and
+// follows it there when it did anyway. Returns true if it changed the rate.
+static bool keep_in_sync(car_baud_t *baud, int64_t now_us)
+{
+    car_link_stats_t stats = car_link_stats(baud->link);
+    if (stats.tx_bytes != baud->idle_tx_bytes)
+    {
+        baud->idle_tx_bytes = stats.tx_bytes;
+        baud->idle_since_us = now_us;
+    }
+    else if (baud->current && now_us - baud->idle_since_us >= CAR_BAUD_KEEPALIVE_MS * 1000LL)
+    {
+        car_result_t result;
+        call(baud, baud_cmd(CAR_CMD_BAUD_PROBE, 0, 0, 0), &result);
+        baud->keepalives++;
+        stats = car_link_stats(baud->link);
+        baud->idle_tx_bytes = stats.tx_bytes;
+        baud->idle_since_us = now_us;
+    }
+
+    bool replied = stats.completed != baud->seen_completed;
+    bool timed_out = stats.timeouts != baud->seen_timeouts;
+    baud->seen_completed = stats.completed;
+    baud->seen_timeouts = stats.timeouts;
+    if (replied || !timed_out)
+    {
+        baud->silent_checks = replied ? 0 : baud->silent_checks;
+        return false;
+    }
+    if (++baud->silent_checks < CAR_BAUD_DESYNC_CHECKS || !baud->current)
+    {
+        return false;
+    }
+
+    // nothing but timeouts: the car is at the base rate, or will be once it
+    // stops hearing valid frames at this one
+    enter(baud, CAR_BAUD_REVERT, 0);
+    switch_to(baud, 0);
+    baud->current = 0;
+    baud->silent_checks = 0;
+    baud->resyncs++;
+    enter(baud, CAR_BAUD_DONE, 0);
+    return true;
+}
+
+bool car_baud_check(car_baud_t *baud, int64_t now_us)
+{
+    if (keep_in_sync(baud, now_us))
+    {
+        car_link_stats_t stats = car_link_stats(baud->link);
+        baud->window_start_us = now_us;
+        baud->window_errors = line_errors(&stats);
+        return true;
+    }
+    car_link_stats_t stats = car_link_stats(baud->link);
+    uint32_t errors = line_errors(&stats);
+    if (now_us - baud->window_start_us > CAR_BAUD_ERROR_WINDOW_MS * 1000LL)
+    {
+        baud->window_start_us = now_us;
+        baud->window_errors = errors;
+        return false;
+    }
+    if (errors - baud->window_errors < CAR_BAUD_ERROR_BURST || !baud->current)
+    {
+        return false;
+    }
+
+    int lower = baud->current - 1;
+    while (lower > 0 && !(baud->supported & (1u << lower)))
+    {
+        lower--;
+    }
+    car_result_t result;
+    enter(baud, CAR_BAUD_PROPOSE, lower);
+    if (call(baud, baud_cmd(CAR_CMD_BAUD_SET, 1, lower, 0), &result) && result.status == CAR_OK)
+    {
+        switch_to(baud, lower);
+        enter(baud, CAR_BAUD_COMMIT, lower);
+        if (!call(baud, baud_cmd(CAR_CMD_BAUD_COMMIT, 0, 0, 0), &result))
+        {
+            lower = 0;
+        }
+    }
+    else
+    {
+        lower = 0;
+    }
+    if (!lower)
+    {
+        // the car drops back to the base rate once it stops hearing valid frames
+        enter(baud, CAR_BAUD_REVERT, 0);
+        switch_to(baud, 0);
+        sleep_ms(CAR_BAUD_SILENCE_MS);
+    }
+    baud->current = lower;
+    baud->step_downs++;
+    enter(baud, CAR_BAUD_DONE, lower);
+
+    stats = car_link_stats(baud->link);
+    baud->window_start_us = now_us;
+    baud->window_errors = line_errors(&stats);
+    return true;
+}
+
+uint32_t car_baud_rate(const car_baud_t *baud)
+{
+    return car_baud_rates[baud->current];
+}
@@ -0,0 +1,103 @@
+/*
+ * UART baud rate negotiation between the ESP32 and the car.
+ *
+ * Both sides start at CAR_BAUD_BASE. The handshake, run over the car link:
+ *
+ *   PROBE    {"N":111}            car answers {id_<mask>}, bit i = car_baud_rates[i]
+ *   PROPOSE  {"N":112,"D1":i}     car acks at the old rate, then switches to rate i
+ *   SWITCH   ESP32 switches after the ack
+ *   TEST     {"N":113,"D1":seq,"D2":check} x CAR_BAUD_TEST_FRAMES, car echoes {id_<check>}
+ *   COMMIT   {"N":114}            car keeps the rate
+ *   REVERT   a failed test: ESP32 goes back to the old rate; the car does too
+ *            when no COMMIT arrives within CAR_BAUD_COMMIT_MS of switching
+ *
+ * Candidates are tried from the fastest rate both sides support down. Car
+ * firmware that doesn't answer the probe stays at the base rate.
+ *
+ * After negotiation car_baud_check() watches the link; a burst of CRC errors or
+ * overlong frames steps one rate down (timeouts alone don't, the car may just
+ * be busy or unplugged). If the step itself can't get through, the
+ * ESP32 returns to CAR_BAUD_BASE, where the car lands on its own after
+ * CAR_BAUD_SILENCE_MS without a valid frame.
+ *
+ * Above the base rate an idle link would run into that silence, so the check
+ * sends a probe as keepalive once nothing went out for CAR_BAUD_KEEPALIVE_MS.
+ * When CAR_BAUD_DESYNC_CHECKS checks in a row saw timeouts and no reply at
+ * all, the car is taken to be back at the base rate (silence, reset) and the
+ * ESP32 follows it there.
+ */
+
+#ifndef _CAR_BAUD_H
+#define _CAR_BAUD_H
+
+#include <stdint.h>
+#include "car_link.h"
+
+#define CAR_CMD_BAUD_PROBE 111
+#define CAR_CMD_BAUD_SET 112
+#define CAR_CMD_BAUD_TEST 113
+#define CAR_CMD_BAUD_COMMIT 114
+
+#define CAR_BAUD_BASE 9600
+#define CAR_BAUD_RATES 7
+#define CAR_BAUD_TEST_FRAMES 8
+#define CAR_BAUD_COMMIT_MS 1000
+#define CAR_BAUD_SILENCE_MS 2000
+#define CAR_BAUD_REPLY_MS 300
+#define CAR_BAUD_ERROR_BURST 3      // errors within CAR_BAUD_ERROR_WINDOW_MS that trigger a step down
+#define CAR_BAUD_ERROR_WINDOW_MS 2000
+#define CAR_BAUD_KEEPALIVE_MS 500 // plus the check period, well inside CAR_BAUD_SILENCE_MS
+#define CAR_BAUD_DESYNC_CHECKS 3
+
+extern const uint32_t car_baud_rates[CAR_BAUD_RATES];
+
+typedef enum
+{
+    CAR_BAUD_PROBE,
+    CAR_BAUD_PROPOSE,
+    CAR_BAUD_SWITCH,
+    CAR_BAUD_TEST,
+    CAR_BAUD_COMMIT,
+    CAR_BAUD_REVERT,
+    CAR_BAUD_DONE,
+} car_baud_state_t;
+
+typedef void (*car_baud_trace_fn)(car_baud_state_t state, uint32_t rate);
+
+typedef struct
+{
+    car_link_t *link;
+    car_baud_state_t state;
+    int current;   // index into car_baud_rates both sides use
+    int candidate; // index being tried
+    uint32_t supported; // car's mask, 0 until probed
+    uint32_t max_rate;  // 0: no limit
+    uint32_t upgrades;
+    uint32_t failed_tests;
+    uint32_t step_downs;
+    car_baud_trace_fn trace;
+    // error burst monitor
+    int64_t window_start_us;
+    uint32_t window_errors; // CRC errors + overflows when the window started
+    // keepalive and desync monitor
+    uint32_t idle_tx_bytes;
+    int64_t idle_since_us;
+    uint32_t seen_completed;
+    uint32_t seen_timeouts;
+    int silent_checks; // checks in a row with timeouts and no reply
+    uint32_t keepalives;
+    uint32_t resyncs;
+} car_baud_t;
+
+void car_baud_init(car_baud_t *baud, car_link_t *link, car_baud_trace_fn trace);
+// Caps the rates negotiate() tries, e.g. for a long cable; 0 lifts the cap.
+void car_baud_limit(car_baud_t *baud, uint32_t max_rate);
+// Runs the handshake to completion; returns the rate in use afterwards.
+// Blocks for a few hundred ms per candidate; needs the link's polling task.
+uint32_t car_baud_negotiate(car_baud_t *baud);
+// Call periodically, at most CAR_BAUD_KEEPALIVE_MS apart. Returns true if it
+// changed the rate.
+bool car_baud_check(car_baud_t *baud, int64_t now_us);
+uint32_t car_baud_rate(const car_baud_t *baud);
+
+#endif
@@ -0,0 +1,1023 @@
+#include "car_link.h"
+#include "car_proto.h"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+#define CAR_FUTURE_SLACK_US 500000
+
+static int64_t now_us(void)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+static void copy_id(char *dst, const char *src)
+{
+    if (!src)
+    {
+        dst[0] = 0;
+        return;
+    }
+    strncpy(dst, src, CAR_LINK_ID_LEN - 1);
+    dst[CAR_LINK_ID_LEN - 1] = 0;
+}
+
+car_cmd_t car_cmd_move(int dir, uint32_t cm, const char *id)
+{
+    car_cmd_t cmd;
+    cmd.n = CAR_CMD_MOVE;
+    cmd.argc = 2;
+    cmd.arg[0] = dir;
+    cmd.arg[1] = (int32_t)cm;
+    copy_id(cmd.id, id);
+    return cmd;
+}
+
+car_cmd_t car_cmd_turn(int degrees, const char *id)
+{
+    car_cmd_t cmd;
+    cmd.n = CAR_CMD_TURN;
+    cmd.argc = 1;
+    cmd.arg[0] = degrees;
+    cmd.arg[1] = 0;
+    copy_id(cmd.id, id);
+    return cmd;
+}
+
+car_cmd_t car_cmd_pose(const char *id)
+{
+    car_cmd_t cmd;
+    cmd.n = CAR_CMD_POSE;
+    cmd.argc = 0;
+    cmd.arg[0] = 0;
+    cmd.arg[1] = 0;
+    copy_id(cmd.id, id);
+    return cmd;
+}
+
+car_cmd_t car_cmd_pose_stream(uint32_t period_ms, const char *id)
+{
+    car_cmd_t cmd;
+    cmd.n = CAR_CMD_POSE_STREAM;
+    cmd.argc = 1;
+    cmd.arg[0] = (int32_t)period_ms;
+    cmd.arg[1] = 0;
+    copy_id(cmd.id, id);
+    return cmd;
+}
+
+car_cmd_t car_cmd_stop(void)
+{
+    car_cmd_t cmd;
+    cmd.n = CAR_CMD_STOP;
+    cmd.argc = 0;
+    cmd.arg[0] = 0;
+    cmd.arg[1] = 0;
+    cmd.id[0] = 0;
+    return cmd;
+}
+
+size_t car_cmd_format(const car_cmd_t *cmd, char *out, size_t size)
+{
+    int len = snprintf(out, size, "{\"N\":%u", cmd->n);
+    for (int i = 0; i < cmd->argc && i < 2 && len > 0 && (size_t)len < size; i++)
+    {
+        len += snprintf(out + len, size - len, ",\"D%d\":%ld", i + 1, (long)cmd->arg[i]);
+    }
+    if (cmd->id[0] && len > 0 && (size_t)len < size)
+    {
+        len += snprintf(out + len, size - len, ",\"H\":\"%s\"", cmd->id);
+    }
+    if (len > 0 && (size_t)len < size)
+    {
+        len += snprintf(out + len, size - len, "}");
+    }
+    return len > 0 && (size_t)len < size ? (size_t)len : 0;
+}
+
+bool car_reply_id(const char *frame, size_t len, char *id, size_t id_size, car_status_t *status)
+{
+    static const char key[] = "\"H\":\"";
+    if (len < 3 || frame[0] != '{' || frame[len - 1] != '}')
+    {
+        return false;
+    }
+    // JSON reply echoing the id, {"H":"p1234","pose":{...}}
+    for (size_t i = 1; i + sizeof(key) - 1 < len; i++)
+    {
+        if (memcmp(frame + i, key, sizeof(key) - 1))
+        {
+            continue;
+        }
+        const char *start = frame + i + sizeof(key) - 1;
+        const char *end = (const char *)memchr(start, '"', frame + len - start);
+        if (!end || (size_t)(end - start) >= id_size || end == start)
+        {
+            return false;
+        }
+        memcpy(id, start, end - start);
+        id[end - start] = 0;
+        *status = CAR_OK;
+        return true;
+    }
+    // Short form {<id>_<result>}
+    if (memchr(frame, '"', len) || memchr(frame, ':', len))
+    {
+        return false;
+    }
+    const char *us = NULL;
+    for (const char *p = frame + len - 2; p > frame; p--)
+    {
+        if (*p == '_')
+        {
+            us = p;
+            break;
+        }
+    }
+    if (!us || us == frame + 1 || (size_t)(us - frame - 1) >= id_size)
+    {
+        return false;
+    }
+    memcpy(id, frame + 1, us - frame - 1);
+    id[us - frame - 1] = 0;
+    size_t result_len = frame + len - 1 - (us + 1);
+    *status = result_len == 5 && !memcmp(us + 1, "false", 5) ? CAR_REJECTED : CAR_OK;
+    return true;
+}
+
+void car_link_init(car_link_t *link, const car_transport_t *io)
+{
+    std::lock_guard<std::mutex> guard(link->lock);
+    link->io = *io;
+    for (int i = 0; i < CAR_LINK_MAX_PENDING; i++)
+    {
+        link->pending[i].in_use = false;
+    }
+    for (int i = 0; i < CAR_LINK_MAX_SUBSCRIBERS; i++)
+    {
+        link->subscribers[i].in_use = false;
+    }
+    link->framing = CAR_FRAMING_TEXT;
+    link->next_tag = 1;
+    link->preempting.store(0);
+    link->epoch.store(0);
+    link->wire_len = 0;
+    link->frame_len = 0;
+    link->depth = 0;
+    link->in_string = false;
+    link->overflow = false;
+    memset(&link->stats, 0, sizeof(link->stats));
+}
+
+bool car_link_subscribe(car_link_t *link, const char *key, car_frame_queue_t *queue)
+{
+    std::lock_guard<std::mutex> guard(link->lock);
+    for (int i = 0; i < CAR_LINK_MAX_SUBSCRIBERS; i++)
+    {
+        car_subscriber_t *sub = &link->subscribers[i];
+        if (!sub->in_use)
+        {
+            snprintf(sub->key, sizeof(sub->key), "%s", key ? key : "");
+            sub->queue = queue;
+            sub->in_use = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+void car_frame_queue_init(car_frame_queue_t *queue)
+{
+    queue->head.store(0);
+    queue->tail.store(0);
+    queue->dropped.store(0);
+}
+
+bool car_frame_queue_push(car_frame_queue_t *queue, const char *frame, size_t len)
+{
+    uint32_t head = queue->head.load(std::memory_order_relaxed);
+    if (head - queue->tail.load(std::memory_order_acquire) >= CAR_LINK_QUEUE_DEPTH)
+    {
+        queue->dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    car_frame_t *slot = &queue->slots[head & (CAR_LINK_QUEUE_DEPTH - 1)];
+    slot->len = len < sizeof(slot->text) ? len : sizeof(slot->text) - 1;
+    memcpy(slot->text, frame, slot->len);
+    slot->text[slot->len] = 0;
+    queue->head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+bool car_frame_queue_pop(car_frame_queue_t *queue, car_frame_t *out)
+{
+    uint32_t tail = queue->tail.load(std::memory_order_relaxed);
+    if (tail == queue->head.load(std::memory_order_acquire))
+    {
+        return false;
+    }
+    const car_frame_t *slot = &queue->slots[tail & (CAR_LINK_QUEUE_DEPTH - 1)];
+    out->len = slot->len;
+    memcpy(out->text, slot->text, slot->len + 1);
+    queue->tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+void car_link_set_framing(car_link_t *link, car_framing_t framing)
+{
+    std::lock_guard<std::mutex> guard(link->lock);
+    link->framing = framing;
+}
+
+car_framing_t car_link_framing(car_link_t *link)
+{
+    std::lock_guard<std::mutex> guard(link->lock);
+    return link->framing;
+}
+
+void car_link_set_baud(car_link_t *link, uint32_t baud)
+{
+    // no frame is cut in half: writers hold tx_lock for a whole frame
+    std::lock_guard<std::mutex> guard(link->tx_lock);
+    link->io.flush(link->io.ctx);
+    link->io.set_baud(link->io.ctx, baud);
+}
+
+static void complete(const car_pending_t *p, car_status_t status, const char *reply, size_t reply_len, int64_t now)
+{
+    car_result_t result;
+    result.status = status;
+    result.rtt_us = now - p->sent_us;
+    result.reply_len = reply_len < sizeof(result.reply) ? reply_len : sizeof(result.reply) - 1;
+    memcpy(result.reply, reply, result.reply_len);
+    result.reply[result.reply_len] = 0;
+    if (p->done)
+    {
+        p->done(p->arg, &result);
+    }
+}
+
+// Caller holds link->lock. Takes pending[i] off the table into claimed.
+static void claim_locked(car_link_t *link, int i, car_status_t status, int64_t now, car_pending_t *claimed)
+{
+    car_pending_t *p = &link->pending[i];
+    *claimed = *p;
+    p->in_use = false;
+    int64_t rtt = now - p->sent_us;
+    link->stats.completed++;
+    link->stats.rejected += status == CAR_REJECTED;
+    link->stats.rtt_last_us = rtt;
+    link->stats.rtt_sum_us += rtt;
+    if (rtt > link->stats.rtt_max_us)
+    {
+        link->stats.rtt_max_us = rtt;
+    }
+}
+
+// Queues an unclaimed frame for its subscribers; never blocks the reader.
+static bool route_locked(car_link_t *link, const char *frame, size_t len)
+{
+    char id[CAR_LINK_ID_LEN];
+    car_status_t status;
+    bool has_id = car_reply_id(frame, len, id, sizeof(id), &status);
+    bool routed = false;
+    for (int i = 0; i < CAR_LINK_MAX_SUBSCRIBERS; i++)
+    {
+        const car_subscriber_t *sub = &link->subscribers[i];
+        size_t key_len = strlen(sub->key);
+        if (!sub->in_use || !key_len)
+        {
+            continue;
+        }
+        if ((len == key_len + 2 && !memcmp(frame + 1, sub->key, key_len)) || (has_id && !strcmp(id, sub->key)))
+        {
+            car_frame_queue_push(sub->queue, frame, len);
+            routed = true;
+        }
+    }
+    bool keyed = routed;
+    for (int i = 0; i < CAR_LINK_MAX_SUBSCRIBERS && !keyed; i++)
+    {
+        const car_subscriber_t *sub = &link->subscribers[i];
+        if (sub->in_use && !sub->key[0])
+        {
+            car_frame_queue_push(sub->queue, frame, len);
+            routed = true;
+        }
+    }
+    return routed;
+}
+
+static void dispatch_frame(car_link_t *link, const char *frame, size_t len)
+{
+    char id[CAR_LINK_ID_LEN];
+    car_status_t status;
+    int64_t now = now_us();
+    car_pending_t claimed;
+    claimed.in_use = false;
+    {
+        std::lock_guard<std::mutex> guard(link->lock);
+        if (car_reply_id(frame, len, id, sizeof(id), &status))
+        {
+            for (int i = 0; i < CAR_LINK_MAX_PENDING; i++)
+            {
+                if (link->pending[i].in_use && !strcmp(link->pending[i].id, id))
+                {
+                    claim_locked(link, i, status, now, &claimed);
+                    break;
+                }
+            }
+        }
+        if (!claimed.in_use && !route_locked(link, frame, len))
+        {
+            link->stats.unmatched++;
+        }
+    }
+    // the callback runs without the lock so it may submit the next command
+    if (claimed.in_use)
+    {
+        complete(&claimed, status, frame, len, now);
+    }
+}
+
+// Binary replies name their command by tag; they are completed with the text
+// the JSON protocol would have sent, so callers see the same replies either way.
+static void dispatch_binary(car_link_t *link, const car_proto_msg_t *msg)
+{
+    if (msg->type == CAR_PROTO_TEXT)
+    {
+        if (msg->payload_len <= CAR_LINK_FRAME_LEN)
+        {
+            dispatch_frame(link, (const char *)msg->payload, msg->payload_len);
+        }
+        return;
+    }
+    if (msg->type == CAR_PROTO_POSE_REPLY && !msg->tag)
+    {
+        // a streamed pose rather than the reply to a command
+        char text[CAR_LINK_FRAME_LEN];
+        size_t len = car_proto_reply_text(msg, CAR_POSE_STREAM_ID, text, sizeof(text));
+        if (len)
+        {
+            dispatch_frame(link, text, len);
+        }
+        return;
+    }
+    int64_t now = now_us();
+    car_status_t status = msg->type == CAR_PROTO_REJECT ? CAR_REJECTED : CAR_OK;
+    car_pending_t claimed;
+    claimed.in_use = false;
+    {
+        std::lock_guard<std::mutex> guard(link->lock);
+        for (int i = 0; i < CAR_LINK_MAX_PENDING && msg->tag; i++)
+        {
+            if (link->pending[i].in_use && link->pending[i].tag == msg->tag)
+            {
+                claim_locked(link, i, status, now, &claimed);
+                break;
+            }
+        }
+        if (!claimed.in_use)
+        {
+            link->stats.unmatched++;
+            return;
+        }
+    }
+    char text[CAR_LINK_FRAME_LEN];
+    size_t len = car_proto_reply_text(msg, claimed.id, text, sizeof(text));
+    complete(&claimed, status, text, len, now);
+}
+
+// Binary frames end at a zero byte; a corrupt one costs only itself.
+static void feed_binary(car_link_t *link, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (data[i])
+        {
+            if (link->wire_len < sizeof(link->wire))
+            {
+                link->wire[link->wire_len++] = data[i];
+            }
+            else
+            {
+                link->overflow = true;
+            }
+            continue;
+        }
+        car_proto_msg_t msg;
+        if (link->overflow)
+        {
+            std::lock_guard<std::mutex> guard(link->lock);
+            link->stats.overflows++;
+        }
+        else if (link->wire_len && car_proto_decode(link->wire, link->wire_len, &msg))
+        {
+            dispatch_binary(link, &msg);
+        }
+        else if (link->wire_len)
+        {
+            std::lock_guard<std::mutex> guard(link->lock);
+            link->stats.crc_errors++;
+        }
+        link->wire_len = 0;
+        link->overflow = false;
+    }
+}
+
+// Frames are brace-balanced objects; braces inside strings don't count, so
+// nested replies such as {"H":"p1","pose":{...}} come out whole.
+static void feed(car_link_t *link, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        char c = (char)data[i];
+        if (!link->depth && c != '{')
+        {
+            continue; // noise between frames
+        }
+        if (link->frame_len < sizeof(link->frame))
+        {
+            link->frame[link->frame_len++] = c;
+        }
+        else
+        {
+            link->overflow = true;
+        }
+        if (c == '"' && (link->frame_len < 2 || link->frame[link->frame_len - 2] != '\\'))
+        {
+            link->in_string = !link->in_string;
+        }
+        if (link->in_string)
+        {
+            continue;
+        }
+        if (c == '{')
+        {
+            link->depth++;
+        }
+        else if (c == '}' && --link->depth == 0)
+        {
+            if (link->overflow)
+            {
+                std::lock_guard<std::mutex> guard(link->lock);
+                link->stats.overflows++;
+            }
+            else
+            {
+                dispatch_frame(link, link->frame, link->frame_len);
+            }
+            link->frame_len = 0;
+            link->overflow = false;
+        }
+    }
+}
+
+static void expire(car_link_t *link)
+{
+    int64_t now = now_us();
+    while (true)
+    {
+        car_pending_t expired;
+        expired.in_use = false;
+        {
+            std::lock_guard<std::mutex> guard(link->lock);
+            for (int i = 0; i < CAR_LINK_MAX_PENDING; i++)
+            {
+                car_pending_t *p = &link->pending[i];
+                if (p->in_use && now >= p->deadline_us)
+                {
+                    expired = *p;
+                    p->in_use = false;
+                    link->stats.timeouts++;
+                    break;
+                }
+            }
+        }
+        if (!expired.in_use)
+        {
+            return;
+        }
+        complete(&expired, CAR_TIMEOUT, "", 0, now);
+    }
+}
+
+void car_link_poll(car_link_t *link, uint32_t timeout_ms)
+{
+    uint8_t buf[64];
+    int n = link->io.read(link->io.ctx, buf, sizeof(buf), timeout_ms);
+    if (n > 0)
+    {
+        {
+            std::lock_guard<std::mutex> guard(link->lock);
+            link->stats.rx_bytes += n;
+        }
+        if (link->framing == CAR_FRAMING_BINARY)
+        {
+            feed_binary(link, buf, n);
+        }
+        else
+        {
+            feed(link, buf, n);
+        }
+    }
+    expire(link);
+}
+
+// Writes one frame once no preempt is pending. With epoch, the frame is
+// dropped (CAR_CANCELLED) if a preempt went out since that epoch was read.
+static car_status_t write_bytes(car_link_t *link, const void *data, size_t len, const uint32_t *epoch)
+{
+    bool ok;
+    {
+        std::unique_lock<std::mutex> guard(link->tx_lock);
+        while (link->preempting.load())
+        {
+            link->tx_cond.wait(guard);
+        }
+        if (epoch && link->epoch.load() != *epoch)
+        {
+            return CAR_CANCELLED;
+        }
+        ok = link->io.write(link->io.ctx, (const uint8_t *)data, len);
+        // on the wire before the next writer, so a preempt never queues
+        // behind more than one frame
+        link->io.flush(link->io.ctx);
+    }
+    std::lock_guard<std::mutex> guard(link->lock);
+    link->stats.tx_bytes += ok ? len : 0;
+    return ok ? CAR_OK : CAR_IO_ERROR;
+}
+
+bool car_link_write(car_link_t *link, const void *data, size_t len)
+{
+    if (car_link_framing(link) != CAR_FRAMING_BINARY)
+    {
+        return write_bytes(link, data, len, NULL) == CAR_OK;
+    }
+    uint8_t wire[CAR_PROTO_MAX_WIRE];
+    size_t n = car_proto_encode_text((const char *)data, len, wire, sizeof(wire));
+    return n && write_bytes(link, wire, n, NULL) == CAR_OK;
+}
+
+// Submits cmd unless a preempt went out since epoch was read.
+static car_status_t submit_in(car_link_t *link, const car_cmd_t *cmd, uint32_t timeout_ms, car_done_fn done, void *arg,
+                             uint32_t epoch)
+{
+    car_pending_t *slot = NULL;
+    car_framing_t framing;
+    uint8_t tag = 0;
+    {
+        // registered before the write so an instant reply finds it
+        std::lock_guard<std::mutex> guard(link->lock);
+        if (link->epoch.load() != epoch)
+        {
+            return CAR_CANCELLED;
+        }
+        framing = link->framing;
+        for (int i = 0; i < CAR_LINK_MAX_PENDING && cmd->id[0]; i++)
+        {
+            car_pending_t *p = &link->pending[i];
+            if (p->in_use && !strcmp(p->id, cmd->id))
+            {
+                return CAR_BUSY;
+            }
+            if (!p->in_use && !slot)
+            {
+                slot = p;
+            }
+        }
+        if (cmd->id[0])
+        {
+            if (!slot)
+            {
+                return CAR_BUSY;
+            }
+            tag = link->next_tag++;
+            if (!link->next_tag)
+            {
+                link->next_tag = 1; // 0 means no reply
+            }
+            slot->in_use = true;
+            strcpy(slot->id, cmd->id);
+            slot->tag = tag;
+            slot->sent_us = now_us();
+            slot->deadline_us = slot->sent_us + timeout_ms * 1000LL;
+            slot->done = done;
+            slot->arg = arg;
+        }
+    }
+
+    uint8_t wire[CAR_PROTO_MAX_WIRE];
+    size_t len;
+    if (framing == CAR_FRAMING_BINARY)
+    {
+        len = car_proto_encode_cmd(cmd, tag, wire, sizeof(wire));
+        if (!len)
+        {
+            // no binary form (e.g. the baud handshake): its JSON in a TEXT frame
+            char text[CAR_LINK_FRAME_LEN];
+            size_t text_len = car_cmd_format(cmd, text, sizeof(text));
+            len = text_len ? car_proto_encode_text(text, text_len, wire, sizeof(wire)) : 0;
+        }
+    }
+    else
+    {
+        len = car_cmd_format(cmd, (char *)wire, sizeof(wire));
+    }
+    car_status_t status = len ? write_bytes(link, wire, len, &epoch) : CAR_IO_ERROR;
+    if (status == CAR_CANCELLED)
+    {
+        // the preempt already completed the slot with CAR_CANCELLED
+        return slot ? CAR_OK : CAR_CANCELLED;
+    }
+    if (status != CAR_OK)
+    {
+        if (slot)
+        {
+            std::lock_guard<std::mutex> guard(link->lock);
+            slot->in_use = false;
+        }
+        return status;
+    }
+    std::lock_guard<std::mutex> guard(link->lock);
+    link->stats.sent++;
+    return CAR_OK;
+}
+
+car_status_t car_link_submit(car_link_t *link, const car_cmd_t *cmd, uint32_t timeout_ms, car_done_fn done, void *arg)
+{
+    return submit_in(link, cmd, timeout_ms, done, arg, link->epoch.load());
+}
+
+static void future_done(void *arg, const car_result_t *result)
+{
+    car_future_t *future = (car_future_t *)arg;
+    std::lock_guard<std::mutex> guard(future->link->lock);
+    future->result = *result;
+    future->done = true;
+    future->link->cond.notify_all();
+}
+
+static car_status_t submit_future(car_link_t *link, const car_cmd_t *cmd, uint32_t timeout_ms, car_future_t *future,
+                                  car_done_fn done)
+{
+    future->link = link;
+    future->done = false;
+    future->deadline_us = now_us() + timeout_ms * 1000LL + CAR_FUTURE_SLACK_US;
+    future->result.status = CAR_TIMEOUT;
+    future->result.rtt_us = 0;
+    future->result.reply_len = 0;
+    future->result.reply[0] = 0;
+    car_status_t status = car_link_submit(link, cmd, timeout_ms, done, future);
+    if (status != CAR_OK || !cmd->id[0])
+    {
+        future->result.status = status;
+        future->done = true;
+    }
+    return status;
+}
+
+car_status_t car_link_submit_future(car_link_t *link, const car_cmd_t *cmd, uint32_t timeout_ms, car_future_t *future)
+{
+    return submit_future(link, cmd, timeout_ms, future, future_done);
+}
+
+car_status_t car_link_wait(car_future_t *future)
+{
+    car_link_t *link = future->link;
+    std::unique_lock<std::mutex> guard(link->lock);
+    while (!future->done)
+    {
+        int64_t left = future->deadline_us - now_us();
+        if (left <= 0)
+        {
+            // the poller never got to it; take the request back so nobody completes it later
+            for (int i = 0; i < CAR_LINK_MAX_PENDING; i++)
+            {
+                car_pending_t *p = &link->pending[i];
+                if (p->in_use && p->arg == future)
+                {
+                    p->in_use = false;
+                    link->stats.timeouts++;
+                }
+            }
+            future->result.status = CAR_TIMEOUT;
+            future->done = true;
+            break;
+        }
+        link->cond.wait_for(guard, std::chrono::microseconds(left));
+    }
+    return future->result.status;
+}
+
+car_status_t car_link_call(car_link_t *link, const car_cmd_t *cmd, uint32_t timeout_ms, car_result_t *result)
+{
+    car_future_t future;
+    car_link_submit_future(link, cmd, timeout_ms, &future);
+    car_status_t status = car_link_wait(&future);
+    if (result)
+    {
+        *result = future.result;
+    }
+    return status;
+}
+
+car_status_t car_link_preempt(car_link_t *link, const car_cmd_t *cmd, uint32_t timeout_ms, car_future_t *future)
+{
+    int64_t start = now_us();
+    uint8_t tag = 0;
+    if (future)
+    {
+        future->link = link;
+        future->done = !cmd->id[0];
+        future->deadline_us = start + timeout_ms * 1000LL + CAR_FUTURE_SLACK_US;
+        future->result.status = cmd->id[0] ? CAR_TIMEOUT : CAR_OK;
+        future->result.rtt_us = 0;
+        future->result.reply_len = 0;
+        future->result.reply[0] = 0;
+    }
+    car_pending_t cancelled[CAR_LINK_MAX_PENDING];
+    int n = 0;
+    car_framing_t framing;
+    link->preempting++;
+    {
+        std::lock_guard<std::mutex> guard(link->lock);
+        link->epoch++;
+        for (int i = 0; i < CAR_LINK_MAX_PENDING; i++)
+        {
+            car_pending_t *p = &link->pending[i];
+            if (p->in_use)
+            {
+                cancelled[n++] = *p;
+                p->in_use = false;
+            }
+        }
+        link->stats.cancelled += n;
+        framing = link->framing;
+        if (future && cmd->id[0])
+        {
+            // the table was just emptied
+            car_pending_t *slot = &link->pending[0];
+            tag = link->next_tag++;
+            if (!link->next_tag)
+            {
+                link->next_tag = 1;
+            }
+            slot->in_use = true;
+            strcpy(slot->id, cmd->id);
+            slot->tag = tag;
+            slot->sent_us = start;
+            slot->deadline_us = start + timeout_ms * 1000LL;
+            slot->done = future_done;
+            slot->arg = future;
+        }
+    }
+
+    uint8_t wire[CAR_PROTO_MAX_WIRE];
+    size_t len = framing == CAR_FRAMING_BINARY ? car_proto_encode_cmd(cmd, tag, wire, sizeof(wire))
+                                               : car_cmd_format(cmd, (char *)wire, sizeof(wire));
+    bool ok = false;
+    {
+        // only the frame being written right now is ahead of this one
+        std::lock_guard<std::mutex> guard(link->tx_lock);
+        if (len && link->io.write(link->io.ctx, wire, len))
+        {
+            link->io.flush(link->io.ctx);
+            ok = true;
+        }
+        link->preempting--;
+    }
+    link->tx_cond.notify_all();
+    if (!ok && tag)
+    {
+        std::lock_guard<std::mutex> guard(link->lock);
+        link->pending[0].in_use = false;
+        future->result.status = CAR_IO_ERROR;
+        future->done = true;
+    }
+
+    int64_t now = now_us();
+    {
+        std::lock_guard<std::mutex> guard(link->lock);
+        link->stats.tx_bytes += ok ? len : 0;
+        link->stats.preempts++;
+        link->stats.preempt_last_us = now - start;
+        if (now - start > link->stats.preempt_max_us)
+        {
+            link->stats.preempt_max_us = now - start;
+        }
+    }
+    for (int i = 0; i < n; i++)
+    {
+        complete(&cancelled[i], CAR_CANCELLED, "", 0, now);
+    }
+    return ok ? CAR_OK : CAR_IO_ERROR;
+}
+
+struct pipeline;
+
+typedef struct
+{
+    struct pipeline *pipeline;
+    size_t index; // into cmds/outcomes
+    bool busy;
+} pipeline_slot_t;
+
+typedef struct pipeline
+{
+    car_link_t *link;
+    car_outcome_t *outcomes;
+    size_t in_flight;
+    int64_t deadline_us; // backstop: latest submit's deadline plus slack
+    pipeline_slot_t slots[CAR_LINK_MAX_PENDING];
+} pipeline_t;
+
+static void pipeline_done(void *arg, const car_result_t *result)
+{
+    pipeline_slot_t *slot = (pipeline_slot_t *)arg;
+    pipeline_t *p = slot->pipeline;
+    std::lock_guard<std::mutex> guard(p->link->lock);
+    p->outcomes[slot->index].status = result->status;
+    p->outcomes[slot->index].rtt_us = result->rtt_us;
+    slot->busy = false;
+    p->in_flight--;
+    p->link->cond.notify_all();
+}
+
+// Caller holds link->lock. Waits until fewer than limit commands are in flight.
+static void pipeline_wait_locked(pipeline_t *p, std::unique_lock<std::mutex> &guard, size_t limit)
+{
+    car_link_t *link = p->link;
+    while (p->in_flight >= limit)
+    {
+        int64_t left = p->deadline_us - now_us();
+        if (left > 0)
+        {
+            link->cond.wait_for(guard, std::chrono::microseconds(left));
+            continue;
+        }
+        // the poller never got to them; take them back so nobody completes them later
+        for (int i = 0; i < CAR_LINK_MAX_PENDING; i++)
+        {
+            car_pending_t *pending = &link->pending[i];
+            pipeline_slot_t *slot = (pipeline_slot_t *)pending->arg;
+            if (pending->in_use && pending->done == pipeline_done && slot->pipeline == p)
+            {
+                pending->in_use = false;
+                link->stats.timeouts++;
+                p->outcomes[slot->index].status = CAR_TIMEOUT;
+                p->outcomes[slot->index].rtt_us = 0;
+                slot->busy = false;
+                p->in_flight--;
+            }
+        }
+    }
+}
+
+size_t car_link_pipeline(car_link_t *link, const car_cmd_t *cmds, size_t count, size_t window, uint32_t timeout_ms,
+                         car_outcome_t *outcomes)
+{
+    return car_link_pipeline_at(link, cmds, count, window, timeout_ms, outcomes, link->epoch.load());
+}
+
+size_t car_link_pipeline_at(car_link_t *link, const car_cmd_t *cmds, size_t count, size_t window,
+                            uint32_t timeout_ms, car_outcome_t *outcomes, uint32_t epoch)
+{
+    pipeline_t p;
+    p.link = link;
+    p.outcomes = outcomes;
+    p.in_flight = 0;
+    p.deadline_us = 0;
+    if (window < 1)
+    {
+        window = 1;
+    }
+    if (window > CAR_LINK_MAX_PENDING)
+    {
+        window = CAR_LINK_MAX_PENDING;
+    }
+    for (size_t k = 0; k < window; k++)
+    {
+        p.slots[k].pipeline = &p;
+        p.slots[k].busy = false;
+    }
+    {
+        std::lock_guard<std::mutex> guard(link->lock);
+        for (size_t i = 0; i < count; i++)
+        {
+            outcomes[i].status = CAR_PENDING;
+            outcomes[i].rtt_us = 0;
+        }
+    }
+
+    // submit_in() checks epoch, so nothing of this batch goes out after a preempt
+    size_t next = 0;
+    while (next < count)
+    {
+        pipeline_slot_t *slot = NULL;
+        {
+            std::unique_lock<std::mutex> guard(link->lock);
+            pipeline_wait_locked(&p, guard, window);
+            for (size_t k = 0; k < window && !slot; k++)
+            {
+                slot = p.slots[k].busy ? NULL : &p.slots[k];
+            }
+            slot->index = next;
+            slot->busy = true;
+            p.in_flight++;
+            p.deadline_us = now_us() + timeout_ms * 1000LL + CAR_FUTURE_SLACK_US;
+        }
+        car_status_t status = submit_in(link, &cmds[next], timeout_ms, pipeline_done, slot, epoch);
+        if (status == CAR_OK && !cmds[next].id[0])
+        {
+            // nothing will answer; count it as delivered
+            std::lock_guard<std::mutex> guard(link->lock);
+            outcomes[next].status = CAR_OK;
+            outcomes[next].rtt_us = 0;
+            slot->busy = false;
+            p.in_flight--;
+        }
+        else if (status != CAR_OK)
+        {
+            std::unique_lock<std::mutex> guard(link->lock);
+            slot->busy = false;
+            p.in_flight--;
+            if (status == CAR_BUSY && p.in_flight)
+            {
+                // same id still in flight, or the table is full: retry after the next reply
+                pipeline_wait_locked(&p, guard, p.in_flight);
+                continue;
+            }
+            outcomes[next].status = status;
+            outcomes[next].rtt_us = 0;
+            if (status == CAR_CANCELLED)
+            {
+                while (++next < count)
+                {
+                    outcomes[next].status = CAR_CANCELLED;
+                    outcomes[next].rtt_us = 0;
+                }
+                break;
+            }
+        }
+        next++;
+    }
+
+    // every slot lives on this stack frame, so wait for the last replies or timeouts
+    std::unique_lock<std::mutex> guard(link->lock);
+    pipeline_wait_locked(&p, guard, 1);
+    size_t ok = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        ok += outcomes[i].status == CAR_OK;
+    }
+    return ok;
+}
+
+void car_link_outcomes(car_link_t *link, const car_outcome_t *outcomes, size_t count, car_outcome_t *copy)
+{
+    // every writer of a pipeline's outcomes holds the link lock
+    std::lock_guard<std::mutex> guard(link->lock);
+    memcpy(copy, outcomes, count * sizeof(car_outcome_t));
+}
+
+// Runs in the polling task: the car sends binary right after its ack, so the
+// framer has to switch before it reads another byte.
+static void negotiate_done(void *arg, const car_result_t *result)
+{
+    car_future_t *future = (car_future_t *)arg;
+    if (result->status == CAR_OK)
+    {
+        car_link_set_framing(future->link, CAR_FRAMING_BINARY);
+    }
+    future_done(arg, result);
+}
+
+car_framing_t car_link_negotiate(car_link_t *link, uint32_t timeout_ms)
+{
+    car_cmd_t hello;
+    hello.n = CAR_CMD_PROTO;
+    hello.argc = 1;
+    hello.arg[0] = CAR_PROTO_VERSION;
+    hello.arg[1] = 0;
+    strcpy(hello.id, "v1");
+    car_link_set_framing(link, CAR_FRAMING_TEXT);
+    car_future_t future;
+    submit_future(link, &hello, timeout_ms, &future, negotiate_done);
+    car_link_wait(&future);
+    return car_link_framing(link);
+}
+
+uint32_t car_link_epoch(car_link_t *link)
+{
+    return link->epoch.load();
+}
+
+car_link_stats_t car_link_stats(car_link_t *link)
+{
+    std::lock_guard<std::mutex> guard(link->lock);
+    return link->stats;
+}
@@ -0,0 +1,258 @@
+/*
+ * Command link to the car's Arduino over the UART.
+ *
+ * Commands carry an id in "H"; the car answers with {<id>_ok}, {<id>_false},
+ * {<id>_<value>} or a JSON object that echoes "H". One reader (car_link_poll,
+ * run from a dedicated task) frames the incoming bytes, matches each reply to
+ * its pending request by id and completes it through a callback, or with a
+ * timeout once the request's deadline has passed. Callers either pass a
+ * callback or block on a future; nothing busy-waits on the UART. Frames no
+ * request claims go to subscribers (TCP bridge, factory test) through
+ * single-producer single-consumer queues, so no one else reads the UART.
+ *
+ * The transport is a set of function pointers, so the link runs unchanged
+ * against Serial2 on the car and against a pty on a host.
+ */
+
+#ifndef _CAR_LINK_H
+#define _CAR_LINK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#define CAR_LINK_MAX_PENDING 16
+#define CAR_LINK_ID_LEN 12
+#define CAR_LINK_FRAME_LEN 192 // longer incoming frames are dropped
+#define CAR_LINK_WIRE_LEN (CAR_LINK_FRAME_LEN + 16) // a text frame wrapped in binary framing
+#define CAR_LINK_MAX_SUBSCRIBERS 6
+#define CAR_LINK_KEY_LEN 16
+#define CAR_LINK_QUEUE_DEPTH 8 // power of two
+
+// Car command numbers (Elegoo protocol "N")
+#define CAR_CMD_STOP 100
+#define CAR_CMD_MOVE 200 // D1 direction, D2 distance in cm
+#define CAR_CMD_TURN 201 // D1 degrees
+#define CAR_CMD_POSE 300
+#define CAR_CMD_POSE_STREAM 301 // D1 period in ms, 0 stops; poses then arrive unasked under CAR_POSE_STREAM_ID
+#define CAR_CMD_PROTO 110 // D1 = binary framing version offered; {id_ok} if the car switches
+
+#define CAR_PROTO_VERSION 1
+#define CAR_POSE_STREAM_ID "ps" // {"H":"ps","pose":{...}}, subscribe to it for streamed poses
+
+typedef enum
+{
+    CAR_FRAMING_TEXT,   // JSON frames, what every car firmware speaks
+    CAR_FRAMING_BINARY, // car_proto.h
+} car_framing_t;
+
+typedef struct
+{
+    // Returns the number of bytes read, 0 if nothing arrived within timeout_ms, < 0 on error.
+    int (*read)(void *ctx, uint8_t *buf, size_t len, uint32_t timeout_ms);
+    bool (*write)(void *ctx, const uint8_t *buf, size_t len);
+    void (*set_baud)(void *ctx, uint32_t baud);
+    void (*flush)(void *ctx); // returns once everything written is on the wire
+    void *ctx;
+} car_transport_t;
+
+typedef struct
+{
+    uint16_t n;
+    uint8_t argc; // how many of D1, D2 are sent
+    int32_t arg[2];
+    char id[CAR_LINK_ID_LEN]; // empty: no reply expected
+} car_cmd_t;
+
+typedef enum
+{
+    CAR_OK,       // {id_ok}, {id_value} or a JSON reply
+    CAR_REJECTED, // {id_false}
+    CAR_TIMEOUT,
+    CAR_BUSY,     // no free slot, or the id is already in flight
+    CAR_IO_ERROR, // the transport refused the write
+    CAR_CANCELLED, // flushed by car_link_preempt()
+    CAR_PENDING,   // not answered yet, in the outcomes of a running car_link_pipeline()
+} car_status_t;
+
+typedef struct
+{
+    car_status_t status;
+    int64_t rtt_us;
+    size_t reply_len;
+    char reply[CAR_LINK_FRAME_LEN + 1];
+} car_result_t;
+
+// Called once per submitted command, from the task running car_link_poll().
+typedef void (*car_done_fn)(void *arg, const car_result_t *result);
+typedef struct
+{
+    uint16_t len;
+    char text[CAR_LINK_FRAME_LEN + 1]; // NUL terminated
+} car_frame_t;
+
+// Lock-free ring between the polling task (the only producer) and one consumer.
+typedef struct
+{
+    car_frame_t slots[CAR_LINK_QUEUE_DEPTH];
+    std::atomic<uint32_t> head; // next slot to write, producer only
+    std::atomic<uint32_t> tail; // next slot to read, consumer only
+    std::atomic<uint32_t> dropped; // frames that found the queue full
+} car_frame_queue_t;
+
+typedef struct
+{
+    bool in_use;
+    char key[CAR_LINK_KEY_LEN]; // empty: frames no keyed subscriber took
+    car_frame_queue_t *queue;
+} car_subscriber_t;
+
+typedef struct
+{
+    bool in_use;
+    char id[CAR_LINK_ID_LEN];
+    uint8_t tag; // stands in for id on the wire in binary framing
+    int64_t sent_us;
+    int64_t deadline_us;
+    car_done_fn done;
+    void *arg;
+} car_pending_t;
+
+typedef struct
+{
+    uint32_t sent;
+    uint32_t completed;
+    uint32_t rejected;
+    uint32_t timeouts;
+    uint32_t unmatched;  // frames no request or subscriber took
+    uint32_t overflows;  // frames longer than CAR_LINK_FRAME_LEN
+    uint32_t crc_errors; // binary frames failing COBS or CRC checks
+    uint32_t tx_bytes;
+    uint32_t rx_bytes;
+    int64_t rtt_last_us;
+    int64_t rtt_max_us;
+    int64_t rtt_sum_us; // over completed
+    uint32_t cancelled; // pending commands flushed by preempts
+    uint32_t preempts;
+    int64_t preempt_last_us; // car_link_preempt() call until its frame was on the wire
+    int64_t preempt_max_us;
+} car_link_stats_t;
+
+typedef struct car_link
+{
+    car_transport_t io;
+    std::mutex lock;    // pending table, stats
+    std::mutex tx_lock; // keeps frames from different callers whole
+    std::condition_variable cond;
+    std::condition_variable tx_cond;  // writers held back while a preempt goes out
+    std::atomic<int> preempting;      // preempts waiting for or holding tx_lock
+    std::atomic<uint32_t> epoch;      // bumped by every preempt
+    car_pending_t pending[CAR_LINK_MAX_PENDING];
+    car_subscriber_t subscribers[CAR_LINK_MAX_SUBSCRIBERS];
+    car_framing_t framing;
+    uint8_t next_tag;
+    // incremental framers, only touched by the polling task
+    char frame[CAR_LINK_FRAME_LEN];
+    size_t frame_len;
+    int depth;
+    bool in_string;
+    bool overflow;
+    uint8_t wire[CAR_LINK_WIRE_LEN];
+    size_t wire_len;
+    car_link_stats_t stats;
+} car_link_t;
+
+// Result holder for callers that want to block; lives until car_link_wait() returns.
+typedef struct
+{
+    car_link_t *link;
+    bool done;
+    int64_t deadline_us; // backstop in case nothing polls the link
+    car_result_t result;
+} car_future_t;
+
+void car_link_init(car_link_t *link, const car_transport_t *io);
+// Frames no pending request claims are queued for the subscribers whose key
+// is the frame's reply id ({key_...}, "H":"key") or its whole body ({key}).
+// Subscribers with an empty key get the frames no keyed subscriber took.
+// Returns false if the table is full.
+bool car_link_subscribe(car_link_t *link, const char *key, car_frame_queue_t *queue);
+void car_link_set_framing(car_link_t *link, car_framing_t framing);
+car_framing_t car_link_framing(car_link_t *link);
+// Drains what was written so far, then changes the UART rate (car_baud.h).
+void car_link_set_baud(car_link_t *link, uint32_t baud);
+// Offers binary framing with a text CAR_CMD_PROTO command and switches to it
+// if the car accepts; old firmware doesn't, and the link stays on text.
+// Needs the polling task running.
+car_framing_t car_link_negotiate(car_link_t *link, uint32_t timeout_ms);
+
+// Reads for up to timeout_ms, completes the requests whose replies arrived and
+// expires the ones past their deadline. Run it in a loop from a single task.
+void car_link_poll(car_link_t *link, uint32_t timeout_ms);
+
+// Writes the command and registers it under cmd->id. Anything but CAR_OK
+// means it was not sent and done will not be called. Commands without an id
+// are written and forgotten.
+car_status_t car_link_submit(car_link_t *link, const car_cmd_t *cmd, uint32_t timeout_ms, car_done_fn done, void *arg);
+car_status_t car_link_submit_future(car_link_t *link, const car_cmd_t *cmd, uint32_t timeout_ms, car_future_t *future);
+// Blocks until the future completes; returns its status.
+car_status_t car_link_wait(car_future_t *future);
+// submit_future + wait
+car_status_t car_link_call(car_link_t *link, const car_cmd_t *cmd, uint32_t timeout_ms, car_result_t *result);
+// A text frame, e.g. forwarded from the TCP bridge; no reply tracking. Wrapped
+// in a TEXT frame when the link runs binary framing.
+bool car_link_write(car_link_t *link, const void *data, size_t len);
+
+// Priority lane for stop and emergency frames. cmd goes out ahead of every
+// command still waiting to be written, which is then dropped, and all pending
+// commands complete with CAR_CANCELLED, so pipelines stop feeding the car.
+// It waits only for the frame being written when it is called and what the
+// UART still buffers; the time until cmd is on the wire is in the stats.
+// With a future and an id in cmd, the reply is tracked like car_link_submit_future().
+car_status_t car_link_preempt(car_link_t *link, const car_cmd_t *cmd, uint32_t timeout_ms, car_future_t *future);
+// Moves on every car_link_preempt(); work queued before a stop can check it.
+uint32_t car_link_epoch(car_link_t *link);
+
+car_link_stats_t car_link_stats(car_link_t *link);
+
+void car_frame_queue_init(car_frame_queue_t *queue);
+// Producer side; false (and counted in dropped) if the queue is full.
+bool car_frame_queue_push(car_frame_queue_t *queue, const char *frame, size_t len);
+// Consumer side; false if empty.
+bool car_frame_queue_pop(car_frame_queue_t *queue, car_frame_t *out);
+
+typedef struct
+{
+    car_status_t status;
+    int64_t rtt_us;
+} car_outcome_t;
+
+// Sends cmds in order, keeping up to window of them awaiting their reply, and
+// stores each command's outcome at the same index as replies arrive in any
+// order. A preempt cancels the rest. Returns the number of CAR_OK outcomes.
+size_t car_link_pipeline(car_link_t *link, const car_cmd_t *cmds, size_t count, size_t window, uint32_t timeout_ms,
+                         car_outcome_t *outcomes);
+// Same, for a batch that waited in a queue: a preempt since epoch was read with
+// car_link_epoch() cancels all of it before anything goes out.
+size_t car_link_pipeline_at(car_link_t *link, const car_cmd_t *cmds, size_t count, size_t window,
+                            uint32_t timeout_ms, car_outcome_t *outcomes, uint32_t epoch);
+// Copies the outcomes of a pipeline that may still be running; commands not
+// answered yet read CAR_PENDING.
+void car_link_outcomes(car_link_t *link, const car_outcome_t *outcomes, size_t count, car_outcome_t *copy);
+
+// Builders for the commands the firmware sends; id may be NULL.
+car_cmd_t car_cmd_move(int dir, uint32_t cm, const char *id);
+car_cmd_t car_cmd_turn(int degrees, const char *id);
+car_cmd_t car_cmd_pose(const char *id);
+car_cmd_t car_cmd_pose_stream(uint32_t period_ms, const char *id);
+car_cmd_t car_cmd_stop(void);
+
+// Text form of a command, {"N":200,"D1":1,"D2":50,"H":"m001"}. Returns its
+// length, or 0 if it does not fit.
+size_t car_cmd_format(const car_cmd_t *cmd, char *out, size_t size);
+// Extracts the id a reply frame refers to. Returns false if it carries none.
+bool car_reply_id(const char *frame, size_t len, char *id, size_t id_size, car_status_t *status);
+
+#endif
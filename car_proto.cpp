@@ -0,0 +1,164 @@
+#include "car_proto.h"
+#include <stdio.h>
+#include <string.h>
+
+uint16_t car_proto_crc16(const uint8_t *data, size_t len)
+{
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int b = 0; b < 8; b++)
+        {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+size_t cobs_encode(const uint8_t *in, size_t len, uint8_t *out)
+{
+    size_t code_pos = 0;
+    size_t o = 1;
+    uint8_t code = 1;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (in[i])
+        {
+            out[o++] = in[i];
+            code++;
+        }
+        if (!in[i] || code == 0xFF)
+        {
+            out[code_pos] = code;
+            code = 1;
+            code_pos = o++;
+        }
+    }
+    out[code_pos] = code;
+    return o;
+}
+
+size_t cobs_decode(const uint8_t *in, size_t len, uint8_t *out)
+{
+    size_t i = 0;
+    size_t o = 0;
+    while (i < len)
+    {
+        uint8_t code = in[i++];
+        if (!code || i + code - 1 > len)
+        {
+            return 0;
+        }
+        for (uint8_t k = 1; k < code; k++)
+        {
+            out[o++] = in[i++];
+        }
+        if (code != 0xFF && i < len)
+        {
+            out[o++] = 0;
+        }
+    }
+    return o;
+}
+
+size_t car_proto_encode(uint8_t type, uint8_t tag, const uint8_t *payload, size_t payload_len, uint8_t *out,
+                        size_t size)
+{
+    uint8_t body[CAR_PROTO_MAX_BODY + 2];
+    size_t len = 2 + payload_len;
+    if (len > CAR_PROTO_MAX_BODY || CAR_PROTO_WIRE_LEN(len) > size)
+    {
+        return 0;
+    }
+    body[0] = type;
+    body[1] = tag;
+    if (payload_len)
+    {
+        memcpy(body + 2, payload, payload_len);
+    }
+    uint16_t crc = car_proto_crc16(body, len);
+    body[len++] = crc & 0xFF;
+    body[len++] = crc >> 8;
+    size_t n = cobs_encode(body, len, out);
+    out[n++] = 0;
+    return n;
+}
+
+size_t car_proto_encode_cmd(const car_cmd_t *cmd, uint8_t tag, uint8_t *out, size_t size)
+{
+    uint8_t payload[3] = {0};
+    switch (cmd->n)
+    {
+    case CAR_CMD_STOP:
+        return car_proto_encode(CAR_PROTO_STOP, tag, payload, 0, out, size);
+    case CAR_CMD_MOVE:
+        payload[0] = (uint8_t)(int8_t)cmd->arg[0];
+        payload[1] = cmd->arg[1] & 0xFF;
+        payload[2] = (cmd->arg[1] >> 8) & 0xFF;
+        return cmd->arg[1] >= 0 && cmd->arg[1] <= 0xFFFF ? car_proto_encode(CAR_PROTO_MOVE, tag, payload, 3, out, size) : 0;
+    case CAR_CMD_TURN:
+        payload[0] = cmd->arg[0] & 0xFF;
+        payload[1] = (cmd->arg[0] >> 8) & 0xFF;
+        return car_proto_encode(CAR_PROTO_TURN, tag, payload, 2, out, size);
+    case CAR_CMD_POSE:
+        return car_proto_encode(CAR_PROTO_POSE, tag, payload, 0, out, size);
+    default:
+        return 0;
+    }
+}
+
+size_t car_proto_encode_text(const char *text, size_t len, uint8_t *out, size_t size)
+{
+    return car_proto_encode(CAR_PROTO_TEXT, 0, (const uint8_t *)text, len, out, size);
+}
+
+bool car_proto_decode(uint8_t *buf, size_t len, car_proto_msg_t *msg)
+{
+    size_t n = cobs_decode(buf, len, buf);
+    if (n < 4)
+    {
+        return false;
+    }
+    uint16_t crc = buf[n - 2] | (buf[n - 1] << 8);
+    if (car_proto_crc16(buf, n - 2) != crc)
+    {
+        return false;
+    }
+    msg->type = buf[0];
+    msg->tag = buf[1];
+    msg->payload = buf + 2;
+    msg->payload_len = n - 4;
+    return true;
+}
+
+static int16_t get_le16(const uint8_t *p)
+{
+    return (int16_t)(p[0] | (p[1] << 8));
+}
+
+size_t car_proto_reply_text(const car_proto_msg_t *msg, const char *id, char *out, size_t size)
+{
+    int len = 0;
+    switch (msg->type)
+    {
+    case CAR_PROTO_ACK:
+        len = snprintf(out, size, "{%s_ok}", id);
+        break;
+    case CAR_PROTO_REJECT:
+        len = snprintf(out, size, "{%s_false}", id);
+        break;
+    case CAR_PROTO_POSE_REPLY:
+        if (msg->payload_len < 8)
+        {
+            return 0;
+        }
+        len = snprintf(out, size, "{\"H\":\"%s\",\"pose\":{\"x\":%.3f,\"y\":%.3f,\"th\":%d,\"v\":%.3f}}", id,
+                       get_le16(msg->payload) / 1000.0, get_le16(msg->payload + 2) / 1000.0,
+                       get_le16(msg->payload + 4), get_le16(msg->payload + 6) / 1000.0);
+        break;
+    default:
+        return 0;
+    }
+    return len > 0 && (size_t)len < size ? (size_t)len : 0;
+}
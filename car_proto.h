@@ -0,0 +1,72 @@
+/*
+ * Binary framing for the car link, used instead of the JSON text frames once
+ * both sides agreed on it (see car_link_negotiate).
+ *
+ * A frame is   type | tag | payload | crc16   COBS encoded and terminated
+ * by a 0x00 byte, so a receiver resynchronizes at the next zero after any
+ * corruption and a bad CRC drops exactly one frame. The tag is a one byte
+ * stand-in for the H id, assigned by the sender and echoed in the reply.
+ * Multi-byte fields are little endian.
+ *
+ *   ESP32 -> car                      car -> ESP32
+ *   0x01 STOP                         0x81 ACK      ({id_ok})
+ *   0x02 MOVE  dir i8, cm u16         0x82 REJECT   ({id_false})
+ *   0x03 TURN  degrees i16            0x83 POSE     x mm i16, y mm i16, th deg i16, v mm/s i16
+ *   0x04 POSE                         0x7F TEXT     any text frame, tag 0
+ *   0x7F TEXT  any text frame, tag 0
+ *
+ * A POSE reply with tag 0 is a streamed pose (CAR_CMD_POSE_STREAM, which like
+ * the other commands without a binary form travels as TEXT).
+ */
+
+#ifndef _CAR_PROTO_H
+#define _CAR_PROTO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "car_link.h"
+
+#define CAR_PROTO_STOP 0x01
+#define CAR_PROTO_MOVE 0x02
+#define CAR_PROTO_TURN 0x03
+#define CAR_PROTO_POSE 0x04
+#define CAR_PROTO_ACK 0x81
+#define CAR_PROTO_REJECT 0x82
+#define CAR_PROTO_POSE_REPLY 0x83
+#define CAR_PROTO_TEXT 0x7F
+
+// Encoded size of a len byte frame body (before COBS), delimiter included
+#define CAR_PROTO_WIRE_LEN(len) ((len) + 2 + ((len) + 2) / 254 + 1 + 1)
+#define CAR_PROTO_MAX_BODY (CAR_LINK_FRAME_LEN + 2)
+#define CAR_PROTO_MAX_WIRE CAR_PROTO_WIRE_LEN(CAR_PROTO_MAX_BODY)
+
+typedef struct
+{
+    uint8_t type;
+    uint8_t tag;
+    const uint8_t *payload;
+    size_t payload_len;
+} car_proto_msg_t;
+
+uint16_t car_proto_crc16(const uint8_t *data, size_t len); // CRC-16/CCITT-FALSE
+// Returns the encoded length; out must hold len + len / 254 + 1 bytes.
+size_t cobs_encode(const uint8_t *in, size_t len, uint8_t *out);
+// Decodes in place is allowed. Returns the decoded length, 0 if in is malformed.
+size_t cobs_decode(const uint8_t *in, size_t len, uint8_t *out);
+
+// Wire frames, delimiter included. Return 0 if out is too small or the
+// command has no binary form.
+size_t car_proto_encode(uint8_t type, uint8_t tag, const uint8_t *payload, size_t payload_len, uint8_t *out,
+                        size_t size);
+size_t car_proto_encode_cmd(const car_cmd_t *cmd, uint8_t tag, uint8_t *out, size_t size);
+size_t car_proto_encode_text(const char *text, size_t len, uint8_t *out, size_t size);
+
+// Decodes one frame as received between delimiters; buf is overwritten and
+// msg points into it. Returns false on COBS or CRC errors.
+bool car_proto_decode(uint8_t *buf, size_t len, car_proto_msg_t *msg);
+
+// Text form of a reply for the id the tag stood for, as the JSON protocol
+// would have sent it. Returns its length, or 0 for unknown types.
+size_t car_proto_reply_text(const car_proto_msg_t *msg, const char *id, char *out, size_t size);
+
+#endif
@@ -0,0 +1,78 @@
+#include "car_serial.h"
+#include <Arduino.h>
+#include "esp_timer.h"
+
+car_link_t car_link;
+car_baud_t car_baud;
+car_frame_queue_t pose_frames;
+
+static int serial_read(void *ctx, uint8_t *buf, size_t len, uint32_t timeout_ms)
+{
+    HardwareSerial *port = (HardwareSerial *)ctx;
+    uint32_t start = millis();
+    size_t avail;
+    while (!(avail = port->available()))
+    {
+        if (millis() - start >= timeout_ms)
+        {
+            return 0;
+        }
+        vTaskDelay(1);
+    }
+    return (int)port->read(buf, avail < len ? avail : len);
+}
+
+static bool serial_write(void *ctx, const uint8_t *buf, size_t len)
+{
+    return ((HardwareSerial *)ctx)->write(buf, len) == len;
+}
+
+static void serial_set_baud(void *ctx, uint32_t baud)
+{
+    ((HardwareSerial *)ctx)->updateBaudRate(baud);
+}
+
+static void serial_flush(void *ctx)
+{
+    ((HardwareSerial *)ctx)->flush();
+}
+
+static void car_rx_task(void *arg)
+{
+    while (true)
+    {
+        car_link_poll(&car_link, 20);
+    }
+}
+
+// Blocking car_link_call()s, so off the RX task
+static void car_baud_task(void *arg)
+{
+    while (true)
+    {
+        vTaskDelay(500 / portTICK_PERIOD_MS);
+        if (car_baud_check(&car_baud, esp_timer_get_time()))
+        {
+            Serial.printf("Car link: down to %u baud\n", car_baud_rate(&car_baud));
+        }
+    }
+}
+
+void car_serial_init(uint32_t baud, int8_t rx_pin, int8_t tx_pin)
+{
+    Serial2.begin(baud, SERIAL_8N1, rx_pin, tx_pin);
+    car_transport_t io = {serial_read, serial_write, serial_set_baud, serial_flush, &Serial2};
+    car_link_init(&car_link, &io);
+}
+
+void car_serial_begin(void)
+{
+    // above the camera tasks, so replies are timestamped when they arrive
+    xTaskCreate(car_rx_task, "car_rx", 4096, NULL, tskIDLE_PRIORITY + 6, NULL);
+    // older car firmware doesn't answer the offer and keeps the JSON protocol
+    bool binary = car_link_negotiate(&car_link, 300) == CAR_FRAMING_BINARY;
+    Serial.println(binary ? "Car link: binary framing" : "Car link: JSON framing");
+    car_baud_init(&car_baud, &car_link, NULL);
+    Serial.printf("Car link: %u baud\n", car_baud_negotiate(&car_baud));
+    xTaskCreate(car_baud_task, "car_baud", 3072, NULL, tskIDLE_PRIORITY + 1, NULL);
+}
@@ -0,0 +1,27 @@
+/*
+ * The car link bound to Serial2. A task started by car_serial_begin() is the
+ * only reader of the UART; everything else talks to the car through car_link.
+ * car_serial_begin() also settles framing and baud rate with the car, and a
+ * second task steps the rate down if the link turns unreliable.
+ *
+ * car_serial_init() opens the port and resets the link; subscribe queues
+ * between the two calls so no frame arrives before its subscriber.
+ */
+
+#ifndef _CAR_SERIAL_H
+#define _CAR_SERIAL_H
+
+#include <stdint.h>
+#include "car_link.h"
+#include "car_baud.h"
+
+extern car_link_t car_link;
+extern car_baud_t car_baud;
+// Poses the car streams under CAR_POSE_STREAM_ID, drained by pose_stream_task
+// in app_httpd.cpp; subscribed in setup() with the other queues
+extern car_frame_queue_t pose_frames;
+
+void car_serial_init(uint32_t baud, int8_t rx_pin, int8_t tx_pin);
+void car_serial_begin(void);
+
+#endif
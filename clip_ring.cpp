@@ -0,0 +1,180 @@
+#include "clip_ring.h"
+#include <string.h>
+
+#define CLIP_ALIGN 8
+
+static size_t record_size(size_t len)
+{
+    return (sizeof(clip_frame_t) + len + CLIP_ALIGN - 1) & ~(size_t)(CLIP_ALIGN - 1);
+}
+
+static const clip_frame_t *record_at(const clip_ring_t *ring, size_t pos)
+{
+    return (const clip_frame_t *)(ring->mem + pos);
+}
+
+// Caller holds ring->lock
+static void reset_locked(clip_ring_t *ring)
+{
+    ring->head = 0;
+    ring->tail = 0;
+    ring->wrap_end = 0;
+    ring->wrapped = false;
+    ring->count = 0;
+    ring->frame_bytes = 0;
+}
+
+// Caller holds ring->lock
+static void evict_oldest_locked(clip_ring_t *ring)
+{
+    const clip_frame_t *rec = record_at(ring, ring->head);
+    ring->frame_bytes -= rec->len;
+    ring->head += record_size(rec->len);
+    ring->count--;
+    ring->evicted++;
+    if (!ring->count)
+    {
+        reset_locked(ring);
+    }
+    else if (ring->wrapped && ring->head >= ring->wrap_end)
+    {
+        ring->head = 0;
+        ring->wrapped = false;
+    }
+}
+
+// Caller holds ring->lock. Evicts until need bytes fit, returns their offset.
+static size_t reserve_locked(clip_ring_t *ring, size_t need)
+{
+    while (true)
+    {
+        if (!ring->count)
+        {
+            reset_locked(ring);
+            return 0;
+        }
+        if (!ring->wrapped)
+        {
+            if (ring->size - ring->tail >= need)
+            {
+                return ring->tail;
+            }
+            if (ring->head >= need)
+            {
+                ring->wrap_end = ring->tail;
+                ring->wrapped = true;
+                return 0;
+            }
+        }
+        else if (ring->head - ring->tail >= need)
+        {
+            return ring->tail;
+        }
+        evict_oldest_locked(ring);
+    }
+}
+
+void clip_ring_init(clip_ring_t *ring, uint8_t *mem, size_t size, int64_t max_age_us)
+{
+    std::lock_guard<std::mutex> guard(ring->lock);
+    ring->mem = mem;
+    ring->size = mem ? size & ~(size_t)(CLIP_ALIGN - 1) : 0;
+    ring->max_age_us = max_age_us;
+    ring->frozen = false;
+    ring->stored = 0;
+    ring->evicted = 0;
+    ring->rejected = 0;
+    reset_locked(ring);
+}
+
+void clip_ring_clear(clip_ring_t *ring)
+{
+    std::lock_guard<std::mutex> guard(ring->lock);
+    reset_locked(ring);
+}
+
+bool clip_ring_push(clip_ring_t *ring, const uint8_t *jpg, size_t len, uint16_t width, uint16_t height,
+                    int64_t timestamp_us)
+{
+    std::lock_guard<std::mutex> guard(ring->lock);
+    size_t need = record_size(len);
+    if (ring->frozen || need > ring->size)
+    {
+        ring->rejected++;
+        return false;
+    }
+    if (ring->max_age_us)
+    {
+        while (ring->count && timestamp_us - record_at(ring, ring->head)->timestamp_us > ring->max_age_us)
+        {
+            evict_oldest_locked(ring);
+        }
+    }
+
+    size_t pos = reserve_locked(ring, need);
+    clip_frame_t *rec = (clip_frame_t *)(ring->mem + pos);
+    rec->len = len;
+    rec->width = width;
+    rec->height = height;
+    rec->timestamp_us = timestamp_us;
+    memcpy(rec + 1, jpg, len);
+    ring->tail = pos + need;
+    ring->count++;
+    ring->frame_bytes += len;
+    ring->newest_us = timestamp_us;
+    ring->stored++;
+    return true;
+}
+
+void clip_ring_freeze(clip_ring_t *ring, bool frozen)
+{
+    std::lock_guard<std::mutex> guard(ring->lock);
+    ring->frozen = frozen;
+}
+
+uint32_t clip_ring_visit(clip_ring_t *ring, int64_t since_us, clip_ring_visit_fn fn, void *arg)
+{
+    // Frozen rings are read without the lock so a slow reader doesn't hold up pushes
+    std::unique_lock<std::mutex> guard(ring->lock);
+    if (ring->frozen)
+    {
+        guard.unlock();
+    }
+    uint32_t visited = 0;
+    size_t pos = ring->head;
+    bool wrapped = ring->wrapped;
+    for (uint32_t i = 0; i < ring->count; i++)
+    {
+        const clip_frame_t *rec = record_at(ring, pos);
+        if (rec->timestamp_us >= since_us)
+        {
+            visited++;
+            if (!fn(arg, rec, (const uint8_t *)(rec + 1)))
+            {
+                break;
+            }
+        }
+        pos += record_size(rec->len);
+        if (wrapped && pos >= ring->wrap_end)
+        {
+            pos = 0;
+            wrapped = false;
+        }
+    }
+    return visited;
+}
+
+clip_ring_stats_t clip_ring_stats(clip_ring_t *ring)
+{
+    std::lock_guard<std::mutex> guard(ring->lock);
+    clip_ring_stats_t st;
+    st.count = ring->count;
+    st.frame_bytes = ring->frame_bytes;
+    st.size = ring->size;
+    st.oldest_us = ring->count ? record_at(ring, ring->head)->timestamp_us : 0;
+    st.newest_us = ring->count ? ring->newest_us : 0;
+    st.stored = ring->stored;
+    st.evicted = ring->evicted;
+    st.rejected = ring->rejected;
+    return st;
+}
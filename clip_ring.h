@@ -0,0 +1,74 @@
+/*
+ * Pre-event clip buffer: the most recent JPEG frames, kept back to back in one
+ * caller-supplied block of memory (PSRAM on the car). Capacity is a byte budget,
+ * so low-resolution frames buy more seconds than large ones; the oldest frames
+ * are evicted to make room, and frames older than max_age_us go as well.
+ *
+ * Records never straddle the end of the block: when the tail runs out of room
+ * it wraps to offset 0 and the gap left at the end is skipped on reads.
+ *
+ * No platform dependencies, the eviction logic can be exercised on a host.
+ */
+
+#ifndef _CLIP_RING_H
+#define _CLIP_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+
+typedef struct
+{
+    uint32_t len; // JPEG bytes following the record header
+    uint16_t width;
+    uint16_t height;
+    int64_t timestamp_us;
+} clip_frame_t;
+
+typedef struct
+{
+    std::mutex lock;
+    uint8_t *mem;
+    size_t size;
+    int64_t max_age_us; // 0 keeps frames until the budget runs out
+    size_t head;        // oldest record
+    size_t tail;        // where the next record goes
+    size_t wrap_end;    // end of the data before offset 0, while wrapped
+    bool wrapped;       // data is [head, wrap_end) + [0, tail)
+    bool frozen;        // pushes are refused while an export reads the ring
+    uint32_t count;
+    size_t frame_bytes; // JPEG bytes held
+    int64_t newest_us;
+    uint32_t stored;
+    uint32_t evicted;
+    uint32_t rejected; // larger than the whole budget, or pushed while frozen
+} clip_ring_t;
+
+typedef struct
+{
+    uint32_t count;
+    size_t frame_bytes;
+    size_t size;
+    int64_t oldest_us;
+    int64_t newest_us;
+    uint32_t stored;
+    uint32_t evicted;
+    uint32_t rejected;
+} clip_ring_stats_t;
+
+// Called for each frame from oldest to newest; return false to stop.
+typedef bool (*clip_ring_visit_fn)(void *arg, const clip_frame_t *frame, const uint8_t *jpg);
+
+void clip_ring_init(clip_ring_t *ring, uint8_t *mem, size_t size, int64_t max_age_us);
+void clip_ring_clear(clip_ring_t *ring);
+// Copies one frame in, evicting as needed. Returns false if it was rejected.
+bool clip_ring_push(clip_ring_t *ring, const uint8_t *jpg, size_t len, uint16_t width, uint16_t height,
+                    int64_t timestamp_us);
+// While frozen the ring content is stable and may be visited without blocking
+// the recorder; pushes are counted as rejected.
+void clip_ring_freeze(clip_ring_t *ring, bool frozen);
+// Visits the frames captured at or after since_us. Returns the number visited.
+uint32_t clip_ring_visit(clip_ring_t *ring, int64_t since_us, clip_ring_visit_fn fn, void *arg);
+clip_ring_stats_t clip_ring_stats(clip_ring_t *ring);
+
+#endif
@@ -0,0 +1,260 @@
+#include "frame_hub.h"
+#include <string.h>
+#include <chrono>
+
+// Caller holds hub->lock
+static void frame_unref_locked(frame_ref_t *frame)
+{
+    if (--frame->refs > 0)
+    {
+        return;
+    }
+    if (frame->release)
+    {
+        frame->release(frame->owner);
+    }
+    frame->owner = NULL;
+    frame->release = NULL;
+    frame->buf = NULL;
+    frame->len = 0;
+    frame->pinned = false;
+}
+
+// Caller holds hub->lock
+static int pinned_locked(frame_hub_t *hub)
+{
+    int pinned = 0;
+    for (int i = 0; i < FRAME_HUB_MAX_FRAMES; i++)
+    {
+        pinned += hub->frames[i].refs > 0 && hub->frames[i].pinned;
+    }
+    return pinned;
+}
+
+void frame_hub_init(frame_hub_t *hub)
+{
+    std::lock_guard<std::mutex> guard(hub->lock);
+    for (int i = 0; i < FRAME_HUB_MAX_FRAMES; i++)
+    {
+        frame_ref_t *f = &hub->frames[i];
+        f->buf = NULL;
+        f->len = 0;
+        f->owner = NULL;
+        f->release = NULL;
+        f->refs = 0;
+        f->pinned = false;
+        f->hub = hub;
+    }
+    for (int i = 0; i < FRAME_HUB_MAX_SUBSCRIBERS; i++)
+    {
+        hub->subs[i].in_use = false;
+        hub->subs[i].pending = NULL;
+        hub->subs[i].last_seq = 0;
+        hub->subs[i].taken = 0;
+        hub->subs[i].dropped = 0;
+        hub->subs[i].skipped = 0;
+    }
+    hub->sub_count = 0;
+    hub->seq = 0;
+    hub->published = 0;
+    hub->overruns = 0;
+    hub->copies = 0;
+    hub->pin_limit = 0;
+    hub->copy_alloc = NULL;
+    hub->copy_release = NULL;
+}
+
+void frame_hub_limit_pins(frame_hub_t *hub, int limit, frame_alloc_fn alloc, frame_release_fn release)
+{
+    std::lock_guard<std::mutex> guard(hub->lock);
+    hub->pin_limit = limit;
+    hub->copy_alloc = alloc;
+    hub->copy_release = release;
+}
+
+frame_hub_stats_t frame_hub_stats(frame_hub_t *hub)
+{
+    std::lock_guard<std::mutex> guard(hub->lock);
+    frame_hub_stats_t stats;
+    stats.published = hub->published;
+    stats.overruns = hub->overruns;
+    stats.copies = hub->copies;
+    stats.pinned = pinned_locked(hub);
+    return stats;
+}
+
+frame_sub_t *frame_hub_subscribe(frame_hub_t *hub)
+{
+    std::lock_guard<std::mutex> guard(hub->lock);
+    for (int i = 0; i < FRAME_HUB_MAX_SUBSCRIBERS; i++)
+    {
+        frame_sub_t *sub = &hub->subs[i];
+        if (!sub->in_use)
+        {
+            sub->in_use = true;
+            sub->pending = NULL;
+            sub->last_seq = 0;
+            sub->taken = 0;
+            sub->dropped = 0;
+            sub->skipped = 0;
+            hub->sub_count++;
+            hub->cond.notify_all();
+            return sub;
+        }
+    }
+    return NULL;
+}
+
+void frame_hub_unsubscribe(frame_hub_t *hub, frame_sub_t *sub)
+{
+    if (!sub)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(hub->lock);
+    if (sub->pending)
+    {
+        frame_unref_locked(sub->pending);
+        sub->pending = NULL;
+    }
+    sub->in_use = false;
+    hub->sub_count--;
+}
+
+frame_ref_t *frame_hub_take(frame_hub_t *hub, frame_sub_t *sub, uint32_t timeout_ms)
+{
+    std::unique_lock<std::mutex> guard(hub->lock);
+    if (!hub->cond.wait_for(guard, std::chrono::milliseconds(timeout_ms), [sub] { return sub->pending != NULL; }))
+    {
+        return NULL;
+    }
+    frame_ref_t *frame = sub->pending;
+    sub->pending = NULL;
+    if (sub->last_seq && frame->seq > sub->last_seq + 1)
+    {
+        sub->skipped += frame->seq - sub->last_seq - 1;
+    }
+    sub->last_seq = frame->seq;
+    sub->taken++;
+    return frame;
+}
+
+frame_sub_stats_t frame_hub_sub_stats(frame_hub_t *hub, frame_sub_t *sub)
+{
+    std::lock_guard<std::mutex> guard(hub->lock);
+    frame_sub_stats_t stats;
+    stats.taken = sub->taken;
+    stats.dropped = sub->dropped;
+    stats.skipped = sub->skipped;
+    return stats;
+}
+
+void frame_ref_release(frame_ref_t *frame)
+{
+    if (!frame)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(frame->hub->lock);
+    frame_unref_locked(frame);
+}
+
+bool frame_hub_wait_subscribers(frame_hub_t *hub, uint32_t timeout_ms)
+{
+    std::unique_lock<std::mutex> guard(hub->lock);
+    return hub->cond.wait_for(guard, std::chrono::milliseconds(timeout_ms), [hub] { return hub->sub_count > 0; });
+}
+
+uint32_t frame_hub_publish(frame_hub_t *hub, const uint8_t *buf, size_t len, uint16_t width, uint16_t height,
+                           int64_t timestamp_us, void *owner, frame_release_fn release)
+{
+    bool copy;
+    {
+        std::lock_guard<std::mutex> guard(hub->lock);
+        copy = hub->pin_limit && hub->sub_count && pinned_locked(hub) >= hub->pin_limit;
+    }
+    if (copy)
+    {
+        // only the producer adds pins, so the count can only have dropped since;
+        // copy without the lock so subscribers keep taking frames meanwhile
+        uint8_t *dup = (uint8_t *)hub->copy_alloc(len);
+        if (dup)
+        {
+            memcpy(dup, buf, len);
+        }
+        if (release)
+        {
+            release(owner);
+        }
+        if (!dup)
+        {
+            std::lock_guard<std::mutex> guard(hub->lock);
+            hub->overruns++;
+            return 0;
+        }
+        buf = dup;
+        owner = dup;
+        release = hub->copy_release;
+    }
+
+    std::lock_guard<std::mutex> guard(hub->lock);
+    frame_ref_t *frame = NULL;
+    for (int i = 0; i < FRAME_HUB_MAX_FRAMES; i++)
+    {
+        if (hub->frames[i].refs == 0)
+        {
+            frame = &hub->frames[i];
+            break;
+        }
+    }
+    if (!frame)
+    {
+        hub->overruns++;
+        if (release)
+        {
+            release(owner);
+        }
+        return 0;
+    }
+
+    frame->buf = buf;
+    frame->len = len;
+    frame->width = width;
+    frame->height = height;
+    frame->timestamp_us = timestamp_us;
+    frame->seq = ++hub->seq;
+    frame->owner = owner;
+    frame->release = release;
+    frame->pinned = !copy;
+    hub->copies += copy;
+    // the hub holds one reference while handing the frame out
+    frame->refs = 1;
+
+    for (int i = 0; i < FRAME_HUB_MAX_SUBSCRIBERS; i++)
+    {
+        frame_sub_t *sub = &hub->subs[i];
+        if (!sub->in_use)
+        {
+            continue;
+        }
+        if (sub->pending)
+        {
+            // latest frame wins, the stale one is dropped for this subscriber only
+            frame_unref_locked(sub->pending);
+            sub->dropped++;
+        }
+        frame->refs++;
+        sub->pending = frame;
+    }
+    hub->published++;
+    uint32_t seq = frame->seq;
+    frame_unref_locked(frame);
+    hub->cond.notify_all();
+    return seq;
+}
+
+int frame_hub_subscriber_count(frame_hub_t *hub)
+{
+    std::lock_guard<std::mutex> guard(hub->lock);
+    return hub->sub_count;
+}
@@ -0,0 +1,117 @@
+/*
+ * Frame hub: one producer (the capture task) publishes each camera frame once,
+ * every subscriber (stream clients, /capture) gets a reference to the same
+ * buffer. The owner (camera_fb_t or a malloc'd JPEG) is handed back through
+ * its release function when the last reference is dropped.
+ *
+ * Every subscriber can hold one frame it is sending plus one in its mailbox,
+ * so with several slow clients the hub could keep every camera buffer and
+ * stall the driver. frame_hub_limit_pins() caps how many frames may stay
+ * backed by their owner; past that, publish copies the bytes out and hands
+ * the owner back at once, so capture never waits on a subscriber.
+ *
+ * Nothing in here depends on the camera driver; tools/hub_bench.cpp drives the
+ * hub on a host with a fake frame source.
+ */
+
+#ifndef _FRAME_HUB_H
+#define _FRAME_HUB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+#include <condition_variable>
+
+#define FRAME_HUB_MAX_SUBSCRIBERS 6
+// one being sent per subscriber, the newest waiting in the mailboxes and the
+// one being published, so a stalled client never costs the others frames
+#define FRAME_HUB_MAX_FRAMES (FRAME_HUB_MAX_SUBSCRIBERS + 2)
+
+typedef void (*frame_release_fn)(void *owner);
+typedef void *(*frame_alloc_fn)(size_t len);
+
+struct frame_hub;
+
+typedef struct
+{
+    const uint8_t *buf;
+    size_t len;
+    uint16_t width;
+    uint16_t height;
+    int64_t timestamp_us; // capture time
+    uint32_t seq;         // hub sequence number, starts at 1
+    void *owner;
+    frame_release_fn release;
+    int refs;
+    bool pinned; // still backed by the producer's owner rather than a copy
+    struct frame_hub *hub;
+} frame_ref_t;
+
+// Each subscriber has a mailbox of depth one: a newer frame replaces the one
+// still waiting there, so a slow client is never more than one frame behind.
+typedef struct
+{
+    bool in_use;
+    frame_ref_t *pending; // delivered but not yet taken
+    uint32_t last_seq;    // seq of the last frame taken
+    uint32_t taken;
+    uint32_t dropped; // replaced in the mailbox before being taken
+    uint32_t skipped; // sequence numbers never taken (drops plus hub overruns)
+} frame_sub_t;
+
+typedef struct
+{
+    uint32_t taken;
+    uint32_t dropped;
+    uint32_t skipped;
+} frame_sub_stats_t;
+
+typedef struct frame_hub
+{
+    std::mutex lock;
+    std::condition_variable cond;
+    frame_ref_t frames[FRAME_HUB_MAX_FRAMES];
+    frame_sub_t subs[FRAME_HUB_MAX_SUBSCRIBERS];
+    int sub_count;
+    uint32_t seq;
+    uint32_t published;
+    uint32_t overruns; // frames released at once because the pool was exhausted
+    uint32_t copies;   // frames copied out to keep within pin_limit
+    int pin_limit;     // 0: no limit
+    frame_alloc_fn copy_alloc;
+    frame_release_fn copy_release;
+} frame_hub_t;
+
+typedef struct
+{
+    uint32_t published;
+    uint32_t overruns;
+    uint32_t copies;
+    int pinned;
+} frame_hub_stats_t;
+
+void frame_hub_init(frame_hub_t *hub);
+// At most limit published frames keep their owner; further frames are copied
+// into alloc'd buffers (freed through release) while that many are in use.
+void frame_hub_limit_pins(frame_hub_t *hub, int limit, frame_alloc_fn alloc, frame_release_fn release);
+frame_hub_stats_t frame_hub_stats(frame_hub_t *hub);
+
+// Subscriber side
+frame_sub_t *frame_hub_subscribe(frame_hub_t *hub);
+void frame_hub_unsubscribe(frame_hub_t *hub, frame_sub_t *sub);
+// Blocks until a frame is delivered to sub, NULL on timeout. The caller owns
+// one reference and must drop it with frame_ref_release().
+frame_ref_t *frame_hub_take(frame_hub_t *hub, frame_sub_t *sub, uint32_t timeout_ms);
+void frame_ref_release(frame_ref_t *frame);
+frame_sub_stats_t frame_hub_sub_stats(frame_hub_t *hub, frame_sub_t *sub);
+
+// Producer side
+// Returns false if nobody subscribed within timeout_ms.
+bool frame_hub_wait_subscribers(frame_hub_t *hub, uint32_t timeout_ms);
+// Hands the frame to every subscriber, replacing any frame still queued there.
+// The owner is released immediately if there are no subscribers.
+uint32_t frame_hub_publish(frame_hub_t *hub, const uint8_t *buf, size_t len, uint16_t width, uint16_t height,
+                           int64_t timestamp_us, void *owner, frame_release_fn release);
+int frame_hub_subscriber_count(frame_hub_t *hub);
+
+#endif
@@ -0,0 +1,128 @@
+#include "mjpeg_avi.h"
+#include <string.h>
+
+#define AVIF_HASINDEX 0x10
+#define AVIIF_KEYFRAME 0x10
+
+static uint8_t *put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static uint8_t *put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = v >> 24;
+    return p + 4;
+}
+
+static uint8_t *put_fourcc(uint8_t *p, const char *cc)
+{
+    memcpy(p, cc, 4);
+    return p + 4;
+}
+
+// Size of the movi LIST payload, including its 'movi' fourcc
+static size_t movi_len(const mjpeg_avi_info_t *info)
+{
+    return 4 + (size_t)info->frames * MJPEG_AVI_CHUNK_LEN + info->frame_bytes;
+}
+
+size_t mjpeg_avi_padded(size_t len)
+{
+    return (len + 1) & ~(size_t)1;
+}
+
+size_t mjpeg_avi_file_len(const mjpeg_avi_info_t *info)
+{
+    return MJPEG_AVI_HEADER_LEN - 4 + movi_len(info) + MJPEG_AVI_CHUNK_LEN +
+           (size_t)info->frames * MJPEG_AVI_INDEX_ENTRY_LEN;
+}
+
+void mjpeg_avi_header(uint8_t out[MJPEG_AVI_HEADER_LEN], const mjpeg_avi_info_t *info)
+{
+    uint32_t fps = info->us_per_frame ? (1000000 + info->us_per_frame / 2) / info->us_per_frame : 1;
+    uint8_t *p = out;
+    p = put_fourcc(p, "RIFF");
+    p = put_le32(p, mjpeg_avi_file_len(info) - 8);
+    p = put_fourcc(p, "AVI ");
+
+    p = put_fourcc(p, "LIST");
+    p = put_le32(p, 192);
+    p = put_fourcc(p, "hdrl");
+    p = put_fourcc(p, "avih");
+    p = put_le32(p, 56);
+    p = put_le32(p, info->us_per_frame);
+    p = put_le32(p, info->max_frame_len * fps); // max bytes per second
+    p = put_le32(p, 0);                          // padding granularity
+    p = put_le32(p, AVIF_HASINDEX);
+    p = put_le32(p, info->frames);
+    p = put_le32(p, 0); // initial frames
+    p = put_le32(p, 1); // streams
+    p = put_le32(p, info->max_frame_len);
+    p = put_le32(p, info->width);
+    p = put_le32(p, info->height);
+    memset(p, 0, 16);
+    p += 16;
+
+    p = put_fourcc(p, "LIST");
+    p = put_le32(p, 116);
+    p = put_fourcc(p, "strl");
+    p = put_fourcc(p, "strh");
+    p = put_le32(p, 56);
+    p = put_fourcc(p, "vids");
+    p = put_fourcc(p, "MJPG");
+    p = put_le32(p, 0); // flags
+    p = put_le32(p, 0); // priority, language
+    p = put_le32(p, 0); // initial frames
+    p = put_le32(p, info->us_per_frame); // scale / rate = seconds per frame
+    p = put_le32(p, 1000000);
+    p = put_le32(p, 0); // start
+    p = put_le32(p, info->frames);
+    p = put_le32(p, info->max_frame_len);
+    p = put_le32(p, 0xFFFFFFFF); // quality: default
+    p = put_le32(p, 0);          // sample size: varies
+    p = put_le16(p, 0);
+    p = put_le16(p, 0);
+    p = put_le16(p, info->width);
+    p = put_le16(p, info->height);
+
+    p = put_fourcc(p, "strf");
+    p = put_le32(p, 40);
+    p = put_le32(p, 40); // BITMAPINFOHEADER
+    p = put_le32(p, info->width);
+    p = put_le32(p, info->height);
+    p = put_le16(p, 1);  // planes
+    p = put_le16(p, 24); // bit count
+    p = put_fourcc(p, "MJPG");
+    p = put_le32(p, (uint32_t)info->width * info->height * 3);
+    memset(p, 0, 16);
+    p += 16;
+
+    p = put_fourcc(p, "LIST");
+    p = put_le32(p, movi_len(info));
+    put_fourcc(p, "movi");
+}
+
+void mjpeg_avi_chunk(uint8_t out[MJPEG_AVI_CHUNK_LEN], size_t len)
+{
+    put_le32(put_fourcc(out, "00dc"), len);
+}
+
+void mjpeg_avi_index(uint8_t out[MJPEG_AVI_CHUNK_LEN], uint32_t frames)
+{
+    put_le32(put_fourcc(out, "idx1"), frames * MJPEG_AVI_INDEX_ENTRY_LEN);
+}
+
+uint32_t mjpeg_avi_index_entry(uint8_t out[MJPEG_AVI_INDEX_ENTRY_LEN], uint32_t offset, size_t len)
+{
+    uint8_t *p = put_fourcc(out, "00dc");
+    p = put_le32(p, AVIIF_KEYFRAME);
+    p = put_le32(p, offset);
+    put_le32(p, len);
+    return offset + MJPEG_AVI_CHUNK_LEN + mjpeg_avi_padded(len);
+}
@@ -0,0 +1,43 @@
+/*
+ * Minimal AVI (RIFF) container for a single MJPEG video stream, written
+ * front to back: the caller knows every frame size before it starts, so the
+ * header is final and no seek back is needed.
+ *
+ *   header   mjpeg_avi_header()                RIFF, hdrl, LIST movi
+ *   frames   mjpeg_avi_chunk() + JPEG + pad    one '00dc' chunk each
+ *   index    mjpeg_avi_index() + entries       idx1, offsets relative to movi
+ */
+
+#ifndef _MJPEG_AVI_H
+#define _MJPEG_AVI_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MJPEG_AVI_HEADER_LEN 224
+#define MJPEG_AVI_CHUNK_LEN 8
+#define MJPEG_AVI_INDEX_ENTRY_LEN 16
+
+typedef struct
+{
+    uint32_t frames;
+    uint16_t width;
+    uint16_t height;
+    uint32_t us_per_frame;
+    uint32_t max_frame_len;
+    size_t frame_bytes; // sum of mjpeg_avi_padded() over all frames
+} mjpeg_avi_info_t;
+
+// JPEG bytes are padded to an even length inside the file.
+size_t mjpeg_avi_padded(size_t len);
+// Total file size for info, for Content-Length.
+size_t mjpeg_avi_file_len(const mjpeg_avi_info_t *info);
+void mjpeg_avi_header(uint8_t out[MJPEG_AVI_HEADER_LEN], const mjpeg_avi_info_t *info);
+void mjpeg_avi_chunk(uint8_t out[MJPEG_AVI_CHUNK_LEN], size_t len);
+// Writes the idx1 chunk header, followed by one entry per frame.
+void mjpeg_avi_index(uint8_t out[MJPEG_AVI_CHUNK_LEN], uint32_t frames);
+// Writes the entry for a frame at the movi-relative offset (4 for the first frame)
+// and returns the offset of the next one.
+uint32_t mjpeg_avi_index_entry(uint8_t out[MJPEG_AVI_INDEX_ENTRY_LEN], uint32_t offset, size_t len);
+
+#endif
@@ -0,0 +1,70 @@
+#include "path_coalesce.h"
+
+static bool is_noop(const car_cmd_t *cmd)
+{
+    return (cmd->n == CAR_CMD_MOVE && cmd->arg[1] == 0) || (cmd->n == CAR_CMD_TURN && cmd->arg[0] == 0);
+}
+
+// Folds cmd into last if the pair is one motion; false leaves last alone.
+static bool merge(car_cmd_t *last, const car_cmd_t *cmd)
+{
+    if (last->n != cmd->n)
+    {
+        return false;
+    }
+    if (cmd->n == CAR_CMD_MOVE && last->arg[0] == cmd->arg[0])
+    {
+        int64_t cm = (int64_t)last->arg[1] + cmd->arg[1];
+        if (cm > PATH_COALESCE_MAX_CM)
+        {
+            return false;
+        }
+        last->arg[1] = (int32_t)cm;
+        return true;
+    }
+    if (cmd->n == CAR_CMD_TURN)
+    {
+        int64_t deg = (int64_t)last->arg[0] + cmd->arg[0];
+        if (deg > PATH_COALESCE_MAX_DEG || deg < -PATH_COALESCE_MAX_DEG)
+        {
+            return false;
+        }
+        last->arg[0] = (int32_t)deg;
+        return true;
+    }
+    return false;
+}
+
+size_t path_coalesce(const car_cmd_t *in, size_t count, car_cmd_t *out, int *origin)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (is_noop(&in[i]))
+        {
+            origin[i] = PATH_COALESCE_NOOP;
+            continue;
+        }
+        if (n && merge(&out[n - 1], &in[i]))
+        {
+            origin[i] = (int)(n - 1);
+            if (!is_noop(&out[n - 1]))
+            {
+                continue;
+            }
+            // the run cancelled out; the command before it may now take what follows
+            n--;
+            for (size_t j = 0; j <= i; j++)
+            {
+                if (origin[j] == (int)n)
+                {
+                    origin[j] = PATH_COALESCE_NOOP;
+                }
+            }
+            continue;
+        }
+        out[n] = in[i];
+        origin[i] = (int)n++;
+    }
+    return n;
+}
@@ -0,0 +1,30 @@
+/*
+ * Coalescing pass for /api/path batches, run before anything goes to the car.
+ *
+ * Planner output tends to contain runs of moves in the same direction, moves
+ * of zero length and turns that cancel each other. The pass merges the runs
+ * (move 30 + move 20 -> move 50, turn 90 + turn -30 -> turn 60), drops the
+ * zero-length actions and removes turn runs that add up to nothing, which
+ * may in turn join the moves around them.
+ *
+ * Every input action keeps an answer: origin[i] names the output command it
+ * was folded into, whose ack then stands for it, or PATH_COALESCE_NOOP if it
+ * needs no command at all. Commands other than moves and turns are barriers
+ * and go out unchanged.
+ */
+
+#ifndef _PATH_COALESCE_H
+#define _PATH_COALESCE_H
+
+#include <stddef.h>
+#include "car_link.h"
+
+#define PATH_COALESCE_NOOP -1
+#define PATH_COALESCE_MAX_CM 0xFFFF   // a merged move still fits the binary frame
+#define PATH_COALESCE_MAX_DEG 0x7FFF
+
+// out must hold count commands; an output command carries the id of the first
+// action folded into it. Returns the number of output commands.
+size_t path_coalesce(const car_cmd_t *in, size_t count, car_cmd_t *out, int *origin);
+
+#endif
@@ -0,0 +1,119 @@
+#include "pose_cache.h"
+#include <string.h>
+#include <atomic>
+#include <mutex>
+
+#define POSE_READ_TRIES 8
+
+static std::mutex pose_write_lock;
+static std::atomic<uint32_t> pose_version(0); // odd while a writer updates the pose
+static char pose_text[POSE_CACHE_TEXT_LEN];
+static size_t pose_len = 0;
+static int64_t pose_stamp_us = 0;
+
+bool pose_cache_store_reply(const char *reply, size_t len, int64_t now_us)
+{
+    static const char key[] = "\"pose\":";
+    const char *end = reply + len;
+    const char *p = reply;
+    // find the key, then the matching brace of the object behind it
+    while (p + sizeof(key) - 1 <= end && memcmp(p, key, sizeof(key) - 1))
+    {
+        p++;
+    }
+    if (p + sizeof(key) - 1 > end)
+    {
+        return false;
+    }
+    p += sizeof(key) - 1;
+    while (p < end && *p == ' ')
+    {
+        p++;
+    }
+    if (p >= end || *p != '{')
+    {
+        return false;
+    }
+    const char *start = p;
+    int depth = 0;
+    for (; p < end; p++)
+    {
+        if (*p == '{')
+        {
+            depth++;
+        }
+        else if (*p == '}' && --depth == 0)
+        {
+            break;
+        }
+    }
+    if (p >= end || (size_t)(p + 1 - start) >= POSE_CACHE_TEXT_LEN)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(pose_write_lock);
+    pose_version.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    pose_len = p + 1 - start;
+    memcpy(pose_text, start, pose_len);
+    pose_text[pose_len] = 0;
+    pose_stamp_us = now_us;
+    std::atomic_thread_fence(std::memory_order_release);
+    pose_version.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// Copies the pose as of one consistent version; the length is clamped so a
+// torn read stays inside the buffers and gets thrown away.
+static bool snapshot(char *text, size_t *len, int64_t *stamp_us)
+{
+    for (int tries = 0; tries < POSE_READ_TRIES; tries++)
+    {
+        uint32_t v = pose_version.load(std::memory_order_acquire);
+        if (v & 1)
+        {
+            continue;
+        }
+        *len = pose_len < POSE_CACHE_TEXT_LEN ? pose_len : POSE_CACHE_TEXT_LEN - 1;
+        memcpy(text, pose_text, *len);
+        text[*len] = 0;
+        *stamp_us = pose_stamp_us;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (pose_version.load(std::memory_order_relaxed) == v)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void read_pose(char *text, size_t *len, int64_t *stamp_us)
+{
+    if (!snapshot(text, len, stamp_us))
+    {
+        // a writer kept getting in the way (e.g. it was preempted mid-update); wait it out
+        std::lock_guard<std::mutex> guard(pose_write_lock);
+        *len = pose_len;
+        memcpy(text, pose_text, pose_len + 1);
+        *stamp_us = pose_stamp_us;
+    }
+}
+
+int pose_cache_read(char *out, size_t out_len, int64_t *stamp_us)
+{
+    char text[POSE_CACHE_TEXT_LEN];
+    size_t len;
+    int64_t stamp;
+    read_pose(text, &len, &stamp);
+    if (!len || len + 1 > out_len)
+    {
+        return -1;
+    }
+    memcpy(out, text, len + 1);
+    if (stamp_us)
+    {
+        *stamp_us = stamp;
+    }
+    return (int)len;
+}
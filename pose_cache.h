@@ -0,0 +1,26 @@
+/*
+ * Last robot pose reported by the car, kept as the JSON object text it was sent
+ * in (e.g. {"x":0.12,"y":0.00,"th":90,"v":0}) together with the time it was
+ * received. Readers copy it into their own buffer, nothing is allocated.
+ *
+ * The pose is streamed at several Hz and read by every HTTP request and stream
+ * part, so it sits behind a sequence lock: writers take turns on a mutex,
+ * readers retry instead of blocking.
+ */
+
+#ifndef _POSE_CACHE_H
+#define _POSE_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define POSE_CACHE_TEXT_LEN 128
+
+// Stores the "pose" object found in a car reply like {"H":"p1234","pose":{...}}.
+// Returns false if the reply has no pose object.
+bool pose_cache_store_reply(const char *reply, size_t len, int64_t now_us);
+// Copies the cached pose text (NUL terminated) into out. Returns its length, or
+// -1 if no pose was received yet or out is too small.
+int pose_cache_read(char *out, size_t out_len, int64_t *stamp_us);
+
+#endif
@@ -0,0 +1,86 @@
+#include "quality_ctl.h"
+
+void quality_ctl_init(quality_ctl_t *ctl, const quality_step_t *ladder, int steps, float target_fps, int start_step)
+{
+    ctl->ladder = ladder;
+    ctl->steps = steps;
+    ctl->step = start_step < 0 ? 0 : (start_step >= steps ? steps - 1 : start_step);
+    ctl->target_fps = target_fps;
+    ctl->below = 0;
+    ctl->above = 0;
+    ctl->upgrade_samples = QUALITY_CTL_UPGRADE_SAMPLES;
+    ctl->last_upgrade_ms = 0;
+    ctl->upgraded = false;
+    ctl->changes = 0;
+}
+
+const quality_step_t *quality_ctl_current(const quality_ctl_t *ctl)
+{
+    return &ctl->ladder[ctl->step];
+}
+
+bool quality_ctl_update(quality_ctl_t *ctl, const quality_sample_t *sample)
+{
+    if (sample->fps <= 0.0f || ctl->target_fps <= 0.0f)
+    {
+        return false;
+    }
+
+    // Link capacity as seen by the sender vs what the target rate needs at this rung
+    float capacity = sample->send_us ? (float)sample->frame_bytes * 1000000.0f / sample->send_us : 0.0f;
+    float needed = (float)sample->frame_bytes * ctl->target_fps;
+
+    bool too_slow = sample->fps < ctl->target_fps * QUALITY_CTL_DEGRADE_RATIO ||
+                    (capacity > 0.0f && capacity < needed);
+    if (too_slow)
+    {
+        ctl->above = 0;
+        if (++ctl->below < QUALITY_CTL_DEGRADE_SAMPLES || ctl->step >= ctl->steps - 1)
+        {
+            return false;
+        }
+        if (ctl->upgraded && sample->now_ms - ctl->last_upgrade_ms < QUALITY_CTL_REVERT_WINDOW_MS)
+        {
+            // the last upgrade did not hold, be more careful next time
+            ctl->upgrade_samples *= 2;
+            if (ctl->upgrade_samples > QUALITY_CTL_UPGRADE_SAMPLES_MAX)
+            {
+                ctl->upgrade_samples = QUALITY_CTL_UPGRADE_SAMPLES_MAX;
+            }
+        }
+        ctl->upgraded = false;
+        ctl->below = 0;
+        ctl->step++;
+        ctl->changes++;
+        return true;
+    }
+    ctl->below = 0;
+
+    if (ctl->step == 0 || sample->fps < ctl->target_fps * QUALITY_CTL_UPGRADE_RATIO)
+    {
+        ctl->above = 0;
+        return false;
+    }
+    float ratio = (float)ctl->ladder[ctl->step - 1].rel_size / ctl->ladder[ctl->step].rel_size;
+    if (capacity > 0.0f && capacity < needed * ratio * QUALITY_CTL_UPGRADE_HEADROOM)
+    {
+        ctl->above = 0;
+        return false;
+    }
+    if (++ctl->above < ctl->upgrade_samples)
+    {
+        return false;
+    }
+    if (ctl->upgraded && sample->now_ms - ctl->last_upgrade_ms >= QUALITY_CTL_REVERT_WINDOW_MS &&
+        ctl->upgrade_samples > QUALITY_CTL_UPGRADE_SAMPLES)
+    {
+        // previous upgrade held, relax again
+        ctl->upgrade_samples /= 2;
+    }
+    ctl->above = 0;
+    ctl->step--;
+    ctl->upgraded = true;
+    ctl->last_upgrade_ms = sample->now_ms;
+    ctl->changes++;
+    return true;
+}
@@ -0,0 +1,61 @@
+/*
+ * Closed-loop JPEG quality / framesize controller.
+ *
+ * Walks a ladder of (framesize, quality) rungs ordered from best to cheapest.
+ * Fed periodically with what the slowest stream actually achieved, it steps
+ * down quickly when the link can't keep the target fps and steps back up only
+ * after a sustained margin. An upgrade that has to be undone soon after makes
+ * the next upgrade wait longer, so a marginal link doesn't oscillate.
+ *
+ * Pure logic without camera or timer dependencies, so it can be driven on a
+ * host from a recorded or simulated bandwidth trace.
+ */
+
+#ifndef _QUALITY_CTL_H
+#define _QUALITY_CTL_H
+
+#include <stdint.h>
+
+#define QUALITY_CTL_DEGRADE_RATIO 0.80f  // fps below target * ratio counts against the rung
+#define QUALITY_CTL_UPGRADE_RATIO 0.95f  // fps needed before trying a better rung
+#define QUALITY_CTL_UPGRADE_HEADROOM 1.3f // spare link capacity required for the next rung
+#define QUALITY_CTL_DEGRADE_SAMPLES 3
+#define QUALITY_CTL_UPGRADE_SAMPLES 6
+#define QUALITY_CTL_UPGRADE_SAMPLES_MAX 48
+#define QUALITY_CTL_REVERT_WINDOW_MS 10000
+
+typedef struct
+{
+    uint8_t framesize; // framesize_t
+    uint8_t quality;   // jpeg quality, lower is better
+    uint16_t rel_size; // expected JPEG size relative to the other rungs
+} quality_step_t;
+
+typedef struct
+{
+    uint32_t now_ms;
+    float fps;            // achieved by the slowest stream
+    uint32_t frame_bytes; // average JPEG size
+    uint32_t send_us;     // average time to push one frame into the socket
+} quality_sample_t;
+
+typedef struct
+{
+    const quality_step_t *ladder;
+    int steps;
+    int step;
+    float target_fps;
+    int below;
+    int above;
+    int upgrade_samples; // grows when upgrades get reverted
+    uint32_t last_upgrade_ms;
+    bool upgraded;
+    uint32_t changes;
+} quality_ctl_t;
+
+void quality_ctl_init(quality_ctl_t *ctl, const quality_step_t *ladder, int steps, float target_fps, int start_step);
+// Returns true when ctl->step changed and the new rung should be applied.
+bool quality_ctl_update(quality_ctl_t *ctl, const quality_sample_t *sample);
+const quality_step_t *quality_ctl_current(const quality_ctl_t *ctl);
+
+#endif
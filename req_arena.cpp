@@ -0,0 +1,50 @@
+#include "req_arena.h"
+#include <string.h>
+
+void req_arena_init(req_arena_t *arena, void *mem, size_t size)
+{
+    // the block itself may start anywhere
+    uintptr_t start = ((uintptr_t)mem + REQ_ARENA_ALIGN - 1) & ~(uintptr_t)(REQ_ARENA_ALIGN - 1);
+    size_t skip = start - (uintptr_t)mem;
+    arena->base = (uint8_t *)start;
+    arena->size = size > skip ? size - skip : 0;
+    arena->used = 0;
+    arena->peak = 0;
+    arena->exhausted = 0;
+}
+
+void *req_arena_alloc(req_arena_t *arena, size_t size)
+{
+    size_t need = (size + REQ_ARENA_ALIGN - 1) & ~(size_t)(REQ_ARENA_ALIGN - 1);
+    if (need > arena->size - arena->used)
+    {
+        arena->exhausted++;
+        return NULL;
+    }
+    void *p = arena->base + arena->used;
+    arena->used += need;
+    if (arena->used > arena->peak)
+    {
+        arena->peak = arena->used;
+    }
+    return p;
+}
+
+char *req_arena_strdup(req_arena_t *arena, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *copy = (char *)req_arena_alloc(arena, len);
+    if (copy)
+    {
+        memcpy(copy, s, len);
+    }
+    return copy;
+}
+
+void req_arena_release(req_arena_t *arena, size_t mark)
+{
+    if (mark < arena->used)
+    {
+        arena->used = mark;
+    }
+}
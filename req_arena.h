@@ -0,0 +1,59 @@
+/*
+ * Per-request bump arena for the HTTP control handlers.
+ *
+ * A handler takes everything it needs while parsing and answering (request
+ * body, query string, JSON documents, response text) from one fixed block by
+ * bumping an offset, and the whole lot is handed back at once when it returns.
+ * Requests then never touch the general heap, so days of polling and path
+ * uploads leave no fragmentation behind.
+ *
+ * An arena is not locked: it belongs to one task, e.g. the single task of an
+ * esp_http_server instance. Anything that outlives the request must be copied
+ * out before the handler returns.
+ */
+
+#ifndef _REQ_ARENA_H
+#define _REQ_ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define REQ_ARENA_ALIGN 8
+
+typedef struct
+{
+    uint8_t *base;
+    size_t size;
+    size_t used;
+    size_t peak;        // high-water mark, to size the block
+    uint32_t exhausted; // allocations refused for lack of room
+} req_arena_t;
+
+void req_arena_init(req_arena_t *arena, void *mem, size_t size);
+// NULL when the arena is full; never falls back to malloc
+void *req_arena_alloc(req_arena_t *arena, size_t size);
+char *req_arena_strdup(req_arena_t *arena, const char *s);
+// Everything allocated after mark is released
+void req_arena_release(req_arena_t *arena, size_t mark);
+
+// Releases what the enclosing scope allocated, at handler exit
+struct req_arena_scope
+{
+    req_arena_t *arena;
+    size_t mark;
+
+    explicit req_arena_scope(req_arena_t *a) : arena(a), mark(a->used) {}
+    ~req_arena_scope() { req_arena_release(arena, mark); }
+};
+
+// Allocator for ArduinoJson's BasicJsonDocument; the pool goes back with the arena
+struct req_arena_allocator
+{
+    req_arena_t *arena;
+
+    req_arena_allocator(req_arena_t *a = NULL) : arena(a) {}
+    void *allocate(size_t n) { return arena ? req_arena_alloc(arena, n) : NULL; }
+    void deallocate(void *) {}
+};
+
+#endif
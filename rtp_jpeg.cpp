@@ -0,0 +1,219 @@
+#include "rtp_jpeg.h"
+#include <string.h>
+
+static void put_be16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = (v >> 16) & 0xFF;
+    p[2] = (v >> 8) & 0xFF;
+    p[3] = v & 0xFF;
+}
+
+bool rtp_jpeg_parse(const uint8_t *jpg, size_t len, rtp_jpeg_info_t *info)
+{
+    const uint8_t *tables[4] = {NULL, NULL, NULL, NULL};
+    uint8_t comp_table[3] = {0, 0, 0};
+    bool have_sof = false;
+
+    memset(info, 0, sizeof(*info));
+    if (len < 4 || jpg[0] != 0xFF || jpg[1] != 0xD8)
+    {
+        return false;
+    }
+    size_t pos = 2;
+    while (pos + 4 <= len)
+    {
+        if (jpg[pos] != 0xFF)
+        {
+            return false;
+        }
+        uint8_t marker = jpg[pos + 1];
+        if (marker == 0xFF)
+        {
+            pos++; // fill byte
+            continue;
+        }
+        size_t seglen = (jpg[pos + 2] << 8) | jpg[pos + 3];
+        if (seglen < 2 || pos + 2 + seglen > len)
+        {
+            return false;
+        }
+        const uint8_t *seg = jpg + pos + 4;
+        size_t body = seglen - 2;
+
+        switch (marker)
+        {
+        case 0xDB: // DQT
+            for (size_t p = 0; p + 65 <= body; p += 65)
+            {
+                if (seg[p] >> 4)
+                {
+                    return false; // 16 bit tables are not in RFC 2435's Q=255 format
+                }
+                tables[seg[p] & 3] = seg + p + 1;
+            }
+            break;
+        case 0xC0: // SOF0, baseline
+        {
+            if (body < 15 || seg[5] != 3)
+            {
+                return false;
+            }
+            info->height = (seg[1] << 8) | seg[2];
+            info->width = (seg[3] << 8) | seg[4];
+            uint8_t luma = seg[7];
+            if (luma == 0x21)
+            {
+                info->type = 0;
+            }
+            else if (luma == 0x22)
+            {
+                info->type = 1;
+            }
+            else
+            {
+                return false;
+            }
+            if (seg[10] != 0x11 || seg[13] != 0x11)
+            {
+                return false;
+            }
+            comp_table[0] = seg[8] & 3;
+            comp_table[1] = seg[11] & 3;
+            comp_table[2] = seg[14] & 3;
+            have_sof = true;
+            break;
+        }
+        case 0xC1:
+        case 0xC2:
+        case 0xC3:
+        case 0xC5:
+        case 0xC6:
+        case 0xC7:
+        case 0xC9:
+        case 0xCA:
+        case 0xCB:
+        case 0xCD:
+        case 0xCE:
+        case 0xCF:
+            return false; // not baseline
+        case 0xDD: // DRI
+            if (body >= 2)
+            {
+                info->restart_interval = (seg[0] << 8) | seg[1];
+            }
+            break;
+        case 0xDA: // SOS, entropy-coded data follows the header
+        {
+            if (!have_sof)
+            {
+                return false;
+            }
+            size_t start = pos + 2 + seglen;
+            size_t end = len;
+            // the scan can't contain FF D9 (byte stuffing), so the last one is EOI
+            while (end >= start + 2 && !(jpg[end - 2] == 0xFF && jpg[end - 1] == 0xD9))
+            {
+                end--;
+            }
+            if (end < start + 2)
+            {
+                return false;
+            }
+            info->scan = jpg + start;
+            info->scan_len = end - 2 - start;
+            info->qtables[0] = tables[comp_table[0]];
+            info->qtables[1] = tables[comp_table[1]];
+            if (!info->qtables[0] || !info->qtables[1])
+            {
+                return false;
+            }
+            info->qtable_count = 2;
+            if (info->restart_interval)
+            {
+                info->type += 64;
+            }
+            return info->width && info->height && info->width <= 2040 && info->height <= 2040;
+        }
+        default:
+            break;
+        }
+        pos += 2 + seglen;
+    }
+    return false;
+}
+
+void rtp_jpeg_session_init(rtp_jpeg_session_t *session, uint32_t ssrc, uint16_t first_seq)
+{
+    session->ssrc = ssrc;
+    session->seq = first_seq;
+    session->packets = 0;
+    session->frames = 0;
+}
+
+bool rtp_jpeg_send_frame(rtp_jpeg_session_t *session, const rtp_jpeg_info_t *info, uint32_t timestamp,
+                         rtp_jpeg_packet_cb cb, void *arg)
+{
+    uint8_t hdr[RTP_JPEG_MAX_HEADER];
+    size_t offset = 0;
+    while (offset < info->scan_len)
+    {
+        size_t h = RTP_HEADER_LEN;
+        // JPEG header: type-specific, fragment offset, type, Q, width/8, height/8
+        hdr[h] = 0;
+        hdr[h + 1] = (offset >> 16) & 0xFF;
+        hdr[h + 2] = (offset >> 8) & 0xFF;
+        hdr[h + 3] = offset & 0xFF;
+        hdr[h + 4] = info->type;
+        hdr[h + 5] = 255; // tables in-band
+        hdr[h + 6] = (info->width + 7) / 8;
+        hdr[h + 7] = (info->height + 7) / 8;
+        h += 8;
+        if (info->type >= 64)
+        {
+            // fragments are not aligned to restart intervals: F = L = 1, count = 0x3FFF
+            put_be16(hdr + h, info->restart_interval);
+            put_be16(hdr + h + 2, 0xFFFF);
+            h += 4;
+        }
+        if (offset == 0)
+        {
+            hdr[h] = 0;     // MBZ
+            hdr[h + 1] = 0; // 8 bit precision for both tables
+            put_be16(hdr + h + 2, 128);
+            memcpy(hdr + h + 4, info->qtables[0], 64);
+            memcpy(hdr + h + 4 + 64, info->qtables[1], 64);
+            h += 4 + 128;
+        }
+
+        size_t chunk = RTP_JPEG_MAX_PACKET - h;
+        if (chunk > info->scan_len - offset)
+        {
+            chunk = info->scan_len - offset;
+        }
+        bool last = offset + chunk == info->scan_len;
+
+        hdr[0] = 0x80; // version 2
+        hdr[1] = RTP_JPEG_PAYLOAD_TYPE | (last ? 0x80 : 0);
+        put_be16(hdr + 2, session->seq);
+        put_be32(hdr + 4, timestamp);
+        put_be32(hdr + 8, session->ssrc);
+
+        // a packet the sender failed to emit still uses its number, so receivers count it as lost
+        session->seq++;
+        if (!cb(arg, hdr, h, info->scan + offset, chunk))
+        {
+            return false;
+        }
+        session->packets++;
+        offset += chunk;
+    }
+    session->frames++;
+    return true;
+}
@@ -0,0 +1,57 @@
+/*
+ * RTP payload format for JPEG (RFC 2435).
+ *
+ * Splits a baseline JPEG from the sensor into RTP packets: the entropy-coded
+ * scan is carried in fragments, the quantization tables travel in-band with
+ * the first fragment (Q = 255), and the Huffman tables are the standard ones
+ * the receiver already knows. A lost packet costs the frame it belongs to and
+ * nothing else.
+ *
+ * No platform dependencies; packets are handed out as header + payload slice
+ * so the sender can emit them without copying the JPEG.
+ */
+
+#ifndef _RTP_JPEG_H
+#define _RTP_JPEG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RTP_JPEG_PAYLOAD_TYPE 26
+#define RTP_JPEG_CLOCK_HZ 90000
+#define RTP_JPEG_MAX_PACKET 1400 // RTP header included, fits a WiFi MTU with UDP/IP
+#define RTP_HEADER_LEN 12
+// RTP + JPEG + restart marker + quantization header with two tables
+#define RTP_JPEG_MAX_HEADER (RTP_HEADER_LEN + 8 + 4 + 4 + 128)
+
+typedef struct
+{
+    uint16_t width;
+    uint16_t height;
+    uint8_t type;   // 0 = 4:2:2, 1 = 4:2:0, +64 when restart markers are used
+    uint16_t restart_interval;
+    const uint8_t *qtables[2]; // luma, chroma; 64 bytes each
+    uint8_t qtable_count;
+    const uint8_t *scan;       // entropy-coded data, EOI stripped
+    size_t scan_len;
+} rtp_jpeg_info_t;
+
+typedef struct
+{
+    uint32_t ssrc;
+    uint16_t seq;
+    uint32_t packets;
+    uint32_t frames;
+} rtp_jpeg_session_t;
+
+// Called once per packet; header and payload are sent back to back as one datagram.
+typedef bool (*rtp_jpeg_packet_cb)(void *arg, const uint8_t *header, size_t header_len, const uint8_t *payload, size_t payload_len);
+
+// Returns false for JPEGs RFC 2435 can't carry (progressive, odd sampling, > 2040 px).
+bool rtp_jpeg_parse(const uint8_t *jpg, size_t len, rtp_jpeg_info_t *info);
+void rtp_jpeg_session_init(rtp_jpeg_session_t *session, uint32_t ssrc, uint16_t first_seq);
+// Packetizes one frame; timestamp is in RTP_JPEG_CLOCK_HZ units. Stops at the first failing callback.
+bool rtp_jpeg_send_frame(rtp_jpeg_session_t *session, const rtp_jpeg_info_t *info, uint32_t timestamp,
+                         rtp_jpeg_packet_cb cb, void *arg);
+
+#endif
@@ -0,0 +1,494 @@
+/*
+ * Serial link benchmark: runs the firmware's car command path against the
+ * simulated car (car_sim) on a pty.
+ *
+ *   g++ -std=gnu++11 -O2 -pthread -I.. car_bench.cpp ../car_proto.cpp ../car_link.cpp ../car_baud.cpp -o car_bench
+ *   ./car_bench [--sim ./car_sim] [--tty PATH] [--count N] [--window N] [--bauds 9600,115200] [--framings text,binary]
+ *               [--tests move,turn,pose,path,stop,queued,idle] [-- car_sim options...]
+ *
+ * For every framing and baud rate it starts a fresh car_sim, negotiates like
+ * car_serial_begin() does (capped at the rate under test) and runs
+ *
+ *   move   N blocking moves, as sendMoveMeters()
+ *   turn   N blocking turns, as sendTurnDegrees()
+ *   pose   N pose queries, as pose_get_handler() without a streamed pose
+ *   path   N moves and turns through car_link_pipeline(), as path_post_handler()
+ *   stop   N times: a full window of moves in flight, then car_link_preempt()
+ *          with a stop as /api/stop does; checks that nothing timed out and
+ *          that the car no longer moves
+ *   queued N times: a path's epoch is read as when path_post_handler() queues
+ *          it, a stop is preempted, then car_link_pipeline_at() runs it with
+ *          that epoch; checks that every command is cancelled and no byte
+ *          of a move or turn is written
+ *   idle   nothing sent for longer than CAR_BAUD_SILENCE_MS, then N moves and
+ *          pose queries; fails if the rates drifted apart meanwhile
+ *
+ * Throughout, car_baud_check() runs every 500 ms as car_baud_task() does.
+ *
+ * printing p50/p99 round trip (for stop: call until the car acked the stop,
+ * for queued: until car_link_pipeline_at() returned),
+ * commands per second and bytes on the wire per command in each direction.
+ * Exits non-zero if any test had failures.
+ * Options after -- go to car_sim, e.g.
+ * "-- --latency 5 --jitter 3 --drop 0.01".
+ */
+
+#include "car_baud.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BENCH_TIMEOUT_MS 3000
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static speed_t speed_of(uint32_t baud)
+{
+    static const struct
+    {
+        uint32_t rate;
+        speed_t speed;
+    } speeds[] = {{19200, B19200}, {38400, B38400}, {57600, B57600}, {115200, B115200}, {230400, B230400}, {460800, B460800}};
+    for (size_t i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+    {
+        if (speeds[i].rate == baud)
+        {
+            return speeds[i].speed;
+        }
+    }
+    return B9600;
+}
+
+// car_transport_t over a tty. A pty drains instantly, so flush waits out the
+// wire time itself like HardwareSerial::flush() would.
+static uint32_t tty_baud = 9600;
+static int64_t tty_idle_us = 0;
+
+static int tty_read(void *ctx, uint8_t *buf, size_t len, uint32_t timeout_ms)
+{
+    struct pollfd pfd = {*(int *)ctx, POLLIN, 0};
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+    {
+        return 0;
+    }
+    return (int)read(*(int *)ctx, buf, len);
+}
+
+static bool tty_write(void *ctx, const uint8_t *buf, size_t len)
+{
+    int64_t now = now_us();
+    tty_idle_us = (tty_idle_us > now ? tty_idle_us : now) + len * 10000000LL / tty_baud;
+    return write(*(int *)ctx, buf, len) == (ssize_t)len;
+}
+
+static void tty_set_baud(void *ctx, uint32_t baud)
+{
+    struct termios tio;
+    tcgetattr(*(int *)ctx, &tio);
+    cfsetspeed(&tio, speed_of(baud));
+    tcsetattr(*(int *)ctx, TCSANOW, &tio);
+    tty_baud = baud;
+}
+
+static void tty_flush(void *ctx)
+{
+    tcdrain(*(int *)ctx);
+    int64_t left = tty_idle_us - now_us();
+    if (left > 0)
+    {
+        usleep(left);
+    }
+}
+
+typedef struct
+{
+    const char *name;
+    std::vector<int64_t> rtt_us;
+    int64_t elapsed_us;
+    size_t failed;
+    car_link_stats_t before;
+    car_link_stats_t after;
+} bench_result_t;
+
+static car_link_t bench_link;
+static int tty_fd = -1;
+static volatile bool polling = false;
+
+static void poll_loop(void)
+{
+    while (polling)
+    {
+        car_link_poll(&bench_link, 20);
+    }
+}
+
+// As car_baud_task() in car_serial.cpp
+static void baud_check_loop(car_baud_t *baud)
+{
+    while (polling)
+    {
+        usleep(500000);
+        if (polling && car_baud_check(baud, now_us()))
+        {
+            printf("# car_baud_check(): down to %u baud\n", car_baud_rate(baud));
+        }
+    }
+}
+
+static car_cmd_t make_cmd(const char *test, size_t i)
+{
+    char id[8];
+    bool turn = !strcmp(test, "turn") || (!strcmp(test, "path") && (i & 1));
+    snprintf(id, sizeof(id), "%c%03lu", turn ? 't' : 'm', (unsigned long)(i % 1000));
+    if (!strcmp(test, "pose"))
+    {
+        id[0] = 'p';
+        return car_cmd_pose(id);
+    }
+    return turn ? car_cmd_turn(90, id) : car_cmd_move(1, 50, id);
+}
+
+// Pose text of the simulated car, to tell whether it still moves
+static std::string pose_now(void)
+{
+    car_cmd_t cmd = car_cmd_pose("p999");
+    car_result_t result;
+    return car_link_call(&bench_link, &cmd, BENCH_TIMEOUT_MS, &result) == CAR_OK ? std::string(result.reply) : "";
+}
+
+static void run_stop(size_t rounds, bench_result_t *r)
+{
+    std::vector<car_cmd_t> cmds(2 * CAR_LINK_MAX_PENDING);
+    std::vector<car_outcome_t> outcomes(cmds.size());
+    for (size_t round = 0; round < rounds; round++)
+    {
+        for (size_t i = 0; i < cmds.size(); i++)
+        {
+            cmds[i] = make_cmd("move", round * cmds.size() + i);
+        }
+        std::thread path([&]() {
+            car_link_pipeline(&bench_link, cmds.data(), cmds.size(), CAR_LINK_MAX_PENDING, BENCH_TIMEOUT_MS,
+                              outcomes.data());
+        });
+        usleep(1000 + lrand48() % 20000);
+        // acked stop: the round trip covers whatever was still queued ahead of it
+        car_cmd_t stop = car_cmd_stop();
+        snprintf(stop.id, sizeof(stop.id), "s%u", (unsigned)(round % 1000));
+        car_future_t future;
+        bool clean = car_link_preempt(&bench_link, &stop, BENCH_TIMEOUT_MS, &future) == CAR_OK &&
+                     car_link_wait(&future) == CAR_OK;
+        path.join();
+        if (clean)
+            r->rtt_us.push_back(future.result.rtt_us);
+
+        for (size_t i = 0; i < outcomes.size(); i++)
+        {
+            clean &= outcomes[i].status == CAR_OK || outcomes[i].status == CAR_CANCELLED;
+        }
+        std::string before = pose_now();
+        usleep(100000);
+        std::string after = pose_now();
+        size_t at = before.find("\"pose\"");
+        clean &= at != std::string::npos && after.size() > at && before.substr(at) == after.substr(at);
+        r->failed += !clean;
+    }
+}
+
+// A path job that a stop overtook between being queued and being started, as
+// path_job_task() runs it: not one of its commands may reach the car
+static void run_queued(size_t rounds, size_t window, bench_result_t *r)
+{
+    std::vector<car_cmd_t> cmds(2 * CAR_LINK_MAX_PENDING);
+    std::vector<car_outcome_t> outcomes(cmds.size());
+    for (size_t round = 0; round < rounds; round++)
+    {
+        for (size_t i = 0; i < cmds.size(); i++)
+        {
+            cmds[i] = make_cmd("path", round * cmds.size() + i);
+        }
+        uint32_t epoch = car_link_epoch(&bench_link); // queued
+        car_cmd_t stop = car_cmd_stop();
+        bool clean = car_link_preempt(&bench_link, &stop, 0, NULL) == CAR_OK;
+        car_link_stats_t before = car_link_stats(&bench_link);
+        int64_t start = now_us();
+        size_t ok = car_link_pipeline_at(&bench_link, cmds.data(), cmds.size(), window, BENCH_TIMEOUT_MS,
+                                         outcomes.data(), epoch);
+        r->rtt_us.push_back(now_us() - start);
+        car_link_stats_t after = car_link_stats(&bench_link);
+        clean &= !ok && after.sent == before.sent && after.tx_bytes == before.tx_bytes;
+        for (size_t i = 0; i < outcomes.size(); i++)
+        {
+            clean &= outcomes[i].status == CAR_CANCELLED;
+        }
+        r->failed += !clean;
+    }
+}
+
+static void run_test(const char *test, size_t count, size_t window, bench_result_t *r)
+{
+    r->name = test;
+    r->failed = 0;
+    r->rtt_us.clear();
+    r->before = car_link_stats(&bench_link);
+    int64_t start = now_us();
+    if (!strcmp(test, "stop"))
+    {
+        run_stop(count, r);
+    }
+    else if (!strcmp(test, "queued"))
+    {
+        run_queued(count, window, r);
+    }
+    else if (!strcmp(test, "idle"))
+    {
+        // nothing from the ESP32 for longer than the car waits before it falls
+        // back to the base rate; the keepalive has to prevent that
+        usleep((CAR_BAUD_SILENCE_MS + 1000) * 1000LL);
+        start = now_us();
+        for (size_t i = 0; i < count; i++)
+        {
+            car_cmd_t cmd = make_cmd(i & 1 ? "pose" : "move", i);
+            car_result_t result;
+            if (car_link_call(&bench_link, &cmd, BENCH_TIMEOUT_MS, &result) == CAR_OK)
+                r->rtt_us.push_back(result.rtt_us);
+            else
+                r->failed++;
+        }
+    }
+    else if (!strcmp(test, "path"))
+    {
+        std::vector<car_cmd_t> cmds(count);
+        std::vector<car_outcome_t> outcomes(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            cmds[i] = make_cmd(test, i);
+        }
+        car_link_pipeline(&bench_link, cmds.data(), count, window, BENCH_TIMEOUT_MS, outcomes.data());
+        for (size_t i = 0; i < count; i++)
+        {
+            if (outcomes[i].status == CAR_OK)
+                r->rtt_us.push_back(outcomes[i].rtt_us);
+            else
+                r->failed++;
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            car_cmd_t cmd = make_cmd(test, i);
+            car_result_t result;
+            if (car_link_call(&bench_link, &cmd, BENCH_TIMEOUT_MS, &result) == CAR_OK)
+                r->rtt_us.push_back(result.rtt_us);
+            else
+                r->failed++;
+        }
+    }
+    r->elapsed_us = now_us() - start;
+    r->after = car_link_stats(&bench_link);
+}
+
+static double percentile_ms(std::vector<int64_t> v, int pct)
+{
+    if (v.empty())
+    {
+        return 0.0;
+    }
+    std::sort(v.begin(), v.end());
+    return v[(v.size() - 1) * pct / 100] / 1000.0;
+}
+
+static pid_t start_sim(const char *sim, const char *tty, const std::vector<const char *> &extra, bool text_only)
+{
+    std::vector<const char *> args;
+    args.push_back(sim);
+    args.push_back("--link");
+    args.push_back(tty);
+    if (text_only)
+    {
+        args.push_back("--text-only");
+    }
+    args.insert(args.end(), extra.begin(), extra.end());
+    args.push_back(NULL);
+    unlink(tty);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        execv(sim, (char *const *)args.data());
+        perror(sim);
+        _exit(127);
+    }
+    for (int i = 0; i < 100 && access(tty, F_OK); i++)
+    {
+        usleep(20000);
+    }
+    return pid;
+}
+
+static bool open_link(const char *tty)
+{
+    tty_fd = open(tty, O_RDWR | O_NOCTTY);
+    if (tty_fd < 0)
+    {
+        perror(tty);
+        return false;
+    }
+    struct termios tio;
+    tcgetattr(tty_fd, &tio);
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, B9600);
+    tcsetattr(tty_fd, TCSANOW, &tio);
+    tty_baud = 9600;
+    car_transport_t io = {tty_read, tty_write, tty_set_baud, tty_flush, &tty_fd};
+    car_link_init(&bench_link, &io);
+    return true;
+}
+
+static std::vector<std::string> split(const char *list)
+{
+    std::vector<std::string> out;
+    std::string s(list);
+    size_t start = 0;
+    while (start <= s.size())
+    {
+        size_t end = s.find(',', start);
+        if (end == std::string::npos)
+        {
+            end = s.size();
+        }
+        if (end > start)
+        {
+            out.push_back(s.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return out;
+}
+
+int main(int argc, char **argv)
+{
+    const char *sim = "./car_sim";
+    const char *tty = "/tmp/car_bench_tty";
+    size_t count = 50;
+    size_t window = 4;
+    const char *bauds = "9600,115200,460800";
+    const char *framings = "text,binary";
+    const char *tests = "move,turn,pose,path,stop,queued,idle";
+    std::vector<const char *> extra;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--sim") && i + 1 < argc)
+            sim = argv[++i];
+        else if (!strcmp(argv[i], "--tty") && i + 1 < argc)
+            tty = argv[++i];
+        else if (!strcmp(argv[i], "--count") && i + 1 < argc)
+            count = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--window") && i + 1 < argc)
+            window = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--bauds") && i + 1 < argc)
+            bauds = argv[++i];
+        else if (!strcmp(argv[i], "--framings") && i + 1 < argc)
+            framings = argv[++i];
+        else if (!strcmp(argv[i], "--tests") && i + 1 < argc)
+            tests = argv[++i];
+        else if (!strcmp(argv[i], "--"))
+        {
+            extra.assign(argv + i + 1, argv + argc);
+            break;
+        }
+        else
+        {
+            fprintf(stderr,
+                    "usage: %s [--sim PATH] [--tty PATH] [--count N] [--window N] [--bauds LIST] [--framings LIST]\n"
+                    "          [--tests LIST] [-- car_sim options]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (!count || !window || window > CAR_LINK_MAX_PENDING)
+    {
+        fprintf(stderr, "--count must be > 0, --window 1..%d\n", CAR_LINK_MAX_PENDING);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%-7s %7s %-6s %5s %8s %8s %8s %9s %9s %5s\n", "framing", "baud", "test", "cmds", "p50 ms", "p99 ms", "cmd/s",
+           "tx B/cmd", "rx B/cmd", "fail");
+    std::vector<std::string> framing_list = split(framings);
+    std::vector<std::string> baud_list = split(bauds);
+    std::vector<std::string> test_list = split(tests);
+    size_t failed = 0;
+    for (size_t f = 0; f < framing_list.size(); f++)
+    {
+        bool binary = framing_list[f] == "binary";
+        for (size_t b = 0; b < baud_list.size(); b++)
+        {
+            uint32_t want = atoi(baud_list[b].c_str());
+            pid_t pid = start_sim(sim, tty, extra, !binary);
+            if (!open_link(tty))
+            {
+                kill(pid, SIGTERM);
+                waitpid(pid, NULL, 0);
+                return 1;
+            }
+            polling = true;
+            std::thread poller(poll_loop);
+
+            car_framing_t framing = car_link_negotiate(&bench_link, 300);
+            car_baud_t baud;
+            car_baud_init(&baud, &bench_link, NULL);
+            car_baud_limit(&baud, want);
+            uint32_t got = car_baud_negotiate(&baud);
+            if (got != want)
+            {
+                printf("# asked for %u baud, got %u\n", want, got);
+            }
+            std::thread checker(baud_check_loop, &baud);
+
+            for (size_t t = 0; t < test_list.size(); t++)
+            {
+                bench_result_t r;
+                run_test(test_list[t].c_str(), count, window, &r);
+                double cmds = (double)count;
+                printf("%-7s %7u %-6s %5zu %8.2f %8.2f %8.1f %9.1f %9.1f %5zu\n",
+                       framing == CAR_FRAMING_BINARY ? "binary" : "text", got, r.name, count,
+                       percentile_ms(r.rtt_us, 50), percentile_ms(r.rtt_us, 99), cmds * 1e6 / r.elapsed_us,
+                       (r.after.tx_bytes - r.before.tx_bytes) / cmds, (r.after.rx_bytes - r.before.rx_bytes) / cmds,
+                       r.failed);
+                fflush(stdout);
+                failed += r.failed;
+            }
+
+            polling = false;
+            checker.join();
+            poller.join();
+            close(tty_fd);
+            kill(pid, SIGTERM);
+            waitpid(pid, NULL, 0);
+        }
+    }
+    unlink(tty);
+    if (failed)
+    {
+        printf("FAIL: %zu commands failed\n", failed);
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,695 @@
+/*
+ * Simulated Elegoo car on a pseudo-terminal, so the serial path can be measured
+ * without a car on the bench.
+ *
+ *   g++ -std=gnu++11 -O2 -pthread -I.. car_sim.cpp ../car_proto.cpp ../car_link.cpp ../car_baud.cpp -o car_sim
+ *   ./car_sim [--link /tmp/car] [--latency MS] [--jitter MS] [--drop P] [--speed M/S] [--turn-rate DEG/S]
+ *             [--ack-on-done] [--text-only] [--fixed-baud] [--max-baud RATE] [--noisy-above RATE] [--factory] [-v]
+ *
+ * Prints the pty it opened (and symlinks it to --link); point car_bench or
+ * anything else that speaks the car protocol at it. It answers
+ *
+ *   {"N":100}       stop, clears the motion queue
+ *   {"N":200,D1,D2} move D2 cm, D1 = 1 forward / 2 backward
+ *   {"N":201,D1}    turn D1 degrees, positive counterclockwise
+ *   {"N":300}       {"H":id,"pose":{...}}
+ *   {"N":301,D1}    stream the pose every D1 ms under CAR_POSE_STREAM_ID
+ *   {"N":110}       binary framing (car_proto.h), unless --text-only
+ *   {"N":111..114}  baud handshake (car_baud.h), unless --fixed-baud
+ *   {Factory}       with --factory, the {BT_detection} / {WA_detection} exchange
+ *
+ * acking commands with an H id as {id_ok} on receipt, or once the motion is
+ * done with --ack-on-done. Moves queue up and run at --speed.
+ *
+ * Bytes take 10 bit times at the current baud rate in both directions. The
+ * rate the other end uses is read from the pty's termios; while it differs
+ * from the simulated car's, received bytes are lost and sent ones arrive as
+ * noise, as on a real UART. --latency and --jitter delay each reply, --drop
+ * loses that share of incoming frames, and above --noisy-above every byte
+ * the car sends is corrupted with probability 1%.
+ */
+
+#include "car_proto.h"
+#include "car_baud.h"
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <deque>
+#include <map>
+#include <string>
+
+#define SIM_ID_LEN 16
+#define SIM_NOISE_RATE 0.01
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const struct
+{
+    uint32_t rate;
+    speed_t speed;
+} speeds[] = {{9600, B9600}, {19200, B19200}, {38400, B38400}, {57600, B57600},
+              {115200, B115200}, {230400, B230400}, {460800, B460800}};
+
+static uint32_t rate_of(speed_t speed)
+{
+    for (size_t i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+    {
+        if (speeds[i].speed == speed)
+        {
+            return speeds[i].rate;
+        }
+    }
+    return 0;
+}
+
+typedef struct
+{
+    double latency_ms;
+    double jitter_ms;
+    double drop;
+    double speed;     // m/s
+    double turn_rate; // deg/s
+    bool ack_on_done;
+    bool text_only;
+    bool fixed_baud;
+    uint32_t max_baud;
+    uint32_t noisy_above;
+    bool factory;
+    bool verbose;
+} sim_opts_t;
+
+// Where a reply goes: an H id in a text frame, or a tag in a binary one
+typedef struct
+{
+    char id[SIM_ID_LEN];
+    uint8_t tag;
+    bool binary;
+} origin_t;
+
+typedef struct
+{
+    bool turn;
+    double remaining; // m or deg, signed
+    origin_t ack;     // with --ack-on-done
+} motion_t;
+
+typedef struct
+{
+    uint64_t frames_in;
+    uint64_t frames_out;
+    uint64_t dropped;
+    uint64_t bad_frames;
+    uint64_t lost_bytes; // received at the wrong rate
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+} sim_stats_t;
+
+static sim_opts_t opts;
+static sim_stats_t stats;
+static int master_fd;
+static bool binary = false;
+static int rate = 0;           // index into car_baud_rates
+static int prev_rate = 0;      // to return to without COMMIT
+static int64_t commit_by = 0;  // 0: nothing to commit
+static int next_rate = -1;     // proposed, taken once the ack is out
+static int64_t switch_at_us = 0;
+static int64_t last_valid_us = 0;
+static int64_t rx_free_us = 0; // when the line into the car is idle
+static int64_t tx_free_us = 0; // when the line out of the car is idle
+static std::multimap<int64_t, std::string> rx_frames; // frame text or wire bytes, by arrival of the last byte
+static std::multimap<int64_t, std::string> tx_bytes;  // by when the last byte is on the wire
+static std::string rx_acc;
+static int rx_depth = 0;
+static double x_m = 0, y_m = 0, th_deg = 0, v_ms = 0;
+static std::deque<motion_t> motions;
+static int64_t pose_period_us = 0;
+static int64_t next_pose_us = 0;
+static volatile sig_atomic_t quit = 0;
+
+static int64_t byte_us(void)
+{
+    return 10000000LL / car_baud_rates[rate];
+}
+
+static int64_t reply_delay_us(void)
+{
+    return (int64_t)((opts.latency_ms + opts.jitter_ms * drand48()) * 1000.0);
+}
+
+// Queues bytes behind whatever the car is still sending
+static void send_raw(const std::string &bytes, int64_t ready_us)
+{
+    int64_t start = ready_us > tx_free_us ? ready_us : tx_free_us;
+    tx_free_us = start + (int64_t)bytes.size() * byte_us();
+    tx_bytes.insert(std::make_pair(tx_free_us, bytes));
+    stats.frames_out++;
+}
+
+static void send_text(const char *text, int64_t ready_us)
+{
+    if (opts.verbose)
+    {
+        printf("-> %s\n", text);
+    }
+    if (!binary)
+    {
+        send_raw(text, ready_us);
+        return;
+    }
+    uint8_t wire[CAR_PROTO_MAX_WIRE];
+    size_t n = car_proto_encode_text(text, strlen(text), wire, sizeof(wire));
+    send_raw(std::string((char *)wire, n), ready_us);
+}
+
+static void send_binary(uint8_t type, uint8_t tag, const uint8_t *payload, size_t len, int64_t ready_us)
+{
+    uint8_t wire[CAR_PROTO_MAX_WIRE];
+    size_t n = car_proto_encode(type, tag, payload, len, wire, sizeof(wire));
+    if (opts.verbose)
+    {
+        printf("-> type 0x%02x tag %u (%zu bytes)\n", type, tag, n);
+    }
+    send_raw(std::string((char *)wire, n), ready_us);
+}
+
+static void send_ack(const origin_t *o, bool ok, int64_t ready_us)
+{
+    if (o->binary)
+    {
+        send_binary(ok ? CAR_PROTO_ACK : CAR_PROTO_REJECT, o->tag, NULL, 0, ready_us);
+        return;
+    }
+    if (!o->id[0])
+    {
+        return;
+    }
+    char text[64];
+    snprintf(text, sizeof(text), "{%s_%s}", o->id, ok ? "ok" : "false");
+    send_text(text, ready_us);
+}
+
+static void send_value(const origin_t *o, long value, int64_t ready_us)
+{
+    char text[64];
+    snprintf(text, sizeof(text), "{%s_%ld}", o->id, value);
+    send_text(text, ready_us);
+}
+
+static void put_le16(uint8_t *p, long v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+static void send_pose(const origin_t *o, int64_t ready_us)
+{
+    if (binary && (o->binary || !strcmp(o->id, CAR_POSE_STREAM_ID)))
+    {
+        uint8_t payload[8];
+        put_le16(payload, lround(x_m * 1000));
+        put_le16(payload + 2, lround(y_m * 1000));
+        put_le16(payload + 4, lround(th_deg));
+        put_le16(payload + 6, lround(v_ms * 1000));
+        send_binary(CAR_PROTO_POSE_REPLY, o->binary ? o->tag : 0, payload, sizeof(payload), ready_us);
+        return;
+    }
+    char text[128];
+    snprintf(text, sizeof(text), "{\"H\":\"%s\",\"pose\":{\"x\":%.3f,\"y\":%.3f,\"th\":%ld,\"v\":%.3f}}", o->id, x_m, y_m,
+             lround(th_deg), v_ms);
+    send_text(text, ready_us);
+}
+
+static void set_rate(int index, const char *why)
+{
+    if (index != rate)
+    {
+        printf("baud %u -> %u (%s)\n", car_baud_rates[rate], car_baud_rates[index], why);
+        fflush(stdout);
+    }
+    rate = index;
+}
+
+static void run_command(int n, long d1, long d2, const origin_t *o, int64_t t)
+{
+    int64_t ready = t + reply_delay_us();
+    motion_t m;
+    m.ack = *o;
+    switch (n)
+    {
+    case CAR_CMD_STOP:
+        motions.clear();
+        v_ms = 0;
+        send_ack(o, true, ready);
+        break;
+    case CAR_CMD_MOVE:
+    case CAR_CMD_TURN:
+        m.turn = n == CAR_CMD_TURN;
+        m.remaining = m.turn ? d1 : (d1 == 2 ? -d2 : d2) / 100.0;
+        motions.push_back(m);
+        if (!opts.ack_on_done)
+        {
+            send_ack(o, true, ready);
+        }
+        break;
+    case CAR_CMD_POSE:
+        send_pose(o, ready);
+        break;
+    case CAR_CMD_POSE_STREAM:
+        pose_period_us = d1 > 0 ? d1 * 1000LL : 0;
+        next_pose_us = t;
+        send_ack(o, true, ready);
+        break;
+    case CAR_CMD_PROTO:
+        if (opts.text_only || d1 != CAR_PROTO_VERSION)
+        {
+            break; // what firmware without binary framing does
+        }
+        send_ack(o, true, ready);
+        binary = true;
+        printf("binary framing\n");
+        break;
+    case CAR_CMD_BAUD_PROBE:
+        if (!opts.fixed_baud)
+        {
+            long mask = 0;
+            for (int i = 0; i < CAR_BAUD_RATES; i++)
+            {
+                mask |= car_baud_rates[i] <= opts.max_baud ? 1L << i : 0;
+            }
+            send_value(o, mask, ready);
+        }
+        break;
+    case CAR_CMD_BAUD_SET:
+        if (opts.fixed_baud)
+        {
+            break;
+        }
+        if (d1 < 0 || d1 >= CAR_BAUD_RATES || car_baud_rates[d1] > opts.max_baud)
+        {
+            send_ack(o, false, ready);
+            break;
+        }
+        send_ack(o, true, ready);
+        next_rate = (int)d1;
+        switch_at_us = tx_free_us;
+        break;
+    case CAR_CMD_BAUD_TEST:
+        if (!opts.fixed_baud)
+        {
+            send_value(o, d2, ready);
+        }
+        break;
+    case CAR_CMD_BAUD_COMMIT:
+        if (!opts.fixed_baud)
+        {
+            commit_by = 0;
+            send_ack(o, true, ready);
+        }
+        break;
+    default:
+        send_ack(o, false, ready);
+        break;
+    }
+}
+
+static long field(const std::string &f, const char *key, long dflt)
+{
+    size_t p = f.find(key);
+    return p == std::string::npos ? dflt : strtol(f.c_str() + p + strlen(key), NULL, 10);
+}
+
+static void handle_text(const std::string &f, int64_t t)
+{
+    if (opts.verbose)
+    {
+        printf("<- %s\n", f.c_str());
+    }
+    if (f == "{Factory}")
+    {
+        if (opts.factory)
+        {
+            send_text("{BT_detection}", t + reply_delay_us());
+        }
+        return;
+    }
+    if (f == "{BT_OK}")
+    {
+        printf("factory: bluetooth ok\n");
+        send_text("{WA_detection}", t + reply_delay_us());
+        return;
+    }
+    if (f.find("\"N\"") == std::string::npos)
+    {
+        printf("factory: %s\n", f.c_str()); // {WA_OK}, {WA_NO} or the wifi name
+        return;
+    }
+    origin_t o;
+    o.binary = false;
+    o.tag = 0;
+    o.id[0] = 0;
+    size_t h = f.find("\"H\":\"");
+    if (h != std::string::npos)
+    {
+        size_t end = f.find('"', h + 5);
+        snprintf(o.id, sizeof(o.id), "%s", f.substr(h + 5, end - h - 5).c_str());
+    }
+    run_command((int)field(f, "\"N\":", -1), field(f, "\"D1\":", 0), field(f, "\"D2\":", 0), &o, t);
+}
+
+static void handle_binary(std::string &wire, int64_t t)
+{
+    car_proto_msg_t msg;
+    if (!car_proto_decode((uint8_t *)&wire[0], wire.size(), &msg))
+    {
+        stats.bad_frames++;
+        return;
+    }
+    if (msg.type == CAR_PROTO_TEXT)
+    {
+        handle_text(std::string((const char *)msg.payload, msg.payload_len), t);
+        return;
+    }
+    if (opts.verbose)
+    {
+        printf("<- type 0x%02x tag %u\n", msg.type, msg.tag);
+    }
+    origin_t o;
+    o.binary = true;
+    o.tag = msg.tag;
+    o.id[0] = 0;
+    const uint8_t *p = msg.payload;
+    switch (msg.type)
+    {
+    case CAR_PROTO_STOP:
+        run_command(CAR_CMD_STOP, 0, 0, &o, t);
+        break;
+    case CAR_PROTO_MOVE:
+        if (msg.payload_len >= 3)
+        {
+            run_command(CAR_CMD_MOVE, (int8_t)p[0], p[1] | (p[2] << 8), &o, t);
+        }
+        break;
+    case CAR_PROTO_TURN:
+        if (msg.payload_len >= 2)
+        {
+            run_command(CAR_CMD_TURN, (int16_t)(p[0] | (p[1] << 8)), 0, &o, t);
+        }
+        break;
+    case CAR_PROTO_POSE:
+        run_command(CAR_CMD_POSE, 0, 0, &o, t);
+        break;
+    default:
+        send_ack(&o, false, t + reply_delay_us());
+        break;
+    }
+}
+
+// Splits received bytes into frames stamped with when their last byte arrived
+static void receive(const uint8_t *buf, size_t len, int64_t now)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        rx_free_us = (rx_free_us > now ? rx_free_us : now) + byte_us();
+        char c = (char)buf[i];
+        if (binary)
+        {
+            if (c)
+            {
+                rx_acc += c;
+            }
+            else if (!rx_acc.empty())
+            {
+                rx_frames.insert(std::make_pair(rx_free_us, rx_acc));
+                rx_acc.clear();
+            }
+            continue;
+        }
+        if (c == '{')
+        {
+            rx_depth++;
+        }
+        if (rx_depth)
+        {
+            rx_acc += c;
+        }
+        if (c == '}' && rx_depth && --rx_depth == 0)
+        {
+            rx_frames.insert(std::make_pair(rx_free_us, rx_acc));
+            rx_acc.clear();
+        }
+    }
+}
+
+static void drive(double dt, int64_t now)
+{
+    v_ms = 0;
+    while (!motions.empty() && dt > 0)
+    {
+        motion_t *m = &motions.front();
+        double rate_per_s = m->turn ? opts.turn_rate : opts.speed;
+        double step = fabs(m->remaining) < rate_per_s * dt ? fabs(m->remaining) : rate_per_s * dt;
+        double sign = m->remaining < 0 ? -1 : 1;
+        if (m->turn)
+        {
+            th_deg = fmod(th_deg + sign * step + 360.0, 360.0);
+        }
+        else
+        {
+            x_m += sign * step * cos(th_deg * M_PI / 180.0);
+            y_m += sign * step * sin(th_deg * M_PI / 180.0);
+            v_ms = sign * opts.speed;
+        }
+        m->remaining -= sign * step;
+        dt -= step / rate_per_s;
+        if (fabs(m->remaining) < 1e-9)
+        {
+            if (opts.ack_on_done)
+            {
+                send_ack(&m->ack, true, now);
+            }
+            motions.pop_front();
+        }
+    }
+}
+
+static void on_signal(int)
+{
+    quit = 1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *link_path = NULL;
+    opts.latency_ms = 2;
+    opts.jitter_ms = 0;
+    opts.drop = 0;
+    opts.speed = 0.3;
+    opts.turn_rate = 90;
+    opts.ack_on_done = false;
+    opts.text_only = false;
+    opts.fixed_baud = false;
+    opts.max_baud = 460800;
+    opts.noisy_above = 0;
+    opts.factory = false;
+    opts.verbose = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--link") && i + 1 < argc)
+            link_path = argv[++i];
+        else if (!strcmp(argv[i], "--latency") && i + 1 < argc)
+            opts.latency_ms = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--jitter") && i + 1 < argc)
+            opts.jitter_ms = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--drop") && i + 1 < argc)
+            opts.drop = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--speed") && i + 1 < argc)
+            opts.speed = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--turn-rate") && i + 1 < argc)
+            opts.turn_rate = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--max-baud") && i + 1 < argc)
+            opts.max_baud = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--noisy-above") && i + 1 < argc)
+            opts.noisy_above = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--ack-on-done"))
+            opts.ack_on_done = true;
+        else if (!strcmp(argv[i], "--text-only"))
+            opts.text_only = true;
+        else if (!strcmp(argv[i], "--fixed-baud"))
+            opts.fixed_baud = true;
+        else if (!strcmp(argv[i], "--factory"))
+            opts.factory = true;
+        else if (!strcmp(argv[i], "-v"))
+            opts.verbose = true;
+        else
+        {
+            fprintf(stderr,
+                    "usage: %s [--link PATH] [--latency MS] [--jitter MS] [--drop P] [--speed M/S] [--turn-rate DEG/S]\n"
+                    "          [--ack-on-done] [--text-only] [--fixed-baud] [--max-baud RATE] [--noisy-above RATE]\n"
+                    "          [--factory] [-v]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+
+    master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master_fd < 0 || grantpt(master_fd) || unlockpt(master_fd))
+    {
+        perror("pty");
+        return 1;
+    }
+    const char *slave = ptsname(master_fd);
+    // held open so the pty survives clients coming and going
+    int slave_fd = open(slave, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    tcgetattr(slave_fd, &tio);
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, B9600);
+    tcsetattr(slave_fd, TCSANOW, &tio);
+    if (link_path)
+    {
+        unlink(link_path);
+        if (symlink(slave, link_path))
+        {
+            perror(link_path);
+        }
+    }
+    printf("car on %s%s%s\n", slave, link_path ? " -> " : "", link_path ? link_path : "");
+    fflush(stdout);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    srand48(now_us());
+
+    int64_t last_move = now_us();
+    last_valid_us = last_move;
+    while (!quit)
+    {
+        int64_t now = now_us();
+        int64_t next = now + 10000;
+        if (!rx_frames.empty() && rx_frames.begin()->first < next)
+            next = rx_frames.begin()->first;
+        if (!tx_bytes.empty() && tx_bytes.begin()->first < next)
+            next = tx_bytes.begin()->first;
+        struct pollfd pfd = {master_fd, POLLIN, 0};
+        int wait_ms = next > now ? (int)((next - now + 999) / 1000) : 0;
+        if (poll(&pfd, 1, wait_ms) > 0 && (pfd.revents & POLLIN))
+        {
+            uint8_t buf[512];
+            ssize_t n = read(master_fd, buf, sizeof(buf));
+            now = now_us();
+            if (n > 0)
+            {
+                stats.bytes_in += n;
+                tcgetattr(master_fd, &tio);
+                if (rate_of(cfgetospeed(&tio)) == car_baud_rates[rate])
+                {
+                    receive(buf, n, now);
+                }
+                else
+                {
+                    stats.lost_bytes += n; // framing errors on a real UART
+                    rx_acc.clear();
+                    rx_depth = 0;
+                }
+            }
+        }
+        now = now_us();
+
+        while (!rx_frames.empty() && rx_frames.begin()->first <= now)
+        {
+            int64_t t = rx_frames.begin()->first;
+            std::string f = rx_frames.begin()->second;
+            rx_frames.erase(rx_frames.begin());
+            stats.frames_in++;
+            if (opts.drop > 0 && drand48() < opts.drop)
+            {
+                stats.dropped++;
+                continue;
+            }
+            last_valid_us = t;
+            if (binary)
+            {
+                handle_binary(f, t);
+            }
+            else
+            {
+                handle_text(f, t);
+            }
+        }
+
+        while (!tx_bytes.empty() && tx_bytes.begin()->first <= now)
+        {
+            std::string bytes = tx_bytes.begin()->second;
+            tx_bytes.erase(tx_bytes.begin());
+            tcgetattr(master_fd, &tio);
+            bool match = rate_of(cfgetospeed(&tio)) == car_baud_rates[rate];
+            bool noisy = opts.noisy_above && car_baud_rates[rate] > opts.noisy_above;
+            for (size_t i = 0; i < bytes.size(); i++)
+            {
+                if (!match || (noisy && drand48() < SIM_NOISE_RATE))
+                {
+                    bytes[i] = (char)lrand48();
+                }
+            }
+            if (write(master_fd, bytes.data(), bytes.size()) > 0)
+            {
+                stats.bytes_out += bytes.size();
+            }
+        }
+
+        if (next_rate >= 0 && now >= switch_at_us && tx_bytes.empty())
+        {
+            prev_rate = rate;
+            commit_by = now + CAR_BAUD_COMMIT_MS * 1000LL;
+            set_rate(next_rate, "proposed");
+            next_rate = -1;
+        }
+        if (commit_by && now > commit_by)
+        {
+            commit_by = 0;
+            set_rate(prev_rate, "no commit");
+        }
+        if (rate && now - last_valid_us > CAR_BAUD_SILENCE_MS * 1000LL)
+        {
+            set_rate(0, "silence");
+        }
+
+        drive((now - last_move) / 1e6, now);
+        last_move = now;
+        if (pose_period_us && now >= next_pose_us)
+        {
+            origin_t o;
+            o.binary = false;
+            o.tag = 0;
+            snprintf(o.id, sizeof(o.id), "%s", CAR_POSE_STREAM_ID);
+            send_pose(&o, now);
+            next_pose_us += pose_period_us;
+            if (next_pose_us < now)
+            {
+                next_pose_us = now + pose_period_us;
+            }
+        }
+    }
+
+    printf("\nframes in %llu (dropped %llu, bad %llu), out %llu; bytes in %llu (lost %llu), out %llu\n",
+           (unsigned long long)stats.frames_in, (unsigned long long)stats.dropped, (unsigned long long)stats.bad_frames,
+           (unsigned long long)stats.frames_out, (unsigned long long)stats.bytes_in, (unsigned long long)stats.lost_bytes,
+           (unsigned long long)stats.bytes_out);
+    if (link_path)
+    {
+        unlink(link_path);
+    }
+    close(slave_fd);
+    return 0;
+}
@@ -0,0 +1,315 @@
+/*
+ * Clip ring test: exercises clip_ring.cpp's eviction and wrap-around on the
+ * host.
+ *
+ *   g++ -std=gnu++11 -O2 -pthread -I.. clip_test.cpp ../clip_ring.cpp -o clip_test
+ *   ./clip_test [--rounds 200000] [--seed 1] [-v]
+ *
+ * Runs fixed cases for the edges of reserve_locked()/evict_oldest_locked()
+ *
+ *   wrap_end   the tail wraps to 0, then eviction walks head exactly onto
+ *              wrap_end (and past it onto a skipped gap)
+ *   full       a frame whose record takes the whole budget, pushed into an
+ *              empty, a partly full and a wrapped ring
+ *   frozen     pushes while frozen are rejected and leave the content alone
+ *   max_age    frames older than max_age_us go before the budget runs out
+ *
+ * and then --rounds random pushes of random sizes, checking after each one
+ * that the ring holds a gap-free run of the newest frames with intact
+ * payloads and consistent counters. Exits non-zero on the first failure.
+ */
+
+#include "clip_ring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define HEADER_LEN 16 // sizeof(clip_frame_t), what record_size() adds to a frame
+
+static bool verbose = false;
+static int failures = 0;
+
+#define CHECK(cond)                                                                                                   \
+    do                                                                                                                \
+    {                                                                                                                 \
+        if (!(cond))                                                                                                  \
+        {                                                                                                             \
+            printf("  %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);                                        \
+            failures++;                                                                                               \
+            return false;                                                                                             \
+        }                                                                                                             \
+    } while (0)
+
+// Frame n carries len bytes derived from n so a visit can tell it intact. One
+// spare byte keeps data() non-null for empty frames.
+static void fill(std::vector<uint8_t> &buf, uint32_t n, size_t len)
+{
+    buf.assign(len + 1, 0);
+    for (size_t i = 0; i < len; i++)
+    {
+        buf[i] = (uint8_t)(n * 31 + i * 7);
+    }
+}
+
+static bool push(clip_ring_t *ring, uint32_t n, size_t len)
+{
+    std::vector<uint8_t> buf;
+    fill(buf, n, len);
+    return clip_ring_push(ring, buf.data(), len, (uint16_t)len, (uint16_t)n, (int64_t)n * 1000);
+}
+
+typedef struct
+{
+    const clip_ring_t *ring;
+    std::vector<uint32_t> seen;
+    bool ok;
+} walk_t;
+
+static bool walk_frame(void *arg, const clip_frame_t *frame, const uint8_t *jpg)
+{
+    walk_t *w = (walk_t *)arg;
+    uint32_t n = frame->height;
+    std::vector<uint8_t> want;
+    fill(want, n, frame->len);
+    const uint8_t *mem = w->ring->mem;
+    if (frame->len != frame->width || frame->timestamp_us != (int64_t)n * 1000 ||
+        (const uint8_t *)frame < mem || jpg + frame->len > mem + w->ring->size ||
+        memcmp(jpg, want.data(), frame->len))
+    {
+        printf("  frame %u is damaged\n", n);
+        w->ok = false;
+        return false;
+    }
+    w->seen.push_back(n);
+    return true;
+}
+
+// The ring must hold frames first..last without gaps, oldest first
+static bool check_ring(clip_ring_t *ring, uint32_t first, uint32_t last)
+{
+    walk_t w;
+    w.ring = ring;
+    w.ok = true;
+    clip_ring_visit(ring, 0, walk_frame, &w);
+    CHECK(w.ok);
+    CHECK(w.seen.size() == (size_t)(last + 1 - first));
+    for (size_t i = 0; i < w.seen.size(); i++)
+    {
+        CHECK(w.seen[i] == first + i);
+    }
+    clip_ring_stats_t st = clip_ring_stats(ring);
+    CHECK(st.count == w.seen.size());
+    CHECK(!st.count || st.oldest_us == (int64_t)first * 1000);
+    CHECK(!st.count || st.newest_us == (int64_t)last * 1000);
+    CHECK(ring->tail <= ring->size);
+    CHECK(!ring->wrapped || (ring->tail <= ring->head && ring->head < ring->wrap_end));
+    CHECK(ring->wrapped || !ring->count || ring->head < ring->tail);
+    return true;
+}
+
+static bool test_wrap_end(void)
+{
+    static uint8_t mem[256];
+    static clip_ring_t ring;
+    clip_ring_init(&ring, mem, sizeof(mem), 0);
+    // records of 64 bytes: 0, 64, 128, 192 fill the block
+    for (uint32_t n = 0; n < 4; n++)
+    {
+        CHECK(push(&ring, n, 64 - HEADER_LEN));
+    }
+    CHECK(ring.tail == 256 && !ring.wrapped);
+    CHECK(check_ring(&ring, 0, 3));
+    // no room at the end: evicts frame 0 and wraps
+    CHECK(push(&ring, 4, 64 - HEADER_LEN));
+    CHECK(ring.wrapped && ring.wrap_end == 256 && ring.head == 64 && ring.tail == 64);
+    CHECK(check_ring(&ring, 1, 4));
+    // 128-byte record: evicts 1 and 2, head at 192
+    CHECK(push(&ring, 5, 128 - HEADER_LEN));
+    CHECK(ring.wrapped && ring.head == 192 && ring.tail == 192);
+    CHECK(check_ring(&ring, 3, 5));
+    // evicting 3 walks head exactly onto wrap_end, which must unwrap to 0
+    CHECK(push(&ring, 6, 64 - HEADER_LEN));
+    CHECK(!ring.wrapped && ring.head == 0 && ring.tail == 256);
+    CHECK(check_ring(&ring, 4, 6));
+
+    // A gap at the end: records of 96 leave 64 bytes unused before wrap_end
+    clip_ring_init(&ring, mem, sizeof(mem), 0);
+    CHECK(push(&ring, 0, 96 - HEADER_LEN));
+    CHECK(push(&ring, 1, 96 - HEADER_LEN));
+    CHECK(push(&ring, 2, 96 - HEADER_LEN));
+    CHECK(ring.wrapped && ring.wrap_end == 192 && ring.head == 96 && ring.tail == 96);
+    CHECK(check_ring(&ring, 1, 2));
+    // needs 96 more: evicts 1, head reaches wrap_end and unwraps
+    CHECK(push(&ring, 3, 96 - HEADER_LEN));
+    CHECK(!ring.wrapped && ring.head == 0 && ring.tail == 192);
+    CHECK(check_ring(&ring, 2, 3));
+    return true;
+}
+
+static bool test_full(void)
+{
+    static uint8_t mem[256];
+    static clip_ring_t ring;
+    clip_ring_init(&ring, mem, sizeof(mem), 0);
+    CHECK(push(&ring, 0, 256 - HEADER_LEN));
+    CHECK(ring.tail == 256);
+    CHECK(check_ring(&ring, 0, 0));
+    // a second full frame evicts the first
+    CHECK(push(&ring, 1, 256 - HEADER_LEN));
+    CHECK(check_ring(&ring, 1, 1));
+    // one byte more than the budget is rejected and keeps what is there
+    CHECK(!push(&ring, 2, 256 - HEADER_LEN + 1));
+    CHECK(check_ring(&ring, 1, 1));
+    CHECK(clip_ring_stats(&ring).rejected == 1);
+
+    // into a partly full ring
+    clip_ring_init(&ring, mem, sizeof(mem), 0);
+    CHECK(push(&ring, 0, 32));
+    CHECK(push(&ring, 1, 32));
+    CHECK(push(&ring, 2, 256 - HEADER_LEN));
+    CHECK(check_ring(&ring, 2, 2));
+
+    // into a wrapped ring
+    clip_ring_init(&ring, mem, sizeof(mem), 0);
+    for (uint32_t n = 0; n < 5; n++)
+    {
+        CHECK(push(&ring, n, 80 - HEADER_LEN));
+    }
+    CHECK(ring.wrapped);
+    CHECK(push(&ring, 5, 256 - HEADER_LEN));
+    CHECK(!ring.wrapped && ring.head == 0 && ring.tail == 256);
+    CHECK(check_ring(&ring, 5, 5));
+    CHECK(push(&ring, 6, 8));
+    CHECK(check_ring(&ring, 6, 6));
+    return true;
+}
+
+static bool test_frozen(void)
+{
+    static uint8_t mem[512];
+    static clip_ring_t ring;
+    clip_ring_init(&ring, mem, sizeof(mem), 0);
+    for (uint32_t n = 0; n < 6; n++)
+    {
+        CHECK(push(&ring, n, 80));
+    }
+    CHECK(ring.wrapped);
+    uint8_t before[sizeof(mem)];
+    memcpy(before, mem, sizeof(mem));
+    size_t head = ring.head;
+    size_t tail = ring.tail;
+    clip_ring_stats_t st = clip_ring_stats(&ring);
+
+    clip_ring_freeze(&ring, true);
+    for (uint32_t n = 6; n < 50; n++)
+    {
+        CHECK(!push(&ring, n, 80));
+    }
+    // a frozen ring is read without the lock, so nothing may have moved
+    CHECK(!memcmp(before, mem, sizeof(mem)));
+    CHECK(ring.head == head && ring.tail == tail);
+    CHECK(check_ring(&ring, 6 - st.count, 5));
+    CHECK(clip_ring_stats(&ring).rejected == st.rejected + 44);
+    CHECK(clip_ring_stats(&ring).evicted == st.evicted);
+
+    clip_ring_freeze(&ring, false);
+    CHECK(push(&ring, 50, 80));
+    CHECK(clip_ring_stats(&ring).newest_us == 50000);
+    return true;
+}
+
+static bool test_max_age(void)
+{
+    static uint8_t mem[4096];
+    static clip_ring_t ring;
+    clip_ring_init(&ring, mem, sizeof(mem), 5000); // 5 frames at 1 ms apart
+    for (uint32_t n = 0; n < 20; n++)
+    {
+        CHECK(push(&ring, n, 40));
+    }
+    CHECK(check_ring(&ring, 14, 19));
+    return true;
+}
+
+static bool test_random(int rounds, uint32_t seed)
+{
+    static uint8_t mem[64 * 1024];
+    static clip_ring_t ring;
+    srand(seed);
+    for (int pass = 0; pass < 4; pass++)
+    {
+        // odd budgets too, init rounds them down to the record alignment
+        size_t size = sizeof(mem) - (size_t)(rand() % 4096);
+        clip_ring_init(&ring, mem, size, 0);
+        uint32_t first = 0;
+        uint32_t n = 0;
+        for (int i = 0; i < rounds / 4; i++, n++)
+        {
+            // mostly small frames with the odd one near the whole budget
+            size_t len = rand() % 50 ? (size_t)(rand() % 6000) : ring.size - HEADER_LEN - (size_t)(rand() % 64);
+            if (!push(&ring, n, len))
+            {
+                printf("  push of %zu bytes into %zu rejected\n", len, ring.size);
+                failures++;
+                return false;
+            }
+            clip_ring_stats_t st = clip_ring_stats(&ring);
+            first = n + 1 - st.count;
+            if (!check_ring(&ring, first, n))
+            {
+                printf("  after push %u (%zu bytes), size %zu\n", n, len, ring.size);
+                return false;
+            }
+        }
+        if (verbose)
+        {
+            clip_ring_stats_t st = clip_ring_stats(&ring);
+            printf("  budget %zu: %u stored, %u evicted, %u held\n", ring.size, st.stored, st.evicted, st.count);
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = 200000;
+    uint32_t seed = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--rounds") && i + 1 < argc)
+            rounds = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+            seed = (uint32_t)strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-v"))
+            verbose = true;
+        else
+        {
+            fprintf(stderr, "usage: %s [--rounds N] [--seed N] [-v]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (sizeof(clip_frame_t) != HEADER_LEN)
+    {
+        fprintf(stderr, "clip_frame_t is %zu bytes, expected %d\n", sizeof(clip_frame_t), HEADER_LEN);
+        return 2;
+    }
+
+    struct
+    {
+        const char *name;
+        bool (*fn)(void);
+    } tests[] = {
+        {"wrap_end", test_wrap_end},
+        {"full", test_full},
+        {"frozen", test_frozen},
+        {"max_age", test_max_age},
+    };
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        printf("%-10s %s\n", tests[i].name, tests[i].fn() ? "ok" : "FAIL");
+    }
+    printf("%-10s %s\n", "random", test_random(rounds, seed) ? "ok" : "FAIL");
+    printf("%s\n", failures ? "FAIL" : "all passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,271 @@
+/*
+ * Frame hub benchmark: runs frame_hub.cpp on the host with a fake camera that,
+ * like esp_camera_fb_get(), blocks while all of its frame buffers are out.
+ *
+ *   g++ -std=gnu++11 -O2 -pthread -I.. hub_bench.cpp ../frame_hub.cpp -o hub_bench
+ *   ./hub_bench [--fb-count 3] [--lent 1] [--fps 25] [--frame-kb 60] [--stall-ms 2000]
+ *               [--stalled 0,1,2,3] [--seconds 3]
+ *
+ * For every number of stalled subscribers (each takes a frame and holds it for
+ * --stall-ms, like a client whose socket stopped draining, staggered so they
+ * hold different frames) it runs once with
+ * the hub lending any number of camera buffers (old behaviour, "lent -") and
+ * once with frame_hub_limit_pins(--lent), next to one fast subscriber, and
+ * prints the capture rate, what the fast subscriber received, how long capture
+ * waited for a free buffer and how many frames were copied out. Exits non-zero
+ * if, with the limit, capture or the fast subscriber falls more than 10% below
+ * --fps.
+ */
+
+#include "frame_hub.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Fake camera driver: a fixed pool of frame buffers
+typedef struct
+{
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<std::vector<uint8_t>> fbs;
+    std::vector<bool> out;
+} fake_camera_t;
+
+static fake_camera_t camera;
+
+static int fb_get(void)
+{
+    std::unique_lock<std::mutex> guard(camera.lock);
+    while (true)
+    {
+        for (size_t i = 0; i < camera.fbs.size(); i++)
+        {
+            if (!camera.out[i])
+            {
+                camera.out[i] = true;
+                return (int)i;
+            }
+        }
+        camera.cond.wait(guard);
+    }
+}
+
+static void fb_return(void *owner)
+{
+    std::lock_guard<std::mutex> guard(camera.lock);
+    camera.out[(intptr_t)owner] = false;
+    camera.cond.notify_all();
+}
+
+static void *copy_alloc(size_t len)
+{
+    return malloc(len);
+}
+
+static void copy_release(void *owner)
+{
+    free(owner);
+}
+
+typedef struct
+{
+    double capture_fps;
+    double fast_fps;
+    double stall_ms; // capture time spent waiting for a free buffer
+    uint32_t copies;
+    uint32_t overruns;
+} run_result_t;
+
+static run_result_t run(int fb_count, int lent, int fps, size_t frame_len, int stalled, int stall_ms, int seconds)
+{
+    camera.fbs.assign(fb_count, std::vector<uint8_t>(frame_len, 0xA5));
+    camera.out.assign(fb_count, false);
+    static frame_hub_t hub;
+    frame_hub_init(&hub);
+    if (lent)
+    {
+        frame_hub_limit_pins(&hub, lent, copy_alloc, copy_release);
+    }
+
+    std::atomic<bool> stop(false);
+    std::atomic<uint32_t> fast_frames(0);
+    std::vector<std::thread> subs;
+    subs.emplace_back([&]() {
+        frame_sub_t *sub = frame_hub_subscribe(&hub);
+        while (!stop)
+        {
+            frame_ref_t *frame = frame_hub_take(&hub, sub, 100);
+            if (frame)
+            {
+                usleep(1000); // a fast link still takes a moment to send
+                frame_ref_release(frame);
+                fast_frames++;
+            }
+        }
+        frame_hub_unsubscribe(&hub, sub);
+    });
+    for (int i = 0; i < stalled; i++)
+    {
+        subs.emplace_back([&, i]() {
+            frame_sub_t *sub = frame_hub_subscribe(&hub);
+            // clients stall at different moments and so hold different frames
+            usleep(i * 1000LL * stall_ms / (stalled + 1));
+            while (!stop)
+            {
+                frame_ref_t *frame = frame_hub_take(&hub, sub, 100);
+                int64_t until = now_us() + stall_ms * 1000LL;
+                while (frame && !stop && now_us() < until)
+                {
+                    usleep(10000);
+                }
+                frame_ref_release(frame);
+            }
+            frame_hub_unsubscribe(&hub, sub);
+        });
+    }
+    while (frame_hub_subscriber_count(&hub) < stalled + 1)
+    {
+        usleep(1000);
+    }
+
+    int64_t period_us = 1000000 / fps;
+    int64_t start = now_us();
+    int64_t end = start + seconds * 1000000LL;
+    int64_t next = start;
+    int64_t waited = 0;
+    uint32_t frames = 0;
+    uint32_t fast_start = fast_frames;
+    while (now_us() < end)
+    {
+        int64_t t = now_us();
+        int fb = fb_get();
+        waited += now_us() - t;
+        // the sensor delivers at most one frame per period
+        next += period_us;
+        int64_t left = next - now_us();
+        if (left > 0)
+        {
+            usleep(left);
+        }
+        else
+        {
+            next = now_us();
+        }
+        frame_hub_publish(&hub, camera.fbs[fb].data(), frame_len, 640, 480, now_us(), (void *)(intptr_t)fb,
+                          fb_return);
+        frames++;
+    }
+    double elapsed = (now_us() - start) / 1e6;
+    run_result_t r;
+    r.capture_fps = frames / elapsed;
+    r.fast_fps = (fast_frames - fast_start) / elapsed;
+    r.stall_ms = waited / 1000.0;
+    frame_hub_stats_t stats = frame_hub_stats(&hub);
+    r.copies = stats.copies;
+    r.overruns = stats.overruns;
+    stop = true;
+    for (size_t i = 0; i < subs.size(); i++)
+    {
+        subs[i].join();
+    }
+    return r;
+}
+
+static std::vector<int> split_ints(const char *list)
+{
+    std::vector<int> out;
+    std::string s(list);
+    size_t start = 0;
+    while (start <= s.size())
+    {
+        size_t end = s.find(',', start);
+        if (end == std::string::npos)
+        {
+            end = s.size();
+        }
+        if (end > start)
+        {
+            out.push_back(atoi(s.substr(start, end - start).c_str()));
+        }
+        start = end + 1;
+    }
+    return out;
+}
+
+int main(int argc, char **argv)
+{
+    int fb_count = 3;
+    int lent = 1;
+    int fps = 25;
+    int frame_kb = 60;
+    int stall_ms = 2000;
+    int seconds = 3;
+    const char *stalled_list = "0,1,2,3";
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--fb-count") && i + 1 < argc)
+            fb_count = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--lent") && i + 1 < argc)
+            lent = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--fps") && i + 1 < argc)
+            fps = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--frame-kb") && i + 1 < argc)
+            frame_kb = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--stall-ms") && i + 1 < argc)
+            stall_ms = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--stalled") && i + 1 < argc)
+            stalled_list = argv[++i];
+        else if (!strcmp(argv[i], "--seconds") && i + 1 < argc)
+            seconds = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: %s [--fb-count N] [--lent N] [--fps N] [--frame-kb N] [--stall-ms N] "
+                            "[--stalled 0,1,2] [--seconds N]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (fb_count < 1 || lent < 1 || fps < 1 || frame_kb < 1 || seconds < 1)
+    {
+        fprintf(stderr, "bad option value\n");
+        return 2;
+    }
+
+    printf("%-8s %-5s %10s %9s %9s %7s %8s\n", "stalled", "lent", "capture/s", "fast/s", "wait ms", "copies",
+           "overruns");
+    bool pass = true;
+    std::vector<int> stalled = split_ints(stalled_list);
+    for (size_t i = 0; i < stalled.size(); i++)
+    {
+        for (int limit = 0; limit <= 1; limit++)
+        {
+            run_result_t r =
+                run(fb_count, limit ? lent : 0, fps, frame_kb * 1024, stalled[i], stall_ms, seconds);
+            char lent_col[8];
+            snprintf(lent_col, sizeof(lent_col), limit ? "%d" : "-", lent);
+            printf("%-8d %-5s %10.1f %9.1f %9.0f %7u %8u\n", stalled[i], lent_col, r.capture_fps, r.fast_fps,
+                   r.stall_ms, r.copies, r.overruns);
+            fflush(stdout);
+            if (limit && (r.capture_fps < fps * 0.9 || r.fast_fps < fps * 0.9))
+            {
+                pass = false;
+            }
+        }
+    }
+    printf("%s\n", pass ? "capture rate independent of stalled subscribers" : "FAIL: stalled subscribers slow capture");
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,254 @@
+/*
+ * Adaptive quality benchmark: drives quality_ctl.cpp on the host with a
+ * simulated link, the way adaptive_quality_tick() does on the camera.
+ *
+ *   g++ -std=gnu++11 -O2 -I.. quality_bench.cpp ../quality_ctl.cpp -o quality_bench
+ *   ./quality_bench [--trace 1500:30,150:60,1500:120] [--target 15] [--camera-fps 25]
+ *                   [--frame-kb 60] [--jitter 0.1] [--seed 1] [--max-flaps 1] [-v]
+ *
+ * --trace is a list of phases, link kB/s:seconds; the default is a good link,
+ * a step drop to a tenth and recovery. Every ADAPTIVE_PERIOD_MS the simulated
+ * viewer reports fps = min(camera fps, link / frame size), the frame size of
+ * the current rung (--frame-kb at the top rung, scaled by rel_size) and the
+ * send time the link gives it, each spread by up to +-jitter; after a change
+ * samples are skipped for ADAPTIVE_SETTLE_MS like on the camera.
+ *
+ * For every phase it prints the rung the controller settled on, how long that
+ * took, how many changes it made and how many upgrades it had to revert within
+ * QUALITY_CTL_REVERT_WINDOW_MS (flaps). Exits non-zero if a phase ends on a
+ * rung the link can't carry at the target fps, on a rung worse than the one
+ * the upgrade headroom allows, or with more than --max-flaps flaps.
+ */
+
+#include "quality_ctl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define ADAPTIVE_PERIOD_MS 500
+#define ADAPTIVE_SETTLE_MS 2000
+
+// Same rungs as quality_ladder in app_httpd.cpp, framesize_t values from esp_camera
+static const quality_step_t ladder[] = {
+    {9, 10, 1000}, // SVGA
+    {9, 15, 700},
+    {8, 12, 560}, // VGA
+    {8, 18, 400},
+    {6, 15, 170}, // CIF
+    {5, 15, 110}, // QVGA
+    {5, 25, 75},
+    {3, 25, 45}, // HQVGA
+};
+#define LADDER_STEPS (int)(sizeof(ladder) / sizeof(ladder[0]))
+
+static const char *framesize_name(uint8_t framesize)
+{
+    switch (framesize)
+    {
+    case 3:
+        return "HQVGA";
+    case 5:
+        return "QVGA";
+    case 6:
+        return "CIF";
+    case 8:
+        return "VGA";
+    case 9:
+        return "SVGA";
+    default:
+        return "?";
+    }
+}
+
+typedef struct
+{
+    float link_kbps; // kB/s
+    int seconds;
+} phase_t;
+
+// Deterministic noise so a run can be repeated
+static uint32_t rng_state = 1;
+
+static float jitter(float spread)
+{
+    rng_state = rng_state * 1103515245u + 12345u;
+    float unit = ((rng_state >> 8) & 0xFFFF) / 65535.0f; // 0..1
+    return 1.0f + spread * (unit * 2.0f - 1.0f);
+}
+
+static float frame_bytes(int step, float top_bytes)
+{
+    return top_bytes * ladder[step].rel_size / ladder[0].rel_size;
+}
+
+// Best rung the controller should reach on this link: an upgrade from s to
+// s - 1 needs the link to carry rung s - 1 at the target with the headroom
+static int expected_step(float link_bps, float top_bytes, float target_fps)
+{
+    for (int i = 0; i < LADDER_STEPS; i++)
+    {
+        if (link_bps >= frame_bytes(i, top_bytes) * target_fps * QUALITY_CTL_UPGRADE_HEADROOM)
+        {
+            return i;
+        }
+    }
+    return LADDER_STEPS - 1;
+}
+
+static std::vector<phase_t> parse_trace(const char *list)
+{
+    std::vector<phase_t> out;
+    std::string s(list);
+    size_t start = 0;
+    while (start < s.size())
+    {
+        size_t end = s.find(',', start);
+        if (end == std::string::npos)
+        {
+            end = s.size();
+        }
+        phase_t phase;
+        if (sscanf(s.substr(start, end - start).c_str(), "%f:%d", &phase.link_kbps, &phase.seconds) != 2 ||
+            phase.link_kbps <= 0.0f || phase.seconds <= 0)
+        {
+            out.clear();
+            return out;
+        }
+        out.push_back(phase);
+        start = end + 1;
+    }
+    return out;
+}
+
+int main(int argc, char **argv)
+{
+    const char *trace = "1500:30,150:60,1500:120";
+    float target = 15.0f;
+    float camera_fps = 25.0f;
+    float frame_kb = 60.0f;
+    float spread = 0.1f;
+    int max_flaps = 1;
+    bool verbose = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--trace") && i + 1 < argc)
+            trace = argv[++i];
+        else if (!strcmp(argv[i], "--target") && i + 1 < argc)
+            target = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--camera-fps") && i + 1 < argc)
+            camera_fps = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--frame-kb") && i + 1 < argc)
+            frame_kb = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--jitter") && i + 1 < argc)
+            spread = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+            rng_state = (uint32_t)strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "--max-flaps") && i + 1 < argc)
+            max_flaps = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-v"))
+            verbose = true;
+        else
+        {
+            fprintf(stderr, "usage: %s [--trace kBps:s,...] [--target FPS] [--camera-fps FPS] [--frame-kb N] "
+                            "[--jitter F] [--seed N] [--max-flaps N] [-v]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    std::vector<phase_t> phases = parse_trace(trace);
+    if (phases.empty() || target <= 0.0f || camera_fps <= 0.0f || frame_kb <= 0.0f || spread < 0.0f ||
+        spread >= 1.0f)
+    {
+        fprintf(stderr, "bad option value\n");
+        return 2;
+    }
+
+    quality_ctl_t ctl;
+    quality_ctl_init(&ctl, ladder, LADDER_STEPS, target, 0);
+    float top_bytes = frame_kb * 1024.0f;
+
+    printf("%-6s %8s %6s %-14s %-14s %9s %7s %5s\n", "phase", "link kB/s", "secs", "settled", "expected",
+           "settle ms", "changes", "flaps");
+    bool pass = true;
+    uint32_t now_ms = 0;
+    uint32_t settle_until = 0;
+    int last_dir = 0;
+    uint32_t last_up_ms = 0;
+    for (size_t p = 0; p < phases.size(); p++)
+    {
+        float link_bps = phases[p].link_kbps * 1024.0f;
+        uint32_t phase_start = now_ms;
+        uint32_t phase_end = now_ms + phases[p].seconds * 1000;
+        uint32_t last_change = phase_start;
+        uint32_t changes = 0;
+        int flaps = 0;
+        for (; now_ms < phase_end; now_ms += ADAPTIVE_PERIOD_MS)
+        {
+            if (now_ms < settle_until)
+            {
+                continue;
+            }
+            float bytes = frame_bytes(ctl.step, top_bytes) * jitter(spread);
+            float link = link_bps * jitter(spread);
+            quality_sample_t sample;
+            sample.now_ms = now_ms;
+            sample.fps = link / bytes < camera_fps ? link / bytes : camera_fps;
+            sample.frame_bytes = (uint32_t)bytes;
+            sample.send_us = (uint32_t)(bytes * 1000000.0f / link);
+            int before = ctl.step;
+            if (!quality_ctl_update(&ctl, &sample))
+            {
+                continue;
+            }
+            int dir = ctl.step < before ? 1 : -1;
+            if (dir < 0 && last_dir > 0 && now_ms - last_up_ms < QUALITY_CTL_REVERT_WINDOW_MS)
+            {
+                flaps++;
+            }
+            if (dir > 0)
+            {
+                last_up_ms = now_ms;
+            }
+            last_dir = dir;
+            changes++;
+            last_change = now_ms;
+            settle_until = now_ms + ADAPTIVE_SETTLE_MS;
+            if (verbose)
+            {
+                printf("  %7.1fs %5.1f fps -> step %d %s q%u\n", now_ms / 1000.0f, sample.fps, ctl.step,
+                       framesize_name(ladder[ctl.step].framesize), ladder[ctl.step].quality);
+            }
+        }
+
+        int expected = expected_step(link_bps, top_bytes, target);
+        const quality_step_t *step = quality_ctl_current(&ctl);
+        char settled[24];
+        char wanted[24];
+        snprintf(settled, sizeof(settled), "%d %s q%u", ctl.step, framesize_name(step->framesize), step->quality);
+        snprintf(wanted, sizeof(wanted), "%d %s q%u", expected, framesize_name(ladder[expected].framesize),
+                 ladder[expected].quality);
+        printf("%-6zu %8.0f %6d %-14s %-14s %9u %7u %5d\n", p, phases[p].link_kbps, phases[p].seconds, settled,
+               wanted, changes ? last_change - phase_start : 0, changes, flaps);
+
+        bool carried = link_bps >= frame_bytes(ctl.step, top_bytes) * target;
+        if (!carried)
+        {
+            printf("FAIL: phase %zu ends on a rung the link can't carry at %.0f fps\n", p, target);
+            pass = false;
+        }
+        if (ctl.step > expected)
+        {
+            printf("FAIL: phase %zu ends below the best rung with upgrade headroom\n", p);
+            pass = false;
+        }
+        if (flaps > max_flaps)
+        {
+            printf("FAIL: phase %zu reverted %d upgrades\n", p, flaps);
+            pass = false;
+        }
+    }
+    printf("%s\n", pass ? "controller settles without flapping" : "FAIL");
+    return pass ? 0 : 1;
+}
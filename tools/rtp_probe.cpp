@@ -0,0 +1,259 @@
+/*
+ * Host-side RTP/JPEG probe.
+ *
+ *   g++ -std=gnu++11 -O2 -I.. rtp_probe.cpp ../rtp_jpeg.cpp -o rtp_probe
+ *
+ * Receive (from the car: GET /api/rtp?port=5004, or from --send below):
+ *   ./rtp_probe --listen 5004
+ * prints frames/s, complete vs. broken frames, packet loss and RFC 3550
+ * interarrival jitter once a second.
+ *
+ * Send a JPEG in a loop through the same packetizer the firmware uses:
+ *   ./rtp_probe --send frame.jpg --to 127.0.0.1:5004 --fps 15 [--drop 0.02]
+ */
+
+#include "rtp_jpeg.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+typedef struct
+{
+    int sock;
+    struct sockaddr_in dest;
+    double drop;
+} send_ctx_t;
+
+static bool send_packet(void *arg, const uint8_t *header, size_t header_len, const uint8_t *payload, size_t payload_len)
+{
+    send_ctx_t *ctx = (send_ctx_t *)arg;
+    if (ctx->drop > 0.0 && drand48() < ctx->drop)
+    {
+        return true; // simulated loss on the air
+    }
+    struct iovec iov[2] = {{(void *)header, header_len}, {(void *)payload, payload_len}};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &ctx->dest;
+    msg.msg_namelen = sizeof(ctx->dest);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    return sendmsg(ctx->sock, &msg, 0) >= 0;
+}
+
+static int run_sender(const char *path, const char *to, int fps, double drop)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        perror(path);
+        return 1;
+    }
+    std::vector<uint8_t> jpg;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    {
+        jpg.insert(jpg.end(), chunk, chunk + n);
+    }
+    fclose(f);
+
+    rtp_jpeg_info_t info;
+    if (!rtp_jpeg_parse(jpg.data(), jpg.size(), &info))
+    {
+        fprintf(stderr, "%s: not a baseline 4:2:x JPEG RFC 2435 can carry\n", path);
+        return 1;
+    }
+    printf("%ux%u type %u, %zu scan bytes\n", info.width, info.height, info.type, info.scan_len);
+
+    send_ctx_t ctx;
+    ctx.sock = socket(AF_INET, SOCK_DGRAM, 0);
+    ctx.drop = drop;
+    memset(&ctx.dest, 0, sizeof(ctx.dest));
+    ctx.dest.sin_family = AF_INET;
+    char host[64];
+    snprintf(host, sizeof(host), "%s", to);
+    char *colon = strchr(host, ':');
+    if (colon)
+    {
+        *colon = 0;
+    }
+    if (!colon || inet_pton(AF_INET, host, &ctx.dest.sin_addr) != 1)
+    {
+        fprintf(stderr, "bad --to %s, expected HOST:PORT\n", to);
+        return 1;
+    }
+    ctx.dest.sin_port = htons(atoi(colon + 1));
+
+    rtp_jpeg_session_t session;
+    rtp_jpeg_session_init(&session, 0x45535033, 0);
+    int64_t period = 1000000 / fps;
+    int64_t next = now_us();
+    while (true)
+    {
+        rtp_jpeg_send_frame(&session, &info, (uint32_t)(next * RTP_JPEG_CLOCK_HZ / 1000000), send_packet, &ctx);
+        next += period;
+        int64_t wait = next - now_us();
+        if (wait > 0)
+        {
+            usleep(wait);
+        }
+    }
+    return 0;
+}
+
+static int run_receiver(int port)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        perror("bind");
+        return 1;
+    }
+    struct timeval tv = {1, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    uint8_t pkt[2048];
+    bool started = false;
+    uint16_t expected_seq = 0;
+    uint32_t cur_ts = 0;
+    bool frame_ok = false;
+    double jitter = 0.0; // RTP clock units
+    int64_t last_transit = 0;
+    bool have_transit = false;
+    uint64_t received = 0, lost = 0, frames = 0, broken = 0, bytes = 0;
+    uint64_t win_received = 0, win_lost = 0, win_frames = 0, win_broken = 0;
+    int64_t report = now_us() + 1000000;
+
+    printf("listening on udp/%d\n", port);
+    while (true)
+    {
+        ssize_t n = recv(sock, pkt, sizeof(pkt), 0);
+        int64_t now = now_us();
+        if (n >= RTP_HEADER_LEN + 8 && (pkt[0] >> 6) == 2 && (pkt[1] & 0x7F) == RTP_JPEG_PAYLOAD_TYPE)
+        {
+            uint16_t seq = (pkt[2] << 8) | pkt[3];
+            uint32_t ts = ((uint32_t)pkt[4] << 24) | (pkt[5] << 16) | (pkt[6] << 8) | pkt[7];
+            bool marker = pkt[1] & 0x80;
+            uint32_t offset = (pkt[13] << 16) | (pkt[14] << 8) | pkt[15];
+
+            if (started && seq != expected_seq)
+            {
+                uint16_t gap = seq - expected_seq;
+                if (gap < 0x8000)
+                {
+                    lost += gap;
+                    win_lost += gap;
+                    frame_ok = false;
+                }
+            }
+            started = true;
+            expected_seq = seq + 1;
+            received++;
+            win_received++;
+            bytes += n;
+
+            if (offset == 0 || ts != cur_ts)
+            {
+                cur_ts = ts;
+                frame_ok = offset == 0;
+            }
+            if (marker)
+            {
+                if (frame_ok)
+                {
+                    frames++;
+                    win_frames++;
+                }
+                else
+                {
+                    broken++;
+                    win_broken++;
+                }
+                frame_ok = false;
+            }
+
+            // RFC 3550 A.8
+            int64_t arrival = now * RTP_JPEG_CLOCK_HZ / 1000000;
+            int64_t transit = arrival - (int64_t)ts;
+            if (have_transit)
+            {
+                int64_t d = transit - last_transit;
+                if (d < 0)
+                {
+                    d = -d;
+                }
+                jitter += ((double)d - jitter) / 16.0;
+            }
+            last_transit = transit;
+            have_transit = true;
+        }
+        if (now >= report)
+        {
+            double loss = win_received + win_lost ? 100.0 * win_lost / (win_received + win_lost) : 0.0;
+            printf("%3llu fps  %3llu broken  loss %5.2f%%  jitter %6.2f ms  | total %llu frames, %llu broken, %llu lost, %.1f MB\n",
+                   (unsigned long long)win_frames, (unsigned long long)win_broken, loss, jitter * 1000.0 / RTP_JPEG_CLOCK_HZ,
+                   (unsigned long long)frames, (unsigned long long)broken, (unsigned long long)lost, bytes / 1e6);
+            fflush(stdout);
+            win_received = win_lost = win_frames = win_broken = 0;
+            report = now + 1000000;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *send_path = NULL;
+    const char *to = "127.0.0.1:5004";
+    int listen_port = 0;
+    int fps = 15;
+    double drop = 0.0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--listen") && i + 1 < argc)
+            listen_port = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--send") && i + 1 < argc)
+            send_path = argv[++i];
+        else if (!strcmp(argv[i], "--to") && i + 1 < argc)
+            to = argv[++i];
+        else if (!strcmp(argv[i], "--fps") && i + 1 < argc)
+            fps = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--drop") && i + 1 < argc)
+            drop = atof(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: %s --listen PORT | --send FILE.jpg [--to HOST:PORT] [--fps N] [--drop P]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (send_path)
+    {
+        return run_sender(send_path, to, fps > 0 ? fps : 15, drop);
+    }
+    if (listen_port)
+    {
+        return run_receiver(listen_port);
+    }
+    fprintf(stderr, "nothing to do, see --listen / --send\n");
+    return 2;
+}